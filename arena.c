@@ -0,0 +1,336 @@
+/**
+ * @file
+ *
+ * arena
+ *
+ * per-command scratch memory and the debug allocation tracker
+ */
+
+#define ARENA_INTERNAL
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "session.h"
+
+//one block of arena memory; allocations are carved off the front
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+    alignas(max_align_t) char data[];
+};
+
+struct arena {
+    struct arena_chunk *chunks; //newest first
+    size_t bytes; //handed out since the last reset
+    size_t high_water; //most bytes any one command needed
+};
+
+static size_t peak_bytes; //most bytes any one command of any session needed
+
+//the arena of the session running on this thread, made on first use
+static struct arena *current_arena(void)
+{
+    struct session *session = session_current();
+    if (session->arena == NULL) {
+        session->arena = calloc(1, sizeof(struct arena));
+    }
+    return session->arena;
+}
+
+//allocate size bytes that stay valid until the next arena_reset()
+void *arena_alloc(size_t size)
+{
+    struct arena *a = current_arena();
+    if (a == NULL) {
+        return NULL;
+    }
+    size = (size + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+    struct arena_chunk *chunk = a->chunks;
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        size_t chunk_size = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+        chunk = malloc(sizeof(struct arena_chunk) + chunk_size);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        chunk->next = a->chunks;
+        a->chunks = chunk;
+    }
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    a->bytes += size;
+    return ptr;
+}
+
+char *arena_strndup(const char *str, size_t len)
+{
+    len = strnlen(str, len);
+    char *copy = arena_alloc(len + 1);
+    if (copy != NULL) {
+        memcpy(copy, str, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+char *arena_strdup(const char *str)
+{
+    return arena_strndup(str, SIZE_MAX);
+}
+
+/**
+ * Release everything allocated since the last reset. One regular chunk is
+ * kept for the next command, so a steady stream of commands costs no mallocs
+ * at all; oversized chunks and any extra growth go back to the heap.
+ */
+void arena_reset(void)
+{
+    struct session *session = session_current();
+    struct arena *a = session->arena;
+    if (a == NULL) {
+        return;
+    }
+    struct arena_chunk *kept = NULL;
+    struct arena_chunk *chunk = a->chunks;
+    while (chunk != NULL) {
+        struct arena_chunk *next = chunk->next;
+        if (kept == NULL && chunk->size == ARENA_CHUNK) {
+            kept = chunk;
+            kept->used = 0;
+            kept->next = NULL;
+        } else {
+            free(chunk);
+        }
+        chunk = next;
+    }
+    a->chunks = kept;
+    if (a->bytes > a->high_water) {
+        a->high_water = a->bytes;
+    }
+    size_t peak = __atomic_load_n(&peak_bytes, __ATOMIC_RELAXED);
+    while (a->bytes > peak && !__atomic_compare_exchange_n(&peak_bytes, &peak, a->bytes,
+                true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    a->bytes = 0;
+}
+
+//free the current session's arena
+void arena_destroy(void)
+{
+    struct session *session = session_current();
+    if (session->arena == NULL) {
+        return;
+    }
+    arena_reset();
+    free(session->arena->chunks);
+    free(session->arena);
+    session->arena = NULL;
+}
+
+/**
+ * The most arena memory a single command has used, in any session of the
+ * process and including the command running now. Kept after the arenas are
+ * freed, so it can still be reported at exit.
+ */
+size_t arena_high_water(void)
+{
+    size_t peak = __atomic_load_n(&peak_bytes, __ATOMIC_RELAXED);
+    struct arena *a = session_current()->arena;
+    return a != NULL && a->bytes > peak ? a->bytes : peak;
+}
+
+
+/* Debug allocation tracking: an open addressing table from address to the
+ * call site that allocated it, shared by every thread */
+
+#define TRACK_SLOTS (1 << 20) //the most allocations tracked at once
+
+#define TRACK_TOMBSTONE ((void *) 1) //a slot whose allocation was freed
+
+#define REPORT_SITES 20 //call sites listed at exit
+
+struct tracked {
+    void *ptr;
+    const char *file;
+    int line;
+    size_t size;
+};
+
+//the allocations made at one place in the source
+struct site {
+    const char *file;
+    int line;
+    size_t count;
+    size_t bytes;
+};
+
+static struct tracked *tracked;
+
+static pthread_mutex_t track_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_once_t track_once = PTHREAD_ONCE_INIT;
+
+static pid_t track_pid; //forked children don't report
+
+static size_t slot_of(const void *ptr)
+{
+    uintptr_t key = (uintptr_t) ptr;
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return key & (TRACK_SLOTS - 1);
+}
+
+static int compare_sites(const void *a, const void *b)
+{
+    const struct site *x = a;
+    const struct site *y = b;
+    return (y->bytes > x->bytes) - (y->bytes < x->bytes);
+}
+
+//print the allocations still live, grouped by call site, biggest first
+static void report_live(void)
+{
+    if (getpid() != track_pid) {
+        return;
+    }
+    pthread_mutex_lock(&track_lock);
+    struct site *sites = calloc(TRACK_SLOTS, sizeof(struct site));
+    size_t site_count = 0;
+    size_t live = 0;
+    size_t bytes = 0;
+    for (size_t i = 0; sites != NULL && i < TRACK_SLOTS; i++) {
+        struct tracked *t = &tracked[i];
+        if (t->ptr == NULL || t->ptr == TRACK_TOMBSTONE) {
+            continue;
+        }
+        live++;
+        bytes += t->size;
+        size_t j;
+        for (j = 0; j < site_count; j++) {
+            if (sites[j].line == t->line && strcmp(sites[j].file, t->file) == 0) {
+                break;
+            }
+        }
+        if (j == site_count) {
+            sites[site_count++] = (struct site) { .file = t->file, .line = t->line };
+        }
+        sites[j].count++;
+        sites[j].bytes += t->size;
+    }
+    if (sites != NULL) {
+        qsort(sites, site_count, sizeof(struct site), compare_sites);
+    }
+    fprintf(stderr, "alloc: %zu live allocations, %zu bytes, at exit\n", live, bytes);
+    for (size_t i = 0; i < site_count && i < REPORT_SITES; i++) {
+        fprintf(stderr, "alloc: %10zu bytes in %6zu allocations from %s:%d\n",
+                sites[i].bytes, sites[i].count, sites[i].file, sites[i].line);
+    }
+    free(sites);
+    pthread_mutex_unlock(&track_lock);
+}
+
+static void track_init(void)
+{
+    tracked = calloc(TRACK_SLOTS, sizeof(struct tracked));
+    track_pid = getpid();
+    atexit(report_live);
+}
+
+static void track(void *ptr, size_t size, const char *file, int line)
+{
+    pthread_once(&track_once, track_init);
+    if (ptr == NULL || tracked == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&track_lock);
+    size_t slot = slot_of(ptr);
+    size_t free_slot = SIZE_MAX;
+    for (size_t probes = 0; probes < TRACK_SLOTS; probes++) {
+        struct tracked *t = &tracked[slot];
+        if (t->ptr == ptr || t->ptr == NULL) {
+            /* A reused address replaces an entry whose free we never saw */
+            if (t->ptr == NULL && free_slot != SIZE_MAX) {
+                t = &tracked[free_slot];
+            }
+            *t = (struct tracked) { .ptr = ptr, .file = file, .line = line, .size = size };
+            break;
+        } else if (t->ptr == TRACK_TOMBSTONE && free_slot == SIZE_MAX) {
+            free_slot = slot;
+        }
+        slot = (slot + 1) & (TRACK_SLOTS - 1);
+    }
+    pthread_mutex_unlock(&track_lock);
+}
+
+//stop tracking ptr, which is about to be freed or handed to a library
+void debug_forget(void *ptr)
+{
+    if (ptr == NULL || tracked == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&track_lock);
+    size_t slot = slot_of(ptr);
+    for (size_t probes = 0; probes < TRACK_SLOTS && tracked[slot].ptr != NULL; probes++) {
+        if (tracked[slot].ptr == ptr) {
+            tracked[slot].ptr = TRACK_TOMBSTONE;
+            break;
+        }
+        slot = (slot + 1) & (TRACK_SLOTS - 1);
+    }
+    pthread_mutex_unlock(&track_lock);
+}
+
+void *debug_malloc(size_t size, const char *file, int line)
+{
+    void *ptr = malloc(size);
+    track(ptr, size, file, line);
+    return ptr;
+}
+
+void *debug_calloc(size_t count, size_t size, const char *file, int line)
+{
+    void *ptr = calloc(count, size);
+    track(ptr, count * size, file, line);
+    return ptr;
+}
+
+void *debug_realloc(void *old, size_t size, const char *file, int line)
+{
+    uintptr_t was = (uintptr_t) old; //only compared, never dereferenced
+    void *ptr = realloc(old, size);
+    if (ptr != NULL) {
+        debug_forget((void *) was);
+        track(ptr, size, file, line);
+    }
+    return ptr;
+}
+
+char *debug_strdup(const char *str, const char *file, int line)
+{
+    char *copy = strdup(str);
+    track(copy, strlen(str) + 1, file, line);
+    return copy;
+}
+
+char *debug_strndup(const char *str, size_t len, const char *file, int line)
+{
+    char *copy = strndup(str, len);
+    track(copy, copy != NULL ? strlen(copy) + 1 : 0, file, line);
+    return copy;
+}
+
+void debug_free(void *ptr)
+{
+    debug_forget(ptr);
+    free(ptr);
+}
@@ -0,0 +1,66 @@
+/**
+ * @file
+ *
+ * ARENA
+ * Scratch memory for the lifetime of one command: the prompt, the parsed
+ * arguments, completion candidates and the like are bump-allocated from the
+ * current session's arena and all released at once by arena_reset() when the
+ * command is done, instead of each being malloc'd and freed (or forgotten).
+ * Nothing that outlives the command, such as history or the job table, may
+ * come from here.
+ *
+ * Building with ALLOC_DEBUG=1 also tracks every malloc, calloc, realloc,
+ * strdup and strndup made by a file that includes this header, and prints
+ * the allocations still live at exit grouped by call site.
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef ALLOC_DEBUG
+#define ALLOC_DEBUG 0
+#endif
+
+#define ARENA_CHUNK (64 * 1024) //bytes the arena grows by, and keeps between commands
+
+struct arena;
+
+void *arena_alloc(size_t);
+char *arena_strdup(const char *);
+char *arena_strndup(const char *, size_t);
+void arena_reset(void);
+void arena_destroy(void);
+size_t arena_high_water(void);
+
+void *debug_malloc(size_t, const char *, int);
+void *debug_calloc(size_t, size_t, const char *, int);
+void *debug_realloc(void *, size_t, const char *, int);
+char *debug_strdup(const char *, const char *, int);
+char *debug_strndup(const char *, size_t, const char *, int);
+void debug_free(void *);
+void debug_forget(void *);
+
+#if ALLOC_DEBUG && !defined(ARENA_INTERNAL)
+#define malloc(size) debug_malloc((size), __FILE__, __LINE__)
+#define calloc(count, size) debug_calloc((count), (size), __FILE__, __LINE__)
+#define realloc(ptr, size) debug_realloc((ptr), (size), __FILE__, __LINE__)
+#define strdup(str) debug_strdup((str), __FILE__, __LINE__)
+#define strndup(str, len) debug_strndup((str), (len), __FILE__, __LINE__)
+#define free(ptr) debug_free(ptr)
+#endif
+
+/**
+ * Memory handed to a library that frees it itself (readline's completion
+ * matches, for instance) would otherwise be reported as live.
+ */
+#if ALLOC_DEBUG
+#define ALLOC_FORGET(ptr) debug_forget(ptr)
+#else
+#define ALLOC_FORGET(ptr) ((void) (ptr))
+#endif
+
+#endif
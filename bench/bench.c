@@ -0,0 +1,397 @@
+/**
+ * @file
+ *
+ * bench
+ *
+ * micro and end-to-end benchmarks for swish. Each result is printed as one
+ * JSON object per line so runs can be collected and compared across versions.
+ *
+ * Usage: bench [filter]    (only run benchmarks whose name contains filter)
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../arena.h"
+#include "../fuzzy.h"
+#include "../history.h"
+#include "../pathindex.h"
+#include "../shell.h"
+#include "../ui.h"
+#include "../zygote.h"
+
+#define MIN_RUNTIME_NS 200000000LL //run each micro benchmark at least this long
+
+#define SYNTHETIC_DIRS 4
+
+#define SYNTHETIC_PER_DIR 2500
+
+#define SPAWN_BALLAST_MB 512 //heap the shell carries for the second spawn round
+
+static const char *filter; //only run benchmarks matching this
+
+static char synthetic_path[256]; //PATH made up of synthetic executables
+
+static char synthetic_base[] = "/tmp/swish-bench-XXXXXX"; //holds the PATH
+
+static char *swish_bin = "./swish"; //the shell binary for end-to-end runs
+
+static long long now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static bool selected(const char *name)
+{
+    return filter == NULL || strstr(name, filter) != NULL;
+}
+
+//run op in growing batches until enough time has passed, then report ns/op
+static void run_micro(const char *name, void (*op)(void))
+{
+    if (!selected(name)) {
+        return;
+    }
+    long long iterations = 1;
+    long long elapsed = 0;
+    while (true) {
+        long long start = now_ns();
+        for (long long i = 0; i < iterations; i++) {
+            op();
+        }
+        elapsed = now_ns() - start;
+        if (elapsed >= MIN_RUNTIME_NS) {
+            break;
+        }
+        iterations *= elapsed < MIN_RUNTIME_NS / 10 ? 10 : 2;
+    }
+    printf("{\"bench\":\"%s\",\"iterations\":%lld,\"ns_per_op\":%.1f}\n",
+            name, iterations, (double) elapsed / iterations);
+    fflush(stdout);
+}
+
+static char oldest_prefix[32]; //matches only the oldest entry once filled
+
+//fill the history with distinct commands
+static void fill_history(void)
+{
+    char buf[64];
+    for (unsigned int i = 0; i < hist_get_limit() + 1; i++) {
+        snprintf(buf, sizeof(buf), "command%u --flag %u", i, i);
+        hist_add(buf);
+    }
+    /* Command numbers count the hist_add run too, so ask for the text */
+    char *oldest = (char *) hist_search_cnum(hist_bottom_cnum());
+    snprintf(oldest_prefix, sizeof(oldest_prefix), "%.*s", (int) strcspn(oldest, " ") + 1,
+            oldest);
+    free(oldest);
+}
+
+static void op_hist_add(void)
+{
+    hist_add("make -j8 all");
+}
+
+static void op_hist_search_prefix(void)
+{
+    /* The oldest entry is the worst case for a newest-first search */
+    const char *found = hist_search_prefix(oldest_prefix);
+    if (found == NULL) {
+        fprintf(stderr, "hist_search_prefix: no match for \"%s\"\n", oldest_prefix);
+        exit(1);
+    }
+    free((char *) found);
+}
+
+static void op_hist_search_prefix_index(void)
+{
+    struct index_navigator nav = hist_search_prefix_index("nomatch", hist_size() - 1, true);
+    (void) nav;
+}
+
+static void op_hist_search_cnum(void)
+{
+    free((char *) hist_search_cnum(hist_bottom_cnum()));
+}
+
+static void op_hist_suggest(void)
+{
+    /* Alternate prefixes so the incremental cache can't answer everything */
+    static int flip;
+    hist_suggest((flip++ & 1) ? "command1" : "command4");
+}
+
+static void op_next_token(void)
+{
+    char line[] = "ls -la --color=auto /usr/bin /usr/local/bin | grep -v foo > out.txt";
+    char *next_tok = line;
+    while (next_token(&next_tok, " \t\r\n") != NULL) {
+    }
+}
+
+static void op_command_generator(void)
+{
+    char *match;
+    for (int state = 0; (match = command_generator("syn1", state)) != NULL; state++) {
+        free(match);
+    }
+}
+
+static const char **fuzzy_candidates;
+
+static uint64_t *fuzzy_masks;
+
+static size_t fuzzy_count;
+
+static void op_fuzzy_rank(void)
+{
+    struct fuzzy_match top[64];
+    fuzzy_rank("sy12", fuzzy_candidates, fuzzy_masks, fuzzy_count, NULL, top, 64);
+}
+
+static void op_prompt_line(void)
+{
+    /* The prompt lives in the session arena, as it does between commands */
+    prompt_line();
+    arena_reset();
+}
+
+//build SYNTHETIC_DIRS directories full of executables and point PATH at them
+static void make_synthetic_path(void)
+{
+    char *base = synthetic_base;
+    if (mkdtemp(base) == NULL) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    synthetic_path[0] = '\0';
+    char path[512];
+    for (int d = 0; d < SYNTHETIC_DIRS; d++) {
+        snprintf(path, sizeof(path), "%s/bin%d", base, d);
+        mkdir(path, 0755);
+        strcat(synthetic_path, d == 0 ? "" : ":");
+        strcat(synthetic_path, path);
+        for (int i = 0; i < SYNTHETIC_PER_DIR; i++) {
+            snprintf(path, sizeof(path), "%s/bin%d/syn%d_%d", base, d, i, d);
+            int fd = open(path, O_WRONLY | O_CREAT, 0755);
+            close(fd);
+        }
+    }
+    setenv("PATH", synthetic_path, 1);
+
+    /* Keep the index cache of the synthetic PATH away from the real one */
+    setenv("XDG_CACHE_HOME", base, 1);
+}
+
+static int remove_entry(const char *path, const struct stat *stats, int type,
+        struct FTW *ftw)
+{
+    return remove(path);
+}
+
+//run swish with arg (and arg2 if not NULL), discarding output; returns wall time in ns
+static long long run_shell(const char *arg, const char *arg2)
+{
+    long long start = now_ns();
+    pid_t child = fork();
+    if (child == 0) {
+        int null_fd = open("/dev/null", O_RDWR);
+        dup2(null_fd, STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        execl(swish_bin, swish_bin, arg, arg2, (char *) NULL);
+        _exit(127);
+    }
+    int status;
+    waitpid(child, &status, 0);
+    return now_ns() - start;
+}
+
+//run the shell in script mode on a script and return the wall time in nanoseconds
+static long long run_script(const char *script)
+{
+    char script_file[] = "/tmp/swish-bench-script-XXXXXX";
+    int fd = mkstemp(script_file);
+    write(fd, script, strlen(script));
+    close(fd);
+
+    long long elapsed = run_shell(script_file, NULL);
+    unlink(script_file);
+    return elapsed;
+}
+
+//commands per second when swish runs a script of nothing but command
+static void script_commands(const char *name, const char *command)
+{
+    if (!selected(name)) {
+        return;
+    }
+    int commands = 2000;
+    char *script = malloc(commands * (strlen(command) + 1) + 1);
+    char *end = script;
+    for (int i = 0; i < commands; i++) {
+        end = stpcpy(stpcpy(end, command), "\n");
+    }
+
+    long long elapsed = run_script(script);
+    printf("{\"bench\":\"%s\",\"commands\":%d,\"ops_per_sec\":%.1f}\n",
+            name, commands, commands / (elapsed / 1e9));
+    fflush(stdout);
+    free(script);
+}
+
+/**
+ * Commands per second in script mode, for a program the shell forks and
+ * execs and for the same command run in process by the fast path.
+ */
+static void bench_script_commands(void)
+{
+    script_commands("e2e_script_commands", "/bin/true");
+    script_commands("e2e_script_fastpath_commands", "true");
+}
+
+//time from starting swish -c to its command exiting: what make pays per recipe line
+static void bench_startup(void)
+{
+    const char *name = "e2e_startup_c";
+    if (!selected(name)) {
+        return;
+    }
+    int runs = 500;
+    long long elapsed = 0;
+    for (int i = 0; i < runs; i++) {
+        elapsed += run_shell("-c", "/bin/true");
+    }
+    printf("{\"bench\":\"%s\",\"runs\":%d,\"us_per_run\":%.1f}\n",
+            name, runs, elapsed / 1e3 / runs);
+    fflush(stdout);
+}
+
+//bytes per second through a three stage pipeline run by swish
+static void bench_pipeline_throughput(void)
+{
+    const char *name = "e2e_pipeline_throughput";
+    if (!selected(name)) {
+        return;
+    }
+    long long bytes = 1LL << 30;
+    char script[256];
+    snprintf(script, sizeof(script),
+            "head -c %lld /dev/zero | cat | cat > /dev/null\n", bytes);
+
+    long long elapsed = run_script(script);
+    printf("{\"bench\":\"%s\",\"bytes\":%lld,\"mb_per_sec\":%.1f}\n",
+            name, bytes, bytes / (elapsed / 1e9) / (1 << 20));
+    fflush(stdout);
+}
+
+static void op_spawn_fork(void)
+{
+    pid_t child = fork();
+    if (child == 0) {
+        execlp("true", "true", (char *) NULL);
+        _exit(1);
+    }
+    waitpid(child, NULL, 0);
+}
+
+static void op_spawn_zygote(void)
+{
+    char *args[] = { "true", NULL };
+    pid_t child = zygote_spawn(args);
+    if (child == -1) {
+        fprintf(stderr, "spawn_zygote: no zygote\n");
+        exit(1);
+    }
+    waitpid(child, NULL, 0);
+}
+
+/**
+ * Launch true with fork() and through the zygote, first as we are and again
+ * after touching a large heap, to show how launch cost follows the size of
+ * the launching process.
+ */
+static void bench_spawn(void)
+{
+    if (!selected("spawn")) {
+        return;
+    }
+    run_micro("spawn_fork", op_spawn_fork);
+    run_micro("spawn_zygote", op_spawn_zygote);
+
+    size_t size = (size_t) SPAWN_BALLAST_MB << 20;
+    char *ballast = malloc(size);
+    memset(ballast, 1, size);
+    run_micro("spawn_fork_ballast", op_spawn_fork);
+    run_micro("spawn_zygote_ballast", op_spawn_zygote);
+    free(ballast);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1) {
+        filter = argv[1];
+    }
+    char *bin = getenv("SWISH");
+    if (bin != NULL) {
+        swish_bin = bin;
+    }
+
+    zygote_start();
+    hist_init(100);
+    run_micro("hist_add", op_hist_add);
+    fill_history();
+    run_micro("hist_search_prefix", op_hist_search_prefix);
+    run_micro("hist_search_prefix_index", op_hist_search_prefix_index);
+    run_micro("hist_search_cnum", op_hist_search_cnum);
+    run_micro("hist_suggest", op_hist_suggest);
+    run_micro("next_token", op_next_token);
+    run_micro("prompt_line", op_prompt_line);
+
+    if (selected("command_generator") || selected("fuzzy_rank")) {
+        char *path = strdup(getenv("PATH"));
+        char *cache_home = getenv("XDG_CACHE_HOME");
+        cache_home = cache_home != NULL ? strdup(cache_home) : NULL;
+        make_synthetic_path();
+        run_micro("command_generator_scan", op_command_generator);
+
+        pathindex_start();
+        while (pathindex_get() == NULL) {
+            usleep(1000);
+        }
+        run_micro("command_generator_index", op_command_generator);
+
+        const struct path_index *index = pathindex_get();
+        fuzzy_candidates = (const char **) index->names;
+        fuzzy_masks = index->masks;
+        fuzzy_count = index->count;
+        run_micro("fuzzy_rank", op_fuzzy_rank);
+
+        setenv("PATH", path, 1);
+        if (cache_home != NULL) {
+            setenv("XDG_CACHE_HOME", cache_home, 1);
+        } else {
+            unsetenv("XDG_CACHE_HOME");
+        }
+        free(path);
+        free(cache_home);
+        nftw(synthetic_base, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    }
+
+    bench_spawn();
+    bench_startup();
+    bench_script_commands();
+    bench_pipeline_throughput();
+    return 0;
+}
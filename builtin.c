@@ -0,0 +1,204 @@
+/**
+ * @file
+ *
+ * builtin
+ *
+ * the builtin registry and the loader for builtins in shared libraries
+ */
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "builtin.h"
+#include "fastpath.h"
+#include "logger.h"
+#include "shell.h"
+
+static struct builtin entries[BUILTIN_MAX]; //in the order they were registered
+
+static char *loaded_from[BUILTIN_MAX]; //the library of each loaded builtin
+
+static size_t entry_count;
+
+static int slots[BUILTIN_SLOTS]; //index into entries plus one, 0 if empty
+
+/* Sessions on other threads may look builtins up while one is loaded */
+static pthread_rwlock_t registry_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static pthread_once_t registry_once = PTHREAD_ONCE_INIT;
+
+//FNV-1a hash of a builtin name
+static size_t name_hash(const char *name)
+{
+    size_t hash = 14695981039346656037ULL;
+    for (const unsigned char *c = (const unsigned char *) name; *c != '\0'; c++) {
+        hash ^= *c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+//the slot that holds name, or the empty slot it would go in
+static int *slot_of(const char *name)
+{
+    size_t i = name_hash(name) & (BUILTIN_SLOTS - 1);
+    while (slots[i] != 0 && strcmp(entries[slots[i] - 1].name, name) != 0) {
+        i = (i + 1) & (BUILTIN_SLOTS - 1);
+    }
+    return &slots[i];
+}
+
+//add or replace a builtin; the registry lock must be held for writing
+static int add(const struct builtin *builtin, const char *path)
+{
+    int *slot = slot_of(builtin->name);
+    size_t index;
+    if (*slot != 0) {
+        index = *slot - 1;
+    } else if (entry_count < BUILTIN_MAX) {
+        index = entry_count++;
+        *slot = index + 1;
+    } else {
+        return -1;
+    }
+    entries[index] = *builtin;
+    free(loaded_from[index]);
+    loaded_from[index] = path != NULL ? strdup(path) : NULL;
+    return 0;
+}
+
+static void register_shell_builtins(void)
+{
+    for (size_t i = 0; i < shell_builtin_count; i++) {
+        add(&shell_builtins[i], NULL);
+    }
+    for (size_t i = 0; i < fastpath_builtin_count; i++) {
+        add(&fastpath_builtins[i], NULL);
+    }
+}
+
+/**
+ * Find the enabled builtin called name, copying it to builtin. Returns -1 if
+ * there is none, so name should be run as a program.
+ */
+int builtin_find(const char *name, struct builtin *builtin)
+{
+    pthread_once(&registry_once, register_shell_builtins);
+    pthread_rwlock_rdlock(&registry_lock);
+    int slot = *slot_of(name);
+    bool found = slot != 0 && !(entries[slot - 1].flags & BUILTIN_DISABLED);
+    if (found) {
+        *builtin = entries[slot - 1];
+    }
+    pthread_rwlock_unlock(&registry_lock);
+    return found ? 0 : -1;
+}
+
+//number of builtins registered, disabled ones included
+size_t builtin_count(void)
+{
+    pthread_once(&registry_once, register_shell_builtins);
+    pthread_rwlock_rdlock(&registry_lock);
+    size_t count = entry_count;
+    pthread_rwlock_unlock(&registry_lock);
+    return count;
+}
+
+//copy the index'th builtin registered to builtin
+int builtin_at(size_t index, struct builtin *builtin)
+{
+    pthread_once(&registry_once, register_shell_builtins);
+    pthread_rwlock_rdlock(&registry_lock);
+    bool found = index < entry_count;
+    if (found) {
+        *builtin = entries[index];
+    }
+    pthread_rwlock_unlock(&registry_lock);
+    return found ? 0 : -1;
+}
+
+//add a builtin, replacing any with the same name; -1 if the registry is full
+int builtin_register(const struct builtin *builtin)
+{
+    pthread_once(&registry_once, register_shell_builtins);
+    pthread_rwlock_wrlock(&registry_lock);
+    int result = add(builtin, NULL);
+    pthread_rwlock_unlock(&registry_lock);
+    return result;
+}
+
+/**
+ * Load the builtin called name from the shared library at path, which must
+ * define a struct builtin called NAME_builtin. The library stays loaded for
+ * good: a handler may be running on another thread at any time.
+ */
+int builtin_load(const char *path, const char *name)
+{
+    void *library = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (library == NULL) {
+        fprintf(stderr, "enable: %s\n", dlerror());
+        return -1;
+    }
+    char symbol[strlen(name) + sizeof("_builtin")];
+    snprintf(symbol, sizeof(symbol), "%s_builtin", name);
+    const struct builtin *found = dlsym(library, symbol);
+    if (found == NULL || found->handler == NULL || found->name == NULL
+            || strcmp(found->name, name) != 0) {
+        fprintf(stderr, "enable: %s: no builtin %s in %s\n", name, symbol, path);
+        dlclose(library);
+        return -1;
+    }
+
+    struct builtin builtin = *found;
+    builtin.flags = (builtin.flags | BUILTIN_LOADED) & ~BUILTIN_DISABLED;
+    pthread_once(&registry_once, register_shell_builtins);
+    pthread_rwlock_wrlock(&registry_lock);
+    int result = add(&builtin, path);
+    pthread_rwlock_unlock(&registry_lock);
+    if (result == -1) {
+        /* Nothing registered points into the library, so it can go */
+        fprintf(stderr, "enable: %s: too many builtins\n", name);
+        dlclose(library);
+        return -1;
+    }
+    LOG("Loaded builtin %s from %s\n", name, path);
+    return 0;
+}
+
+//turn a builtin on or off; -1 if there is no builtin called name
+int builtin_enable(const char *name, bool enabled)
+{
+    pthread_once(&registry_once, register_shell_builtins);
+    pthread_rwlock_wrlock(&registry_lock);
+    int slot = *slot_of(name);
+    if (slot != 0 && enabled) {
+        entries[slot - 1].flags &= ~BUILTIN_DISABLED;
+    } else if (slot != 0) {
+        entries[slot - 1].flags |= BUILTIN_DISABLED;
+    }
+    pthread_rwlock_unlock(&registry_lock);
+    return slot != 0 ? 0 : -1;
+}
+
+//list the builtins as the enable commands that would set them up
+void builtin_print(FILE *out)
+{
+    pthread_once(&registry_once, register_shell_builtins);
+    pthread_rwlock_rdlock(&registry_lock);
+    for (size_t i = 0; i < entry_count; i++) {
+        /* enable takes -n or -f, not both: load first, then turn it off */
+        if (loaded_from[i] != NULL) {
+            fprintf(out, "enable -f %s %s\n", loaded_from[i], entries[i].name);
+        }
+        if (loaded_from[i] == NULL || (entries[i].flags & BUILTIN_DISABLED)) {
+            fprintf(out, "enable %s%s\n", entries[i].flags & BUILTIN_DISABLED ? "-n " : "",
+                    entries[i].name);
+        }
+    }
+    pthread_rwlock_unlock(&registry_lock);
+}
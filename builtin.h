@@ -0,0 +1,63 @@
+/**
+ * @file
+ *
+ * BUILTINS
+ * The registry of commands the shell runs itself. Each builtin has a name, a
+ * handler, a hint for completing its arguments and some flags; lookups go
+ * through a hash table, so finding one costs the same however many there
+ * are. The shell's own builtins are registered on first use and more can be
+ * loaded at runtime with enable -f LIB.so NAME, which looks for a
+ *
+ *     const struct builtin NAME_builtin = { "NAME", handler, hint, flags };
+ *
+ * in the library. A handler gets the arguments and the stream its output
+ * should go to, and returns an exit status (or BUILTIN_EXIT).
+ */
+
+#ifndef _BUILTIN_H_
+#define _BUILTIN_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#define BUILTIN_SLOTS 256 //hash table size, a power of two
+
+#define BUILTIN_MAX 128 //builtins registered at once, loaded ones included
+
+#define BUILTIN_EXIT -1 //handler result: leave the shell
+
+#define BUILTIN_STATUS_SET -2 //handler result: the handler set the wait status itself
+
+#define BUILTIN_BACKGROUND 0x1 //handles a trailing & itself
+#define BUILTIN_HISTORY 0x2 //the line is added to the history
+#define BUILTIN_LOADED 0x4 //loaded with enable -f
+#define BUILTIN_DISABLED 0x8 //turned off with enable -n: the name runs a program
+#define BUILTIN_FASTPATH 0x10 //stands in for the program of the same name; see fastpath.h
+
+//what the arguments of a builtin complete to
+enum builtin_complete {
+    COMPLETE_FILES,
+    COMPLETE_DIRS,
+    COMPLETE_COMMANDS,
+    COMPLETE_NONE,
+};
+
+typedef int (*builtin_handler)(char **args, size_t arg_size, FILE *out);
+
+struct builtin {
+    const char *name;
+    builtin_handler handler;
+    enum builtin_complete complete;
+    int flags;
+};
+
+int builtin_find(const char *, struct builtin *);
+size_t builtin_count(void);
+int builtin_at(size_t, struct builtin *);
+int builtin_register(const struct builtin *);
+int builtin_load(const char *, const char *);
+int builtin_enable(const char *, bool);
+void builtin_print(FILE *);
+
+#endif
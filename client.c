@@ -0,0 +1,102 @@
+/**
+ * @file
+ *
+ * swishc
+ *
+ * thin client for a shell started with swish --serve
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "serve.h"
+
+/**
+ * Run one command on a swish server. The command gets our working directory,
+ * stdin, stdout and stderr, and its exit status becomes ours.
+ */
+int main(int argc, char *argv[])
+{
+    if (argc < 3) {
+        fprintf(stderr, "usage: swishc SOCKET COMMAND [ARG...]\n");
+        return 2;
+    }
+
+    char line[SERVE_MAX_LINE];
+    size_t len = 0;
+    for (int i = 2; i < argc; i++) {
+        size_t arg_len = strlen(argv[i]);
+        if (len + arg_len + 1 >= sizeof(line)) {
+            fprintf(stderr, "swishc: command too long\n");
+            return 2;
+        }
+        if (i > 2) {
+            line[len++] = ' ';
+        }
+        memcpy(line + len, argv[i], arg_len);
+        len += arg_len;
+    }
+    line[len] = '\0';
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(argv[1]) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "swishc: socket path too long: %s\n", argv[1]);
+        return 2;
+    }
+    strcpy(addr.sun_path, argv[1]);
+
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock == -1 || connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        perror(argv[1]);
+        return 127;
+    }
+
+    /* O_PATH works even in directories we may not read */
+    int fds[SERVE_FDS] = {
+        open(".", O_PATH | O_DIRECTORY | O_CLOEXEC),
+        STDIN_FILENO,
+        STDOUT_FILENO,
+        STDERR_FILENO,
+    };
+    if (fds[0] == -1) {
+        perror("swishc: working directory");
+        return 127;
+    }
+
+    struct iovec iov = { .iov_base = line, .iov_len = len };
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(sock, &msg, 0) == -1) {
+        perror("swishc: sendmsg");
+        return 127;
+    }
+    close(fds[0]);
+
+    struct serve_reply reply;
+    if (recv(sock, &reply, sizeof(reply), 0) != sizeof(reply)) {
+        fprintf(stderr, "swishc: no reply from the server\n");
+        return 127;
+    }
+    close(sock);
+    return reply.status == -1 ? 0 : reply.status;
+}
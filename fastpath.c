@@ -0,0 +1,664 @@
+/**
+ * @file
+ *
+ * fastpath
+ *
+ * in-process cat, wc, head, echo, printf, true and false
+ */
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__SSE2__) && defined(__x86_64__)
+#include <emmintrin.h>
+#endif
+
+#include "arena.h"
+#include "fastpath.h"
+#include "metrics.h"
+#include "session.h"
+
+#define INTERRUPTED 130 //exit status after ^C
+
+//what wc counts
+struct counts {
+    uintmax_t lines;
+    uintmax_t words;
+    uintmax_t bytes;
+};
+
+/**
+ * True once ^C is waiting. Under the event loop SIGINT is blocked, so the
+ * long loops here check for it themselves; it stays pending for the loop.
+ */
+static bool interrupted(void)
+{
+    sigset_t pending;
+    return sigpending(&pending) == 0 && sigismember(&pending, SIGINT) == 1;
+}
+
+static int write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        } else if (written == -1) {
+            return -1;
+        }
+        data += written;
+        len -= written;
+    }
+    return 0;
+}
+
+/**
+ * Count the newlines in a block, 16 bytes at a time where SSE2 is available:
+ * each byte lane counts its matches for up to 255 rounds before the lanes
+ * are summed.
+ */
+static size_t count_newlines(const char *data, size_t len)
+{
+    size_t count = 0;
+    size_t i = 0;
+#if defined(__SSE2__) && defined(__x86_64__)
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+    while (len - i >= 16) {
+        size_t rounds = (len - i) / 16;
+        if (rounds > 255) {
+            rounds = 255;
+        }
+        __m128i lanes = zero;
+        for (size_t r = 0; r < rounds; r++, i += 16) {
+            __m128i chunk = _mm_loadu_si128((const __m128i *) (data + i));
+            lanes = _mm_sub_epi8(lanes, _mm_cmpeq_epi8(chunk, newline));
+        }
+        __m128i sums = _mm_sad_epu8(lanes, zero);
+        count += _mm_cvtsi128_si64(sums) + _mm_extract_epi16(sums, 4);
+    }
+#endif
+    for (; i < len; i++) {
+        count += data[i] == '\n';
+    }
+    return count;
+}
+
+//count the words in a block, carrying over whether it started inside one
+static uintmax_t count_words(const char *data, size_t len, bool *in_word)
+{
+    uintmax_t words = 0;
+    for (size_t i = 0; i < len; i++) {
+        bool space = isspace((unsigned char) data[i]);
+        words += !space && !*in_word;
+        *in_word = !space;
+    }
+    return words;
+}
+
+//the real tool handles a terminal on stdin: ^C has to reach whoever reads it
+static bool reads_terminal(char **files, size_t count)
+{
+    bool uses_stdin = count == 0;
+    for (size_t i = 0; i < count; i++) {
+        uses_stdin |= strcmp(files[i], "-") == 0;
+    }
+    return uses_stdin && isatty(session_stdin());
+}
+
+//open a file operand, "-" being stdin, reporting failure like the real tool
+static int open_input(const char *tool, const char *path)
+{
+    if (strcmp(path, "-") == 0) {
+        return session_stdin();
+    }
+    int fd = session_open(path, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "%s: %s: %s\n", tool, path, strerror(errno));
+    }
+    return fd;
+}
+
+static void close_input(int fd)
+{
+    if (fd != session_stdin()) {
+        close(fd);
+    }
+}
+
+/**
+ * Copy in to out. sendfile keeps the data in the kernel; inputs it can't
+ * handle, such as pipes, are read a block at a time instead.
+ */
+static int copy_fd(int in, int out, char *buffer)
+{
+    bool zero_copy = true;
+    while (!interrupted()) {
+        ssize_t moved;
+        if (zero_copy) {
+            moved = sendfile(out, in, NULL, FASTPATH_BLOCK * 8);
+            if (moved == -1 && (errno == EINVAL || errno == ENOSYS)) {
+                zero_copy = false;
+                continue;
+            }
+        } else if ((moved = read(in, buffer, FASTPATH_BLOCK)) > 0
+                && write_all(out, buffer, moved) == -1) {
+            moved = -1;
+        }
+        if (moved == 0) {
+            return 0;
+        } else if (moved == -1 && errno != EINTR) {
+            return 1;
+        }
+    }
+    return INTERRUPTED;
+}
+
+//cat [FILE...], without options
+static int fast_cat(char **args, size_t argc, FILE *out)
+{
+    for (size_t i = 1; i < argc; i++) {
+        if (args[i][0] == '-' && args[i][1] != '\0') {
+            return FASTPATH_FALLBACK;
+        }
+    }
+    if (reads_terminal(&args[1], argc - 1)) {
+        return FASTPATH_FALLBACK;
+    }
+
+    char *stdin_only[] = { "-" };
+    char **files = argc > 1 ? &args[1] : stdin_only;
+    size_t count = argc > 1 ? argc - 1 : 1;
+    char *buffer = malloc(FASTPATH_BLOCK);
+    int status = 0;
+    fflush(out);
+    for (size_t i = 0; i < count && status != INTERRUPTED; i++) {
+        int fd = open_input("cat", files[i]);
+        if (fd == -1) {
+            status = 1;
+            continue;
+        }
+        int copied = copy_fd(fd, fileno(out), buffer);
+        if (copied == 1) {
+            fprintf(stderr, "cat: %s: %s\n", files[i], strerror(errno));
+        }
+        status = copied != 0 ? copied : status;
+        close_input(fd);
+    }
+    free(buffer);
+    return status;
+}
+
+//count one input; only the size is needed for wc -c of a regular file
+static int count_fd(int fd, struct counts *counts, bool words, bool bytes_only, char *buffer)
+{
+    struct stat st;
+    off_t offset;
+    if (bytes_only && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)
+            && (offset = lseek(fd, 0, SEEK_CUR)) != -1) {
+        counts->bytes = st.st_size > offset ? st.st_size - offset : 0;
+        return 0;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    bool in_word = false;
+    ssize_t got;
+    while ((got = read(fd, buffer, FASTPATH_BLOCK)) != 0) {
+        if (got == -1 && errno == EINTR) {
+            continue;
+        } else if (got == -1) {
+            return 1;
+        }
+        counts->bytes += got;
+        counts->lines += count_newlines(buffer, got);
+        if (words) {
+            counts->words += count_words(buffer, got, &in_word);
+        }
+        if (interrupted()) {
+            return INTERRUPTED;
+        }
+    }
+    return 0;
+}
+
+static int stat_input(const char *path, struct stat *st)
+{
+    if (strcmp(path, "-") == 0) {
+        return fstat(session_stdin(), st);
+    }
+    int fd = session_open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    int result = fstat(fd, st);
+    close(fd);
+    return result;
+}
+
+/**
+ * The column width GNU wc uses: wide enough for the total size of the regular
+ * files, at least 7 if any input isn't one, and no padding at all for a
+ * single count of a single input.
+ */
+static int count_width(char **files, size_t count, size_t shown)
+{
+    if (count == 1 && shown == 1) {
+        return 1;
+    }
+    struct stat st;
+    int width = 1;
+    int minimum = 1;
+    uintmax_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (stat_input(files[i], &st) == -1) {
+            continue;
+        } else if (S_ISREG(st.st_mode)) {
+            total += st.st_size;
+        } else {
+            minimum = 7;
+        }
+    }
+    for (; total >= 10; total /= 10) {
+        width++;
+    }
+    return width > minimum ? width : minimum;
+}
+
+static void print_counts(FILE *out, const struct counts *counts, const bool *show,
+        int width, const char *name)
+{
+    const uintmax_t values[] = { counts->lines, counts->words, counts->bytes };
+    bool first = true;
+    for (int i = 0; i < 3; i++) {
+        if (show[i]) {
+            fprintf(out, first ? "%*" PRIuMAX : " %*" PRIuMAX, width, values[i]);
+            first = false;
+        }
+    }
+    if (name != NULL) {
+        fprintf(out, " %s", name);
+    }
+    fputc('\n', out);
+}
+
+//wc [-lwc] [FILE...]
+static int fast_wc(char **args, size_t argc, FILE *out)
+{
+    bool show[3] = { false }; //lines, words, bytes
+    char *files[argc];
+    size_t count = 0;
+    for (size_t i = 1; i < argc; i++) {
+        if (args[i][0] != '-' || args[i][1] == '\0') {
+            files[count++] = args[i];
+            continue;
+        }
+        for (const char *flag = args[i] + 1; *flag != '\0'; flag++) {
+            const char *at = strchr("lwc", *flag);
+            if (at == NULL) {
+                return FASTPATH_FALLBACK;
+            }
+            show[at - "lwc"] = true;
+        }
+    }
+    if (reads_terminal(files, count)) {
+        return FASTPATH_FALLBACK;
+    }
+    if (!show[0] && !show[1] && !show[2]) {
+        show[0] = show[1] = show[2] = true;
+    }
+
+    bool named = count > 0;
+    if (!named) {
+        files[count++] = "-";
+    }
+    int width = count_width(files, count, show[0] + show[1] + show[2]);
+    bool bytes_only = !show[0] && !show[1];
+    char *buffer = bytes_only ? NULL : malloc(FASTPATH_BLOCK);
+    struct counts total = { 0 };
+    int status = 0;
+    for (size_t i = 0; i < count && status != INTERRUPTED; i++) {
+        int fd = open_input("wc", files[i]);
+        if (fd == -1) {
+            status = 1;
+            continue;
+        }
+        struct counts counts = { 0 };
+        int counted = count_fd(fd, &counts, show[1], bytes_only, buffer);
+        close_input(fd);
+        if (counted == 1) {
+            fprintf(stderr, "wc: %s: %s\n", files[i], strerror(errno));
+        }
+        if (counted != 0) {
+            status = counted;
+            continue;
+        }
+        print_counts(out, &counts, show, width, named ? files[i] : NULL);
+        total.lines += counts.lines;
+        total.words += counts.words;
+        total.bytes += counts.bytes;
+    }
+    if (count > 1 && status != INTERRUPTED) {
+        print_counts(out, &total, show, width, "total");
+    }
+    free(buffer);
+    return status;
+}
+
+//copy the first lines lines of in to out
+static int head_fd(int in, int out, uintmax_t lines, char *buffer)
+{
+    while (lines > 0) {
+        ssize_t got = read(in, buffer, FASTPATH_BLOCK);
+        if (got == -1 && errno == EINTR) {
+            continue;
+        } else if (got <= 0) {
+            return got == 0 ? 0 : 1;
+        }
+
+        size_t len = got;
+        size_t newlines = count_newlines(buffer, got);
+        if (newlines >= lines) {
+            const char *end = buffer;
+            for (; lines > 0; lines--) {
+                end = (const char *) memchr(end, '\n', buffer + got - end) + 1;
+            }
+            len = end - buffer;
+        } else {
+            lines -= newlines;
+        }
+        if (write_all(out, buffer, len) == -1) {
+            return 1;
+        }
+        if (interrupted()) {
+            return INTERRUPTED;
+        }
+    }
+    return 0;
+}
+
+//a line count made only of digits, or -1
+static intmax_t parse_count(const char *text)
+{
+    if (*text == '\0' || strspn(text, "0123456789") != strlen(text)) {
+        return -1;
+    }
+    errno = 0;
+    uintmax_t value = strtoumax(text, NULL, 10);
+    return errno == 0 && value <= INTMAX_MAX ? (intmax_t) value : -1;
+}
+
+//head [-n N | -N] [FILE...]
+static int fast_head(char **args, size_t argc, FILE *out)
+{
+    intmax_t lines = 10;
+    char *files[argc];
+    size_t count = 0;
+    for (size_t i = 1; i < argc; i++) {
+        char *arg = args[i];
+        if (strcmp(arg, "-n") == 0 && i + 1 < argc) {
+            lines = parse_count(args[++i]);
+        } else if (strncmp(arg, "-n", 2) == 0) {
+            lines = parse_count(arg + 2);
+        } else if (arg[0] == '-' && isdigit((unsigned char) arg[1])) {
+            lines = parse_count(arg + 1);
+        } else if (arg[0] == '-' && arg[1] != '\0') {
+            return FASTPATH_FALLBACK;
+        } else {
+            files[count++] = arg;
+        }
+        if (lines == -1) {
+            return FASTPATH_FALLBACK;
+        }
+    }
+    if (reads_terminal(files, count)) {
+        return FASTPATH_FALLBACK;
+    }
+
+    bool headers = count > 1;
+    if (count == 0) {
+        files[count++] = "-";
+    }
+    char *buffer = malloc(FASTPATH_BLOCK);
+    int status = 0;
+    fflush(out);
+    for (size_t i = 0; i < count && status != INTERRUPTED; i++) {
+        int fd = open_input("head", files[i]);
+        if (fd == -1) {
+            status = 1;
+            continue;
+        }
+        if (headers) {
+            fprintf(out, "%s==> %s <==\n", i > 0 ? "\n" : "",
+                    strcmp(files[i], "-") == 0 ? "standard input" : files[i]);
+            fflush(out);
+        }
+        int copied = head_fd(fd, fileno(out), lines, buffer);
+        if (copied == 1) {
+            fprintf(stderr, "head: %s: %s\n", files[i], strerror(errno));
+        }
+        status = copied != 0 ? copied : status;
+        close_input(fd);
+    }
+    free(buffer);
+    return status;
+}
+
+//echo [-n] [WORD...]; -e and friends go to the real echo
+static int fast_echo(char **args, size_t argc, FILE *out)
+{
+    if (argc == 2 && (strcmp(args[1], "--help") == 0 || strcmp(args[1], "--version") == 0)) {
+        return FASTPATH_FALLBACK;
+    }
+    bool newline = true;
+    size_t first = 1;
+    for (; first < argc && args[first][0] == '-' && args[first][1] != '\0'
+            && strspn(args[first] + 1, "neE") == strlen(args[first] + 1); first++) {
+        if (strchr(args[first], 'e') != NULL) {
+            return FASTPATH_FALLBACK;
+        }
+        newline &= strchr(args[first], 'n') == NULL;
+    }
+    for (size_t i = first; i < argc; i++) {
+        fputs(args[i], out);
+        if (i + 1 < argc) {
+            fputc(' ', out);
+        }
+    }
+    if (newline) {
+        fputc('\n', out);
+    }
+    return 0;
+}
+
+/**
+ * The character a printf escape stands for, p pointing just past the
+ * backslash and left on the escape's last character, or -1 for escapes
+ * (\c, \x, \u) left to the real printf.
+ */
+static int escape(const char **p)
+{
+    static const char plain[] = "\\\"'abefnrtv";
+    static const char values[] = "\\\"'\a\b\033\f\n\r\t\v";
+    const char *at = **p != '\0' ? strchr(plain, **p) : NULL;
+    if (at != NULL) {
+        return values[at - plain];
+    }
+    if (**p < '0' || **p > '7') {
+        return -1;
+    }
+    int value = 0;
+    for (int digits = 0; digits < 3 && **p >= '0' && **p <= '7'; digits++, (*p)++) {
+        value = value * 8 + (**p - '0');
+    }
+    (*p)--;
+    return value & 0xff;
+}
+
+/**
+ * Print format with args the way printf(1) does, reusing the format while
+ * arguments remain. With out NULL, only check that every escape, conversion
+ * and argument is one handled here.
+ */
+static bool render(FILE *out, const char *format, char **args, size_t count)
+{
+    size_t used = 0;
+    size_t before;
+    do {
+        before = used;
+        for (const char *p = format; *p != '\0'; p++) {
+            if (*p == '\\') {
+                p++;
+                int c = escape(&p);
+                if (c == -1) {
+                    return false;
+                } else if (out != NULL) {
+                    fputc(c, out);
+                }
+                continue;
+            } else if (*p != '%') {
+                if (out != NULL) {
+                    fputc(*p, out);
+                }
+                continue;
+            } else if (p[1] == '%') {
+                if (out != NULL) {
+                    fputc('%', out);
+                }
+                p++;
+                continue;
+            }
+
+            /* Flags, width and precision pass through; lengths are ours */
+            char spec[40] = "%";
+            size_t n = 1;
+            for (p++; n < 24 && *p != '\0' && strchr("-+ #0", *p) != NULL; p++) {
+                spec[n++] = *p;
+            }
+            for (; n < 24 && (isdigit((unsigned char) *p) || *p == '.'); p++) {
+                spec[n++] = *p;
+            }
+            for (; *p != '\0' && strchr("hljztL", *p) != NULL; p++) {
+            }
+            if (*p == '\0') {
+                return false;
+            }
+            const char *arg = used < count ? args[used++] : "";
+            char *end;
+            errno = 0;
+            if (*p == 's') {
+                strcpy(spec + n, "s");
+                if (out != NULL) {
+                    fprintf(out, spec, arg);
+                }
+            } else if (*p == 'c' && *arg != '\0') {
+                strcpy(spec + n, "c");
+                if (out != NULL) {
+                    fprintf(out, spec, arg[0]);
+                }
+            } else if (strchr("di", *p) != NULL && *arg != '\'' && *arg != '"') {
+                long long value = *arg != '\0' ? strtoll(arg, &end, 0) : 0;
+                if (*arg != '\0' && (*end != '\0' || errno != 0)) {
+                    return false;
+                }
+                strcpy(spec + n, "lld");
+                if (out != NULL) {
+                    fprintf(out, spec, value);
+                }
+            } else if (strchr("ouxX", *p) != NULL && *arg != '\'' && *arg != '"') {
+                unsigned long long value = *arg != '\0' ? strtoull(arg, &end, 0) : 0;
+                if (*arg != '\0' && (*end != '\0' || errno != 0)) {
+                    return false;
+                }
+                sprintf(spec + n, "ll%c", *p);
+                if (out != NULL) {
+                    fprintf(out, spec, value);
+                }
+            } else if (strchr("fFeEgGaA", *p) != NULL && *arg != '\'' && *arg != '"') {
+                long double value = *arg != '\0' ? strtold(arg, &end) : 0;
+                if (*arg != '\0' && (*end != '\0' || errno != 0)) {
+                    return false;
+                }
+                sprintf(spec + n, "L%c", *p);
+                if (out != NULL) {
+                    fprintf(out, spec, value);
+                }
+            } else {
+                return false;
+            }
+        }
+    } while (used < count && used > before);
+    return true;
+}
+
+//printf FORMAT [ARGUMENT...], without %b, %q or * widths
+static int fast_printf(char **args, size_t argc, FILE *out)
+{
+    if (argc < 2 || args[1][0] == '-' || !render(NULL, args[1], &args[2], argc - 2)) {
+        return FASTPATH_FALLBACK;
+    }
+    render(out, args[1], &args[2], argc - 2);
+    return 0;
+}
+
+static int fast_true(char **args, size_t argc, FILE *out)
+{
+    return argc == 2 && strncmp(args[1], "--", 2) == 0 ? FASTPATH_FALLBACK : 0;
+}
+
+static int fast_false(char **args, size_t argc, FILE *out)
+{
+    return argc == 2 && strncmp(args[1], "--", 2) == 0 ? FASTPATH_FALLBACK : 1;
+}
+
+//the utilities handled here, registered with the shell's builtins
+const struct builtin fastpath_builtins[] = {
+    { "cat", fast_cat, COMPLETE_FILES, BUILTIN_FASTPATH },
+    { "echo", fast_echo, COMPLETE_FILES, BUILTIN_FASTPATH },
+    { "false", fast_false, COMPLETE_NONE, BUILTIN_FASTPATH },
+    { "head", fast_head, COMPLETE_FILES, BUILTIN_FASTPATH },
+    { "printf", fast_printf, COMPLETE_FILES, BUILTIN_FASTPATH },
+    { "true", fast_true, COMPLETE_NONE, BUILTIN_FASTPATH },
+    { "wc", fast_wc, COMPLETE_FILES, BUILTIN_FASTPATH },
+};
+
+const size_t fastpath_builtin_count = sizeof(fastpath_builtins) / sizeof(fastpath_builtins[0]);
+
+/**
+ * Run args in the shell itself if it is one of the utilities handled here
+ * and hasn't been turned off with enable -n, printing to the session's
+ * stdout. Returns the exit status, or FASTPATH_FALLBACK if the real program
+ * should run instead.
+ */
+int fastpath_run(char **args)
+{
+    const char *setting = getenv("SWISH_FASTPATH");
+    if (setting != NULL && strcmp(setting, "0") == 0) {
+        return FASTPATH_FALLBACK;
+    }
+    struct builtin tool;
+    if (builtin_find(args[0], &tool) == -1 || !(tool.flags & BUILTIN_FASTPATH)) {
+        return FASTPATH_FALLBACK;
+    }
+    size_t argc = 0;
+    while (args[argc] != NULL) {
+        argc++;
+    }
+    FILE *out = session_stdout();
+    int status = tool.handler(args, argc, out);
+    if (status != FASTPATH_FALLBACK) {
+        METRIC_INC(METRIC_FAST_BUILTINS);
+        fflush(out);
+    }
+    return status;
+}
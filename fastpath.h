@@ -0,0 +1,33 @@
+/**
+ * @file
+ *
+ * FAST PATH
+ * In-process versions of cat, wc, head, echo, printf, true and false, the
+ * small utilities scripts run in tight loops, so running one costs no fork or
+ * exec. Only their common options are covered: a command using anything else
+ * (or reading from a terminal) runs the real program instead.
+ *
+ * They are registered as builtins flagged BUILTIN_FASTPATH, so enable lists
+ * them and enable -n NAME runs the real program for good. Unlike other
+ * builtins they only run where the program would (a plain command, not a
+ * pipeline stage), and their handlers return FASTPATH_FALLBACK to decline.
+ * Set SWISH_FASTPATH=0 to always run the real programs.
+ */
+
+#ifndef _FASTPATH_H_
+#define _FASTPATH_H_
+
+#include <stddef.h>
+
+#include "builtin.h"
+
+#define FASTPATH_BLOCK (128 * 1024) //bytes read or copied at a time
+
+#define FASTPATH_FALLBACK -1 //not handled: run the real program
+
+int fastpath_run(char **);
+
+extern const struct builtin fastpath_builtins[];
+extern const size_t fastpath_builtin_count;
+
+#endif
@@ -0,0 +1,246 @@
+/**
+ * @file
+ *
+ * fuzzy
+ *
+ * subsequence matching and ranking for tab completion
+ */
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fuzzy.h"
+
+#define SCORE_MATCH 16
+#define BONUS_BOUNDARY 8
+#define BONUS_CONSECUTIVE 4
+#define BONUS_PREFIX 12
+#define BONUS_CASE 1
+#define PENALTY_GAP_START 3
+#define PENALTY_GAP 1
+
+//the bit a character occupies in a candidate's character set
+static inline uint64_t char_bit(unsigned char c)
+{
+    c = tolower(c);
+    if (c >= 'a' && c <= 'z') {
+        return 1ULL << (c - 'a');
+    } else if (c >= '0' && c <= '9') {
+        return 1ULL << (26 + c - '0');
+    }
+    return 1ULL << (36 + c % 28);
+}
+
+/**
+ * Summarize the (case folded) characters in a string as a 64-bit set. A
+ * candidate can only match if it holds every character in the pattern, so
+ * comparing two masks rejects most candidates with a single AND before any
+ * real scoring happens. Masks are meant to be computed once per candidate.
+ */
+uint64_t fuzzy_mask(const char *str)
+{
+    uint64_t mask = 0;
+    for (const unsigned char *c = (const unsigned char *) str; *c != '\0'; c++) {
+        mask |= char_bit(*c);
+    }
+    return mask;
+}
+
+//true if the character starts a new "word" within the candidate
+static inline bool is_boundary(const char *candidate, size_t i)
+{
+    if (i == 0) {
+        return true;
+    }
+    char prev = candidate[i - 1];
+    if (prev == '-' || prev == '_' || prev == '.' || prev == '/' || prev == ' ') {
+        return true;
+    }
+    return islower((unsigned char) prev) && isupper((unsigned char) candidate[i]);
+}
+
+static inline bool chars_match(char p, char c, bool smart_case)
+{
+    return smart_case ? p == c : tolower((unsigned char) p) == tolower((unsigned char) c);
+}
+
+/**
+ * Score a candidate against the pattern, or return -1 if it does not contain
+ * the pattern as a subsequence. Upper case in the pattern makes the match
+ * case sensitive. A forward pass finds where the earliest match ends and a
+ * backward pass from there finds the tightest window, which is then scored.
+ */
+int fuzzy_score(const char *pattern, const char *candidate)
+{
+    size_t pattern_len = strlen(pattern);
+    if (pattern_len == 0) {
+        return 0;
+    }
+
+    bool smart_case = false;
+    for (size_t i = 0; i < pattern_len; i++) {
+        if (isupper((unsigned char) pattern[i])) {
+            smart_case = true;
+            break;
+        }
+    }
+
+    size_t p = 0;
+    size_t end = 0;
+    for (size_t i = 0; candidate[i] != '\0'; i++) {
+        if (chars_match(pattern[p], candidate[i], smart_case)) {
+            if (++p == pattern_len) {
+                end = i;
+                break;
+            }
+        }
+    }
+    if (p < pattern_len) {
+        return -1;
+    }
+
+    size_t start = end;
+    p = pattern_len;
+    for (size_t i = end + 1; i-- > 0;) {
+        if (chars_match(pattern[p - 1], candidate[i], smart_case)) {
+            if (--p == 0) {
+                start = i;
+                break;
+            }
+        }
+    }
+
+    int score = 0;
+    bool in_gap = false;
+    bool consecutive = false;
+    p = 0;
+    for (size_t i = start; i <= end; i++) {
+        if (p < pattern_len && chars_match(pattern[p], candidate[i], smart_case)) {
+            score += SCORE_MATCH;
+            if (is_boundary(candidate, i)) {
+                score += BONUS_BOUNDARY;
+            }
+            if (consecutive) {
+                score += BONUS_CONSECUTIVE;
+            }
+            if (pattern[p] == candidate[i]) {
+                score += BONUS_CASE;
+            }
+            consecutive = true;
+            in_gap = false;
+            p++;
+        } else {
+            score -= in_gap ? PENALTY_GAP : PENALTY_GAP_START;
+            consecutive = false;
+            in_gap = true;
+        }
+    }
+    if (start == 0) {
+        score += BONUS_PREFIX;
+    }
+    return score;
+}
+
+//true if match a should be ranked below match b
+static inline bool ranks_below(const struct fuzzy_match *a, const struct fuzzy_match *b)
+{
+    if (a->score != b->score) {
+        return a->score < b->score;
+    }
+    size_t a_len = strlen(a->candidate);
+    size_t b_len = strlen(b->candidate);
+    if (a_len != b_len) {
+        return a_len > b_len;
+    }
+    return strcmp(a->candidate, b->candidate) > 0;
+}
+
+//restore the min-heap property below index i
+static void sift_down(struct fuzzy_match *heap, size_t size, size_t i)
+{
+    while (true) {
+        size_t lowest = i;
+        size_t left = 2 * i + 1;
+        size_t right = left + 1;
+        if (left < size && ranks_below(&heap[left], &heap[lowest])) {
+            lowest = left;
+        }
+        if (right < size && ranks_below(&heap[right], &heap[lowest])) {
+            lowest = right;
+        }
+        if (lowest == i) {
+            return;
+        }
+        struct fuzzy_match temp = heap[i];
+        heap[i] = heap[lowest];
+        heap[lowest] = temp;
+        i = lowest;
+    }
+}
+
+//restore the min-heap property above index i
+static void sift_up(struct fuzzy_match *heap, size_t i)
+{
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!ranks_below(&heap[i], &heap[parent])) {
+            return;
+        }
+        struct fuzzy_match temp = heap[i];
+        heap[i] = heap[parent];
+        heap[parent] = temp;
+        i = parent;
+    }
+}
+
+/**
+ * Keep the k best matches out of count candidates in top, best first, and
+ * return how many there were. masks may be NULL; otherwise it holds the
+ * fuzzy_mask() of every candidate and is used to skip hopeless ones. boost
+ * may also be NULL; otherwise its result is added to the score of every
+ * candidate that matches. The results are kept in a min-heap of size k, so
+ * ranking costs O(n log k) rather than a sort of every match.
+ */
+size_t fuzzy_rank(const char *pattern, const char **candidates,
+        const uint64_t *masks, size_t count, int (*boost)(const char *),
+        struct fuzzy_match *top, size_t k)
+{
+    if (k == 0) {
+        return 0;
+    }
+    uint64_t pattern_mask = fuzzy_mask(pattern);
+    size_t size = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        if (masks != NULL && (pattern_mask & ~masks[i]) != 0) {
+            continue;
+        }
+        struct fuzzy_match match = { .candidate = candidates[i] };
+        match.score = fuzzy_score(pattern, candidates[i]);
+        if (match.score < 0) {
+            continue;
+        }
+        if (boost != NULL) {
+            match.score += boost(candidates[i]);
+        }
+        if (size < k) {
+            top[size] = match;
+            sift_up(top, size++);
+        } else if (ranks_below(&top[0], &match)) {
+            top[0] = match;
+            sift_down(top, size, 0);
+        }
+    }
+
+    /* Pop the heap from the back so the best match ends up first */
+    for (size_t end = size; end > 1; end--) {
+        struct fuzzy_match temp = top[0];
+        top[0] = top[end - 1];
+        top[end - 1] = temp;
+        sift_down(top, end - 1, 0);
+    }
+    return size;
+}
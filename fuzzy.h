@@ -0,0 +1,27 @@
+/**
+ * @file
+ *
+ * FUZZY MATCHING
+ * Scores candidates against a pattern whose characters have to appear in
+ * order, but not necessarily next to each other. Matches at word boundaries,
+ * consecutive runs and exact case earn bonuses; gaps cost points.
+ */
+
+#ifndef _FUZZY_H_
+#define _FUZZY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+//a scored candidate
+struct fuzzy_match {
+    const char *candidate;
+    int score;
+};
+
+uint64_t fuzzy_mask(const char *);
+int fuzzy_score(const char *, const char *);
+size_t fuzzy_rank(const char *, const char **, const uint64_t *, size_t,
+        int (*)(const char *), struct fuzzy_match *, size_t);
+
+#endif
@@ -16,76 +16,265 @@
 #include <sys/param.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "arena.h"
 #include "history.h"
 #include "logger.h"
+#include "metrics.h"
+#include "session.h"
 
-static unsigned int command_num; //total number of commands
+#define SUGGEST_BUDGET_NS 250000 //time a suggestion lookup may spend searching
 
-static unsigned int list_limit; //the max amount of commands to store in history
+#define SUGGEST_CHECK_EVERY 32 //entries examined between clock checks
 
-static unsigned int list_index; //the current index
+#define USAGE_MIN_SLOTS 64 //starting size of the usage table
 
-static bool maxed; //boolean true if limit has been reached
+#define USAGE_MAX_ARGS 32 //arguments remembered per command
 
-struct history *hist_list; //our history of commands
+//how often a command has been run, and the arguments it was run with
+struct usage {
+    char *name;
+    unsigned int count;
+    char *args[USAGE_MAX_ARGS]; //most recently used first
+    size_t arg_count;
+};
 
-//initialize history at start of program and gets the memory neccesary
+//the last suggestion lookup, reused while the user keeps typing
+struct suggest_cache {
+    char *prefix;
+    size_t prefix_len;
+    unsigned int answer; //command number of the match, 0 if none
+    unsigned int resume; //command number to continue searching from
+    bool complete; //true if the search was not cut short by the budget
+};
+
+//the history of one session
+struct hist_state {
+    unsigned int command_num; //total number of commands
+    unsigned int list_limit; //the max amount of commands to store in history
+    unsigned int list_index; //the current index
+    bool maxed; //boolean true if limit has been reached
+    struct history *hist_list; //our history of commands
+    struct suggest_cache suggest;
+    struct usage *usage_table; //open addressing table keyed by argv[0]
+    size_t usage_slots; //capacity of the usage table (a power of two)
+    size_t usage_used; //number of commands in the usage table
+};
+
+//the history of the session running on this thread, NULL if it keeps none
+static inline struct hist_state *state(void)
+{
+    return session_current()->history;
+}
+
+//FNV-1a hash of a command name
+static size_t usage_hash(const char *name)
+{
+    size_t hash = 14695981039346656037ULL;
+    for (const unsigned char *c = (const unsigned char *) name; *c != '\0'; c++) {
+        hash ^= *c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+//find the slot that holds name, or the empty slot it would go in
+static struct usage *usage_slot(struct usage *table, size_t slots, const char *name)
+{
+    size_t i = usage_hash(name) & (slots - 1);
+    while (table[i].name != NULL && strcmp(table[i].name, name) != 0) {
+        i = (i + 1) & (slots - 1);
+    }
+    return &table[i];
+}
+
+//double the usage table once it is more than 70% full
+static void usage_grow(void)
+{
+    struct hist_state *h = state();
+    size_t slots = h->usage_slots == 0 ? USAGE_MIN_SLOTS : h->usage_slots * 2;
+    struct usage *table = calloc(slots, sizeof(struct usage));
+    for (size_t i = 0; i < h->usage_slots; i++) {
+        if (h->usage_table[i].name != NULL) {
+            *usage_slot(table, slots, h->usage_table[i].name) = h->usage_table[i];
+        }
+    }
+    free(h->usage_table);
+    h->usage_table = table;
+    h->usage_slots = slots;
+}
+
+//remember an argument for a command, moving it to the front if it was known
+static void usage_add_arg(struct usage *entry, const char *arg)
+{
+    size_t i;
+    for (i = 0; i < entry->arg_count; i++) {
+        if (strcmp(entry->args[i], arg) == 0) {
+            break;
+        }
+    }
+
+    char *saved;
+    if (i < entry->arg_count) {
+        saved = entry->args[i];
+    } else if (entry->arg_count < USAGE_MAX_ARGS) {
+        saved = strdup(arg);
+        i = entry->arg_count++;
+    } else {
+        i = USAGE_MAX_ARGS - 1;
+        free(entry->args[i]);
+        saved = strdup(arg);
+    }
+    memmove(&entry->args[1], &entry->args[0], sizeof(char *) * i);
+    entry->args[0] = saved;
+}
+
+//count a command line towards the usage of its first word
+static void usage_record(const char *cmd)
+{
+    struct hist_state *h = state();
+    char *line = strdup(cmd);
+    char *saveptr;
+    char *name = strtok_r(line, " \t\r\n", &saveptr);
+    if (name == NULL) {
+        free(line);
+        return;
+    }
+
+    if (h->usage_used * 10 >= h->usage_slots * 7) {
+        usage_grow();
+    }
+    struct usage *entry = usage_slot(h->usage_table, h->usage_slots, name);
+    if (entry->name == NULL) {
+        entry->name = strdup(name);
+        h->usage_used++;
+    }
+    entry->count++;
+
+    char *arg;
+    while ((arg = strtok_r(NULL, " \t\r\n", &saveptr)) != NULL) {
+        usage_add_arg(entry, arg);
+    }
+    free(line);
+}
+
+//how many times a command has been run this session
+unsigned int hist_usage_count(const char *name)
+{
+    struct hist_state *h = state();
+    if (h->usage_slots == 0) {
+        return 0;
+    }
+    return usage_slot(h->usage_table, h->usage_slots, name)->count;
+}
+
+//arguments previously given to a command, most recent first
+size_t hist_used_args(const char *name, const char **args, size_t max)
+{
+    struct hist_state *h = state();
+    if (h->usage_slots == 0) {
+        return 0;
+    }
+    struct usage *entry = usage_slot(h->usage_table, h->usage_slots, name);
+    size_t count = entry->arg_count < max ? entry->arg_count : max;
+    for (size_t i = 0; i < count; i++) {
+        args[i] = entry->args[i];
+    }
+    return count;
+}
+
+//initialize history for the current session and get the memory neccesary
 void hist_init(unsigned int limit)
 {
+    struct session *session = session_current();
+    if (session->history == NULL) {
+        session->history = calloc(1, sizeof(struct hist_state));
+    }
+    struct hist_state *h = session->history;
     LOG("Hist with limit %u created\n", limit);
-    list_limit = limit;
-    command_num = 1;
-    list_index = 0;
-    maxed = false;
-    hist_list = calloc(limit+1, sizeof(struct history));
+    h->list_limit = limit;
+    h->command_num = 1;
+    h->list_index = 0;
+    h->maxed = false;
+    h->hist_list = calloc(limit+1, sizeof(struct history));
     for(int i = 0; i<=limit; i++) {
-        hist_list[i].command = "ENDOFLIST";
+        h->hist_list[i].command = "ENDOFLIST";
     }
 }
 
 //release all the memory related to the history
 void hist_destroy(void)
 {
+    struct hist_state *h = state();
+    if (h == NULL) {
+        return;
+    }
 	LOGP("hist_destroy\n");
-	for(int i = 0; i<list_limit; i++){
-    	if(strcmp(hist_list[i].command, "ENDOFLIST")!=0){
-        	free(hist_list[i].command);
+	for(int i = 0; i<h->list_limit; i++){
+    	if(strcmp(h->hist_list[i].command, "ENDOFLIST")!=0){
+        	free(h->hist_list[i].command);
     	}
     }
-    free(hist_list);
+    free(h->hist_list);
+
+    for (size_t i = 0; i < h->usage_slots; i++) {
+        free(h->usage_table[i].name);
+        for (size_t j = 0; j < h->usage_table[i].arg_count; j++) {
+            free(h->usage_table[i].args[j]);
+        }
+    }
+    free(h->usage_table);
+    free(h->suggest.prefix);
+    free(h);
+    session_current()->history = NULL;
 }
 
 //add a command to the history
 void hist_add(char *cmd)
 {
+    struct hist_state *h = state();
+    if (h == NULL) {
+        return; //scripts keep no history
+    }
     if(strcmp(cmd, "")!=0){
-        if(!maxed){
-            hist_list[list_index].cmd_num = command_num;
-            hist_list[list_index].command = strdup(cmd);
-            list_index++;
+        if(!h->maxed){
+            h->hist_list[h->list_index].cmd_num = h->command_num;
+            h->hist_list[h->list_index].command = strdup(cmd);
+            h->list_index++;
         } else {
-            for(int i=1; i<list_limit; i++){
-                hist_list[i-1] = hist_list[i];
+            free(h->hist_list[0].command);
+            METRIC_INC(METRIC_HISTORY_EVICTIONS);
+            for(int i=1; i<h->list_limit; i++){
+                h->hist_list[i-1] = h->hist_list[i];
             }
-            hist_list[list_limit-1].command = strdup(cmd);
-            hist_list[list_limit-1].cmd_num = command_num;
+            h->hist_list[h->list_limit-1].command = strdup(cmd);
+            h->hist_list[h->list_limit-1].cmd_num = h->command_num;
         }
-        command_num++;
-        if(list_index>=list_limit){
-            maxed = true;
+        h->command_num++;
+        METRIC_INC(METRIC_HISTORY_INSERTS);
+        usage_record(cmd);
+        h->suggest.prefix_len = 0;
+        free(h->suggest.prefix);
+        h->suggest.prefix = NULL;
+        if(h->list_index>=h->list_limit){
+            h->maxed = true;
         }
     }
     
 }
 
 //print the current history
-void hist_print(void)
+void hist_print(FILE *out)
 {
-    for(int i = 0; i<list_limit; i++){
-    	if(strcmp(hist_list[i].command, "ENDOFLIST")!=0){
-        	printf("%u %s\n", hist_list[i].cmd_num, hist_list[i].command);
+    struct hist_state *h = state();
+    if (h == NULL) {
+        return;
+    }
+    for(int i = 0; i<h->list_limit; i++){
+    	if(strcmp(h->hist_list[i].command, "ENDOFLIST")!=0){
+        	fprintf(out, "%u %s\n", h->hist_list[i].cmd_num, h->hist_list[i].command);
     	}
     }
 }
@@ -93,20 +282,112 @@ void hist_print(void)
 //search the history list by a prefix (to be used by autocomplete)
 const char *hist_search_prefix(char *prefix)
 {
-    for(int i = list_limit-1; i>=0; i--){
-    	if(hist_list[i].command!=NULL&&strncmp(hist_list[i].command, prefix, strlen(prefix))==0){
-    		return strdup(hist_list[i].command);
+    struct hist_state *h = state();
+    if (h == NULL) {
+        return NULL;
+    }
+    for(int i = h->list_limit-1; i>=0; i--){
+    	if(h->hist_list[i].command!=NULL&&strncmp(h->hist_list[i].command, prefix, strlen(prefix))==0){
+    		return strdup(h->hist_list[i].command);
     	}
     }
     return NULL;
 }
 
+//the entry with a command number, if it is still in the list
+static const char *cnum_entry(unsigned int cnum)
+{
+    struct hist_state *h = state();
+    if (h->list_index == 0 || cnum < h->hist_list[0].cmd_num
+            || cnum - h->hist_list[0].cmd_num >= h->list_index) {
+        return NULL;
+    }
+    return h->hist_list[cnum - h->hist_list[0].cmd_num].command;
+}
+
+//true if entry starts with prefix and has something left to suggest
+static bool suggests(const char *entry, const char *prefix, size_t prefix_len)
+{
+    return entry != NULL && strncmp(entry, prefix, prefix_len) == 0
+        && entry[prefix_len] != '\0';
+}
+
+static long long elapsed_ns(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000000LL + (now.tv_nsec - start->tv_nsec);
+}
+
+/**
+ * Find the most recent entry that starts with prefix and is longer than it,
+ * for inline suggestions. The result points into the history list and stays
+ * valid until the next hist_add. The previous lookup is reused: when the
+ * prefix only grew, nothing newer than the previous answer can match, so the
+ * search resumes from there. A lookup that runs out of its time budget
+ * returns NULL and picks up where it stopped on the next keystroke.
+ */
+const char *hist_suggest(const char *prefix)
+{
+    struct hist_state *h = state();
+    size_t prefix_len = strlen(prefix);
+    if (prefix_len == 0 || h->list_index == 0) {
+        return NULL;
+    }
+
+    bool extends = h->suggest.prefix != NULL && prefix_len >= h->suggest.prefix_len
+        && strncmp(prefix, h->suggest.prefix, h->suggest.prefix_len) == 0;
+    unsigned int resume = h->hist_list[h->list_index - 1].cmd_num;
+    if (extends) {
+        const char *previous = cnum_entry(h->suggest.answer);
+        if (suggests(previous, prefix, prefix_len)) {
+            goto remember;
+        } else if (h->suggest.answer != 0) {
+            resume = h->suggest.answer - 1;
+        } else if (h->suggest.complete) {
+            goto remember;
+        } else {
+            resume = h->suggest.resume;
+        }
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    h->suggest.answer = 0;
+    h->suggest.complete = true;
+    for (unsigned int cnum = resume, checked = 0;
+            cnum >= h->hist_list[0].cmd_num && cnum > 0; cnum--, checked++) {
+        if (checked % SUGGEST_CHECK_EVERY == SUGGEST_CHECK_EVERY - 1
+                && elapsed_ns(&start) > SUGGEST_BUDGET_NS) {
+            h->suggest.complete = false;
+            h->suggest.resume = cnum;
+            break;
+        }
+        if (suggests(cnum_entry(cnum), prefix, prefix_len)) {
+            h->suggest.answer = cnum;
+            break;
+        }
+    }
+
+remember:
+    if (!extends || prefix_len != h->suggest.prefix_len) {
+        free(h->suggest.prefix);
+        h->suggest.prefix = strdup(prefix);
+        h->suggest.prefix_len = prefix_len;
+    }
+    return h->suggest.answer != 0 ? cnum_entry(h->suggest.answer) : NULL;
+}
+
 //search the history by the command number
 const char *hist_search_cnum(int command_number)
 {
-    for(int i = 0; i<list_limit; i++){
-    	if(hist_list[i].cmd_num==command_number){
-    		return strdup(hist_list[i].command);
+    struct hist_state *h = state();
+    if (h == NULL) {
+        return NULL;
+    }
+    for(int i = 0; i<h->list_limit; i++){
+    	if(h->hist_list[i].cmd_num==command_number){
+    		return strdup(h->hist_list[i].command);
     	}
     }
     return NULL;
@@ -114,26 +395,27 @@ const char *hist_search_cnum(int command_number)
 
 //search the history for a command starting with a prefix starting from a certain index
 struct index_navigator hist_search_prefix_index(char *prefix, int start_index, bool up) {
+    struct hist_state *h = state();
 	if (!up) {
-		for(int i = start_index; i<list_limit; i++){
-    		if(hist_list[i].command!=NULL&&strncmp(hist_list[i].command, prefix, strlen(prefix))==0){
-                if (i<list_limit-1) {
-    			    struct index_navigator return_struct = { .result=strdup(hist_list[i].command), .index=i+1};
+		for(int i = start_index; i<h->list_limit; i++){
+    		if(h->hist_list[i].command!=NULL&&strncmp(h->hist_list[i].command, prefix, strlen(prefix))==0){
+                if (i<h->list_limit-1) {
+    			    struct index_navigator return_struct = { .result=strdup(h->hist_list[i].command), .index=i+1};
                     return return_struct;
                 } else {
-                    struct index_navigator return_struct = { .result=strdup(hist_list[i].command), .index=i};
+                    struct index_navigator return_struct = { .result=strdup(h->hist_list[i].command), .index=i};
                     return return_struct;
                 }
     		}
     	}
 	} else {
 		for(int i = start_index; i>=0; i--){
-    		if(hist_list[i].command!=NULL&&strncmp(hist_list[i].command, prefix, strlen(prefix))==0){
+    		if(h->hist_list[i].command!=NULL&&strncmp(h->hist_list[i].command, prefix, strlen(prefix))==0){
                 if (i>0) {
-    			    struct index_navigator return_struct = { .result=strdup(hist_list[i].command), .index=i-1};
+    			    struct index_navigator return_struct = { .result=strdup(h->hist_list[i].command), .index=i-1};
                     return return_struct;
                 } else {
-                    struct index_navigator return_struct = { .result=strdup(hist_list[i].command), .index=i};
+                    struct index_navigator return_struct = { .result=strdup(h->hist_list[i].command), .index=i};
                     return return_struct;
                 }
     		}
@@ -148,8 +430,9 @@ struct index_navigator hist_search_prefix_index(char *prefix, int start_index, b
 //gives the current size of the history
 unsigned int hist_size(void)
 {
-	for(unsigned int i = 0; i<=list_limit; i++){
-		if(strcmp(hist_list[i].command, "ENDOFLIST")==0){
+    struct hist_state *h = state();
+	for(unsigned int i = 0; i<=h->list_limit; i++){
+		if(strcmp(h->hist_list[i].command, "ENDOFLIST")==0){
 			return i;
 		} 
 	}
@@ -160,23 +443,30 @@ unsigned int hist_size(void)
 //return last command number
 unsigned int hist_last_cnum(void)
 {
-    return command_num-1;
+    struct hist_state *h = state();
+    if (h == NULL) {
+        return 0;
+    }
+    return h->command_num-1;
 }
 
 //return the last command number still in the list
 unsigned int hist_bottom_cnum(void)
 {
-	return hist_list[0].cmd_num;
+    struct hist_state *h = state();
+	return h->hist_list[0].cmd_num;
 }
 
 //return the history limit
 unsigned int hist_get_limit(void)
 {
-	return list_limit-1;
+    struct hist_state *h = state();
+	return h->list_limit-1;
 }
 
 //convert an index to a command number
 unsigned int index_to_cnum(int index)
 {
-	return hist_list[index].cmd_num;
+    struct hist_state *h = state();
+	return h->hist_list[index].cmd_num;
 }
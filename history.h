@@ -5,6 +5,7 @@
  */
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdio.h>
 #ifndef _HISTORY_H_
 #define _HISTORY_H_
 
@@ -26,13 +27,16 @@ unsigned int hist_get_limit(void);
 void hist_init(unsigned int);
 void hist_destroy(void);
 void hist_add(char *);
-void hist_print(void);
+void hist_print(FILE *);
 const char *hist_search_prefix(char *);
+const char *hist_suggest(const char *);
 struct index_navigator hist_search_prefix_index(char *, int, bool);
 const char *hist_search_cnum(int);
 unsigned int hist_last_cnum(void);
 unsigned int hist_bottom_cnum(void);
 unsigned int hist_size(void);
 unsigned int index_to_cnum(int);
+unsigned int hist_usage_count(const char *);
+size_t hist_used_args(const char *, const char **, size_t);
 
 #endif
\ No newline at end of file
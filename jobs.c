@@ -0,0 +1,781 @@
+/**
+ * @file
+ *
+ * jobs
+ *
+ * background job table, child reaping and the job control stress test
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "jobs.h"
+#include "logger.h"
+#include "metrics.h"
+#include "schedule.h"
+#include "session.h"
+#include "shell.h"
+#include "trace.h"
+
+//the background jobs of one session
+struct job_table {
+    struct process jobs[MAX_JOBS]; //a list of background jobs
+    int size; //number of entries in the job list
+    struct job_class classes[MAX_CLASSES];
+    int class_count;
+};
+
+static int watch_fd = -1; //epoll instance told about every job's pidfd
+
+static long long reap_calls; //times the job table was polled
+
+static long long reap_ns; //total time spent polling the job table
+
+static long long now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static void start_queued(struct job_table *);
+
+//the job table of the session running on this thread, made on first use
+static struct job_table *table(void)
+{
+    struct session *session = session_current();
+    if (session->jobs == NULL) {
+        session->jobs = calloc(1, sizeof(struct job_table));
+    }
+    return session->jobs;
+}
+
+//the started, unreaped job with pid, or NULL if it isn't one of ours
+static struct process *find_running(struct job_table *t, pid_t pid)
+{
+    for (int i = 0; i < t->size; i++) {
+        if (t->jobs[i].background_pid == pid && !t->jobs[i].done
+                && t->jobs[i].queued_args == NULL) {
+            return &t->jobs[i];
+        }
+    }
+    return NULL;
+}
+
+//reap job if it has exited; false if it hasn't
+static bool reap(struct process *job)
+{
+    int status_local;
+    if (waitpid(job->background_pid, &status_local, WNOHANG) <= 0) {
+        return false;
+    }
+    TRACE_INSTANT(TRACE_SIGCHLD, job->background_pid);
+    METRIC_INC(METRIC_JOBS_REAPED);
+    job->status = status_local;
+    job->reaped_ns = now_ns();
+    job->done = true;
+    return true;
+}
+
+/**
+ * Reap every job in the current session that has finished, then start the
+ * queued jobs that now have room. Starting a job forks, so this must never
+ * be called from a signal handler.
+ *
+ * Exited children are found with waitid(WNOWAIT), which names one without
+ * reaping it, so it costs a call per finished job rather than one per job.
+ * A plain waitpid(-1) would steal foreground children from execute() (or
+ * from other sessions); when the child named isn't one of our jobs, every
+ * job is asked about in turn instead.
+ */
+void jobs_reap(void)
+{
+    long long start = now_ns();
+    struct job_table *t = table();
+    bool scan = false;
+    while (true) {
+        siginfo_t info = { 0 };
+        if (waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT) == -1 || info.si_pid == 0) {
+            break;
+        }
+        struct process *job = find_running(t, info.si_pid);
+        if (job == NULL || !reap(job)) {
+            scan = true;
+            break;
+        }
+    }
+    for (int i = 0; scan && i < t->size; i++) {
+        if (!t->jobs[i].done && t->jobs[i].queued_args == NULL) {
+            reap(&t->jobs[i]);
+        }
+    }
+    reap_calls++;
+    reap_ns += now_ns() - start;
+    start_queued(t);
+}
+
+/**
+ * Register the pidfd of every job started from now on with an epoll
+ * instance, so an event loop wakes up when one of them finishes.
+ */
+void jobs_watch(int epoll_fd)
+{
+    watch_fd = epoll_fd;
+}
+
+//tell the event loop, if there is one, to wake when a job exits
+static void watch(int pidfd)
+{
+    if (watch_fd != -1 && pidfd != -1) {
+        struct epoll_event event = { .events = EPOLLIN, .data.fd = pidfd };
+        epoll_ctl(watch_fd, EPOLL_CTL_ADD, pidfd, &event);
+    }
+}
+
+//the attributes a job runs with: its class's, overridden by its own
+static struct schedule effective(const struct job_table *t, const struct process *job)
+{
+    struct schedule sched = { 0 };
+    if (job->job_class != -1) {
+        sched = t->classes[job->job_class].sched;
+    }
+    schedule_merge(&sched, &job->sched);
+    return sched;
+}
+
+//start a job that was added without a pid, marking it done if that fails
+static void start(struct job_table *t, struct process *job)
+{
+    struct schedule sched = effective(t, job);
+    pid_t pid = launch(job->queued_args, &sched);
+    free(job->queued_args);
+    job->queued_args = NULL;
+    job->started_ns = now_ns();
+    if (pid == -1) {
+        job->status = 127 << 8;
+        job->reaped_ns = job->started_ns;
+        job->done = true;
+        return;
+    }
+    METRIC_INC(METRIC_JOBS_STARTED);
+    TRACE_INSTANT(TRACE_JOB_START, pid);
+    job->background_pid = pid;
+    job->pidfd = syscall(SYS_pidfd_open, pid, 0);
+    watch(job->pidfd);
+}
+
+//jobs of a class that have started and not been reaped
+static int class_running(const struct job_table *t, int job_class)
+{
+    int running = 0;
+    for (int i = 0; i < t->size; i++) {
+        const struct process *job = &t->jobs[i];
+        running += job->job_class == job_class && job->queued_args == NULL && !job->done;
+    }
+    return running;
+}
+
+//true if a job of the class can start now
+static bool class_has_slot(const struct job_table *t, int job_class)
+{
+    return job_class == -1 || t->classes[job_class].max_running == 0
+        || class_running(t, job_class) < t->classes[job_class].max_running;
+}
+
+//start queued jobs, oldest first, while their classes have room
+static void start_queued(struct job_table *t)
+{
+    for (int i = 0; i < t->size; i++) {
+        if (t->jobs[i].queued_args != NULL && class_has_slot(t, t->jobs[i].job_class)) {
+            start(t, &t->jobs[i]);
+        }
+    }
+}
+
+//copy a command's arguments into one allocation, to start it later
+static char **copy_args(char **args)
+{
+    size_t count = 0;
+    size_t bytes = 0;
+    for (; args[count] != NULL; count++) {
+        bytes += strlen(args[count]) + 1;
+    }
+    char **copy = malloc(sizeof(char *) * (count + 1) + bytes);
+    if (copy == NULL) {
+        return NULL;
+    }
+    char *text = (char *) &copy[count + 1];
+    for (size_t i = 0; i < count; i++) {
+        copy[i] = strcpy(text, args[i]);
+        text += strlen(args[i]) + 1;
+    }
+    copy[count] = NULL;
+    return copy;
+}
+
+/**
+ * Run a command in the background as a job of the given class (-1 for none)
+ * with its own scheduling attributes, if any. If the class is at its limit,
+ * or has jobs waiting already, the job waits its turn in the table. Returns
+ * -1 if the table is full or the job could not be started.
+ */
+int job_start(char **args, const char *command, int job_class, const struct schedule *sched)
+{
+    struct job_table *t = table();
+    if (t->size >= MAX_JOBS) {
+        return -1;
+    }
+    struct process *job = &t->jobs[t->size];
+    *job = (struct process) {
+        .command = strdup(command),
+        .pidfd = -1,
+        .job_class = job_class,
+        .queued_args = copy_args(args),
+    };
+    if (sched != NULL) {
+        job->sched = *sched;
+    }
+    if (job->command == NULL || job->queued_args == NULL) {
+        free(job->command);
+        free(job->queued_args);
+        return -1;
+    }
+    t->size++;
+
+    bool waiting = false; //an earlier job of the class is queued
+    for (int i = 0; i < t->size - 1 && job_class != -1; i++) {
+        waiting |= t->jobs[i].job_class == job_class && t->jobs[i].queued_args != NULL;
+    }
+    if (waiting || !class_has_slot(t, job_class)) {
+        return 0;
+    }
+    start(t, job);
+    if (job->done) {
+        free(job->command);
+        t->size--;
+        return -1;
+    }
+    return 0;
+}
+
+//print how a finished job ended
+static void print_done(FILE *out, const struct process *job)
+{
+    if (WIFSIGNALED(job->status)) {
+        fprintf(out, "[%d] Signal %d\t%s\n", job->background_pid,
+                WTERMSIG(job->status), job->command);
+    } else if (WEXITSTATUS(job->status) != 0) {
+        fprintf(out, "[%d] Exit %d\t%s\n", job->background_pid,
+                WEXITSTATUS(job->status), job->command);
+    } else {
+        fprintf(out, "[%d] Done\t%s\n", job->background_pid, job->command);
+    }
+}
+
+/**
+ * Drop finished jobs, printing a notice for each to out and noting their
+ * lifetimes in lifetimes; either may be NULL.
+ */
+static size_t collect(FILE *out, long long *lifetimes, size_t *lifetime_count)
+{
+    struct job_table *t = table();
+    jobs_reap();
+    size_t collected = 0;
+    int kept = 0;
+    for (int i = 0; i < t->size; i++) {
+        if (t->jobs[i].done) {
+            if (out != NULL) {
+                print_done(out, &t->jobs[i]);
+            }
+            if (lifetimes != NULL) {
+                lifetimes[(*lifetime_count)++] = t->jobs[i].reaped_ns - t->jobs[i].started_ns;
+            }
+            if (t->jobs[i].pidfd != -1) {
+                close(t->jobs[i].pidfd);
+            }
+            free(t->jobs[i].command);
+            collected++;
+        } else {
+            t->jobs[kept++] = t->jobs[i];
+        }
+    }
+    t->size = kept;
+    return collected;
+}
+
+//drop finished jobs from the list, returning how many there were
+size_t jobs_collect(void)
+{
+    return collect(NULL, NULL, NULL);
+}
+
+//drop finished jobs from the list, telling the user about each one
+size_t jobs_notify(FILE *out)
+{
+    size_t collected = collect(out, NULL, NULL);
+    if (collected > 0) {
+        fflush(out);
+    }
+    return collected;
+}
+
+//number of jobs that have finished but haven't been collected yet
+size_t jobs_finished(void)
+{
+    struct job_table *t = table();
+    jobs_reap();
+    size_t count = 0;
+    for (int i = 0; i < t->size; i++) {
+        if (t->jobs[i].done) {
+            count++;
+        }
+    }
+    return count;
+}
+
+//number of jobs that have not been reaped yet
+size_t jobs_running(void)
+{
+    struct job_table *t = table();
+    size_t count = 0;
+    for (int i = 0; i < t->size; i++) {
+        if (!t->jobs[i].done) {
+            count++;
+        }
+    }
+    return count;
+}
+
+//print the jobs that are still running, with their pids if pids is set
+void jobs_print(FILE *out, bool pids)
+{
+    jobs_collect();
+    struct job_table *t = table();
+    for (int i = 0; i < t->size; i++) {
+        if (t->jobs[i].command == NULL) {
+            continue;
+        }
+        if (pids && t->jobs[i].queued_args != NULL) {
+            fprintf(out, "queued\t");
+        } else if (pids) {
+            fprintf(out, "%d\t", t->jobs[i].background_pid);
+        }
+        fprintf(out, "%s\n", t->jobs[i].command);
+    }
+}
+
+//a signalfd that sees ^C while SIGINT is blocked (as under the event loop)
+static int interrupt_fd(void)
+{
+    sigset_t mask;
+    sigprocmask(SIG_BLOCK, NULL, &mask);
+    if (!sigismember(&mask, SIGINT)) {
+        return -1;
+    }
+    sigset_t sigint;
+    sigemptyset(&sigint);
+    sigaddset(&sigint, SIGINT);
+    return signalfd(-1, &sigint, SFD_NONBLOCK | SFD_CLOEXEC);
+}
+
+/**
+ * Block until the jobs with the given pids have finished, or until any one
+ * of them has if any is set; with no pids, every job counts. Sleeps on the
+ * jobs' pidfds rather than polling. Jobs waited for leave the table without
+ * a notice, and status gets the wait status of the last pid given (of the
+ * job that finished, with any). Returns -1 with errno set to ECHILD if there
+ * is nothing to wait for, or to EINTR if ^C interrupted the wait.
+ */
+int jobs_wait(const pid_t *pids, size_t count, bool any, int *status)
+{
+    struct job_table *t = table();
+    bool wanted[MAX_JOBS] = { false };
+    size_t targets = 0;
+    for (size_t j = 0; j < count; j++) {
+        int i;
+        for (i = 0; i < t->size && t->jobs[i].background_pid != pids[j]; i++);
+        if (i == t->size) {
+            fprintf(stderr, "wait: %d is not a background job\n", pids[j]);
+            errno = ECHILD;
+            return -1;
+        }
+        targets += !wanted[i];
+        wanted[i] = true;
+    }
+    if (count == 0) {
+        for (int i = 0; i < t->size; i++) {
+            wanted[i] = true;
+        }
+        targets = t->size;
+    }
+    *status = 0;
+    if (targets == 0) {
+        errno = ECHILD;
+        return any ? -1 : 0;
+    }
+
+    int sigint_fd = interrupt_fd();
+    struct pollfd *fds = malloc(sizeof(struct pollfd) * (t->size + 1));
+    int finished = -1;
+    int result = 0;
+    while (true) {
+        jobs_reap();
+        size_t nfds = 0;
+        size_t pending = 0;
+        bool blind = false; //a job without a pidfd has to be polled for
+        bool queued = false; //a job waits for others, wanted or not, to finish
+        finished = -1;
+        for (int i = 0; i < t->size; i++) {
+            if (wanted[i] && t->jobs[i].done) {
+                finished = finished == -1 ? i : finished;
+            } else if (wanted[i]) {
+                pending++;
+                queued |= t->jobs[i].queued_args != NULL;
+            }
+        }
+        for (int i = 0; i < t->size; i++) {
+            if (t->jobs[i].done || t->jobs[i].queued_args != NULL || !(wanted[i] || queued)) {
+                continue;
+            } else if (t->jobs[i].pidfd != -1) {
+                fds[nfds++] = (struct pollfd) { .fd = t->jobs[i].pidfd, .events = POLLIN };
+            } else {
+                blind = true;
+            }
+        }
+        if (any ? finished != -1 : pending == 0) {
+            break;
+        }
+
+        if (sigint_fd != -1) {
+            fds[nfds++] = (struct pollfd) { .fd = sigint_fd, .events = POLLIN };
+        }
+        /* The ^C is left pending for the event loop, as after a command */
+        int ready = poll(fds, nfds, blind ? WAIT_POLL_MS : -1);
+        if (ready > 0 && sigint_fd != -1 && (fds[nfds - 1].revents & POLLIN)) {
+            TRACE_INSTANT(TRACE_SIGINT, 0);
+            errno = EINTR;
+            result = -1;
+            break;
+        }
+    }
+    free(fds);
+    if (sigint_fd != -1) {
+        close(sigint_fd);
+    }
+    if (result == -1) {
+        return -1;
+    }
+
+    /* With any, only the job that finished has been waited for */
+    if (any) {
+        for (int i = 0; i < t->size; i++) {
+            wanted[i] = i == finished;
+        }
+        *status = t->jobs[finished].status;
+    } else if (count > 0) {
+        for (int i = 0; i < t->size; i++) {
+            if (t->jobs[i].background_pid == pids[count - 1]) {
+                *status = t->jobs[i].status;
+            }
+        }
+    }
+    int kept = 0;
+    for (int i = 0; i < t->size; i++) {
+        if (wanted[i]) {
+            if (t->jobs[i].pidfd != -1) {
+                close(t->jobs[i].pidfd);
+            }
+            free(t->jobs[i].command);
+        } else {
+            t->jobs[kept++] = t->jobs[i];
+        }
+    }
+    t->size = kept;
+    return 0;
+}
+
+static long long now_ms(void)
+{
+    return now_ns() / 1000000;
+}
+
+/**
+ * Wait for a foreground child, sending it SIGTERM once timeout_ms have passed
+ * and SIGKILL kill_after_ms after that. The deadline is kept by sleeping on
+ * the child's pidfd, so no watchdog process is needed; a timeout of 0 waits
+ * forever. Stores the wait status in status and returns 1 if the child had
+ * to be signalled, 0 if it finished in time, or -1 (with errno set and
+ * status zeroed) if it couldn't be waited for.
+ */
+int wait_timeout(pid_t pid, long long timeout_ms, long long kill_after_ms, int *status)
+{
+    int pidfd = syscall(SYS_pidfd_open, pid, 0);
+    long long deadline = timeout_ms > 0 ? now_ms() + timeout_ms : -1;
+    int signo = 0; //the last signal sent
+    pid_t waited;
+    *status = 0;
+    while ((waited = waitpid(pid, status, WNOHANG)) != pid) {
+        if (waited == -1 && errno == EINTR) {
+            continue;
+        } else if (waited == -1) {
+            int error = errno;
+            if (pidfd != -1) {
+                close(pidfd);
+            }
+            *status = 0;
+            errno = error;
+            return -1;
+        }
+        long long remaining = -1; //no deadline: sleep until the child exits
+        if (deadline != -1 && (remaining = deadline - now_ms()) <= 0) {
+            signo = signo == 0 ? SIGTERM : SIGKILL;
+            LOG("Timed out; sending signal %d to %d\n", signo, pid);
+            kill(pid, signo);
+            deadline = signo == SIGTERM ? now_ms() + kill_after_ms : -1;
+            continue;
+        }
+        if (pidfd != -1) {
+            struct pollfd child = { .fd = pidfd, .events = POLLIN };
+            poll(&child, 1, remaining);
+        } else {
+            poll(NULL, 0, remaining == -1 || remaining > WAIT_POLL_MS ? WAIT_POLL_MS : remaining);
+        }
+    }
+    if (pidfd != -1) {
+        close(pidfd);
+    }
+    return signo != 0;
+}
+
+/**
+ * Empty the job list and release it. Jobs still waiting for their class to
+ * have room are never started; starting them all now would break the limit,
+ * so each one dropped is reported instead.
+ */
+void free_jobs(void)
+{
+    struct session *session = session_current();
+    struct job_table *t = session->jobs;
+    if (t == NULL) {
+        return;
+    }
+    session->jobs = NULL;
+    for (int i = 0; i < t->size; i++) {
+        LOG("Freeing: %s\n", t->jobs[i].command);
+        if (t->jobs[i].queued_args != NULL) {
+            fprintf(stderr, "swish: queued job not started: %s\n", t->jobs[i].command);
+        }
+        if (t->jobs[i].pidfd != -1) {
+            close(t->jobs[i].pidfd);
+        }
+        free(t->jobs[i].command);
+        free(t->jobs[i].queued_args);
+    }
+    free(t);
+}
+
+/**
+ * The index of the job class called name, making it (with no limit) if it
+ * doesn't exist and create is set. Returns -1 if there is no such class or
+ * no room for another.
+ */
+int job_class_find(const char *name, bool create)
+{
+    struct job_table *t = table();
+    for (int i = 0; i < t->class_count; i++) {
+        if (strcmp(t->classes[i].name, name) == 0) {
+            return i;
+        }
+    }
+    if (!create || t->class_count >= MAX_CLASSES || strlen(name) >= CLASS_NAME_MAX) {
+        return -1;
+    }
+    struct job_class *job_class = &t->classes[t->class_count];
+    *job_class = (struct job_class) { 0 };
+    strcpy(job_class->name, name);
+    return t->class_count++;
+}
+
+struct job_class *job_class_get(int job_class)
+{
+    return &table()->classes[job_class];
+}
+
+/**
+ * Put a change to a class into effect: running jobs get its scheduling
+ * attributes (their own process, not any children they have started), and
+ * queued jobs start if the limit now allows. Returns -1 if some running job
+ * couldn't be rescheduled.
+ */
+int job_class_update(int job_class)
+{
+    struct job_table *t = table();
+    int result = 0;
+    for (int i = 0; i < t->size; i++) {
+        struct process *job = &t->jobs[i];
+        if (job->job_class != job_class || job->queued_args != NULL || job->done) {
+            continue;
+        }
+        struct schedule sched = effective(t, job);
+        if (schedule_apply(job->background_pid, &sched) == -1) {
+            result = -1;
+        }
+    }
+    jobs_reap();
+    return result;
+}
+
+//list the classes with their limits, how busy they are and their attributes
+void job_classes_print(FILE *out)
+{
+    struct job_table *t = table();
+    jobs_reap();
+    for (int i = 0; i < t->class_count; i++) {
+        int queued = 0;
+        for (int j = 0; j < t->size; j++) {
+            queued += t->jobs[j].job_class == i && t->jobs[j].queued_args != NULL;
+        }
+        char max[16] = "-";
+        if (t->classes[i].max_running > 0) {
+            snprintf(max, sizeof(max), "%d", t->classes[i].max_running);
+        }
+        char sched[512];
+        schedule_format(&t->classes[i].sched, sched, sizeof(sched));
+        fprintf(out, "%s\t%d/%s running\t%d queued\t%s\n", t->classes[i].name,
+                class_running(t, i), max, queued, sched);
+    }
+}
+
+static int compare_lifetimes(const void *a, const void *b)
+{
+    long long x = *(const long long *) a;
+    long long y = *(const long long *) b;
+    return (x > y) - (x < y);
+}
+
+//sleep until a child exits (or a short timeout passes), then reap
+static void wait_for_child(void)
+{
+    if (jobs_running() == 0) {
+        return;
+    }
+    /* SIGCHLD stays blocked so one that is already pending isn't missed */
+    struct timespec timeout = { 0, 10000000 };
+    sigset_t chld, old_mask;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, &old_mask);
+    sigtimedwait(&chld, NULL, &timeout);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    jobs_reap();
+}
+
+//start true | true pipelines until upto have been, counting in run_ok the ones that ran
+static void run_pipelines(size_t upto, size_t *ran, size_t *run_ok)
+{
+    for (; *ran < upto; (*ran)++) {
+        char true_cmd[] = "true", bar[] = "|", true_cmd2[] = "true";
+        char *pipeline[] = { true_cmd, bar, true_cmd2, NULL };
+        if (construct_pipeline(pipeline, 3, NULL) == 0) {
+            (*run_ok)++;
+        }
+    }
+}
+
+/**
+ * Launch job_count short-lived background jobs and pipeline_count pipelines,
+ * spread evenly between the jobs, as fast as the job table allows, then
+ * check that every pipeline ran and every child was reaped and the job list
+ * drained. Prints job lifetimes (fork to reap) and the cost of polling the
+ * job table; returns 0 if everything checked out.
+ *
+ * Signal handling itself isn't timed. Here SIGCHLD is taken synchronously
+ * with sigtimedwait, not through the event loop's signalfd, and all it
+ * triggers is a reap, so the cost per poll stands in for it.
+ */
+int jobs_stress(FILE *out, size_t job_count, size_t pipeline_count)
+{
+    jobs_collect();
+    struct job_table *t = table();
+    if (t->size != 0) {
+        fprintf(stderr, "stress: wait for the current jobs to finish first\n");
+        return -1;
+    }
+
+    long long *lifetimes = malloc(sizeof(long long) * (job_count + 1));
+    size_t lifetime_count = 0;
+    long long calls_before = reap_calls;
+    long long reap_before = reap_ns;
+    long long start = now_ns();
+    size_t launched = 0;
+    size_t failed = 0;
+    size_t pipelines = 0; //started so far
+    size_t pipelines_ok = 0; //of those, the ones construct_pipeline ran
+
+    if (job_count == 0) {
+        run_pipelines(pipeline_count, &pipelines, &pipelines_ok);
+    }
+    for (size_t i = 0; i < job_count || t->size > 0; ) {
+        collect(NULL, lifetimes, &lifetime_count);
+
+        if (i < job_count && t->size < MAX_JOBS / 2) {
+            char *args[] = { "true", NULL };
+            if (background_execute(args, 1, -1, NULL) == 0) {
+                launched++;
+            } else {
+                failed++;
+            }
+            i++;
+            run_pipelines(pipeline_count * i / job_count, &pipelines, &pipelines_ok);
+        } else {
+            wait_for_child();
+            if (i >= job_count && now_ns() - start > 60000000000LL) {
+                break;
+            }
+        }
+    }
+    long long elapsed = now_ns() - start;
+
+    /* Every child should be gone: nothing left to wait for, no zombies */
+    siginfo_t info = { 0 };
+    int leftover = waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT);
+    bool zombies = leftover == 0 && info.si_pid != 0;
+    bool consistent = t->size == 0 && lifetime_count == launched
+        && pipelines_ok == pipeline_count;
+
+    qsort(lifetimes, lifetime_count, sizeof(long long), compare_lifetimes);
+    long long calls = reap_calls - calls_before;
+    fprintf(out, "jobs launched:      %zu (%zu failed to start)\n", launched, failed);
+    fprintf(out, "jobs reaped:        %zu\n", lifetime_count);
+    fprintf(out, "pipelines:          %zu of %zu\n", pipelines_ok, pipeline_count);
+    fprintf(out, "elapsed:            %.3f s (%.0f jobs/s)\n", elapsed / 1e9,
+            launched / (elapsed / 1e9));
+    if (lifetime_count > 0) {
+        fprintf(out, "job lifetime us:    p50 %.1f  p99 %.1f  max %.1f\n",
+                lifetimes[lifetime_count / 2] / 1000.0,
+                lifetimes[lifetime_count * 99 / 100] / 1000.0,
+                lifetimes[lifetime_count - 1] / 1000.0);
+    }
+    fprintf(out, "reaping:            %lld polls, %.2f us per poll\n", calls,
+            calls > 0 ? (reap_ns - reap_before) / 1000.0 / calls : 0.0);
+    fprintf(out, "signal handling:    not timed; the reap per poll above stands in for it\n");
+    fprintf(out, "job list:           %s\n", consistent ? "consistent" : "INCONSISTENT");
+    fprintf(out, "zombies:            %s\n", zombies ? "FOUND" : "none");
+    fflush(out);
+    free(lifetimes);
+    return consistent && !zombies ? 0 : -1;
+}
@@ -0,0 +1,71 @@
+/**
+ * @file
+ *
+ * JOBS
+ * Tracks the commands running in the background, one table per session.
+ * Nothing here runs in signal context: finished jobs are reaped with
+ * waitpid(WNOHANG), either when the event loop is woken by a job's pidfd or
+ * before the next command runs.
+ *
+ * A job may belong to a named class that caps how many of its jobs run at
+ * once. Jobs over the cap wait in the table, in order, and are started by
+ * the poll that finds a slot free.
+ */
+
+#ifndef _JOBS_H_
+#define _JOBS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "schedule.h"
+
+#define MAX_JOBS 1024 //background jobs tracked at once
+
+#define WAIT_POLL_MS 10 //how often to check on a child when pidfds are unavailable
+
+#define MAX_CLASSES 16 //job classes in one session
+
+#define CLASS_NAME_MAX 32 //longest job class name, NUL included
+
+//struct containing info for a background process
+struct process {
+    char *command;
+    pid_t background_pid;
+    int pidfd; //readable once the job exits, -1 if pidfds are unavailable
+    int status;
+    bool done; //set once the child is reaped
+    long long started_ns;
+    long long reaped_ns;
+    int job_class; //index of the job's class, -1 if it has none
+    char **queued_args; //the command still to start, NULL once it runs
+    struct schedule sched; //the job's own attributes, over its class's
+};
+
+//a named limit on how many jobs run at once, with defaults for its jobs
+struct job_class {
+    char name[CLASS_NAME_MAX];
+    int max_running; //0 for no limit
+    struct schedule sched;
+};
+
+void jobs_reap(void);
+void jobs_watch(int);
+int job_start(char **, const char *, int, const struct schedule *);
+int job_class_find(const char *, bool);
+struct job_class *job_class_get(int);
+int job_class_update(int);
+void job_classes_print(FILE *);
+size_t jobs_collect(void);
+size_t jobs_notify(FILE *);
+size_t jobs_finished(void);
+size_t jobs_running(void);
+void jobs_print(FILE *, bool);
+int jobs_wait(const pid_t *, size_t, bool, int *);
+int wait_timeout(pid_t, long long, long long, int *);
+void free_jobs(void);
+int jobs_stress(FILE *, size_t, size_t);
+
+#endif
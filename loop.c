@@ -0,0 +1,160 @@
+/**
+ * @file
+ *
+ * loop
+ *
+ * epoll driven input, signal and job event loop
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+
+#include <readline/readline.h>
+
+#include "jobs.h"
+#include "logger.h"
+#include "loop.h"
+#include "metrics.h"
+#include "trace.h"
+
+#define LOOP_EVENTS 16 //events taken from epoll at once
+
+static int epoll_fd = -1;
+
+static int signal_fd = -1;
+
+static char *line_read; //the line readline handed back, if any
+
+static bool line_done; //true once readline has finished a line (or hit EOF)
+
+/**
+ * Block SIGCHLD and SIGINT and route them through a signalfd instead. The
+ * mask is inherited by everything forked from here on, so children restore
+ * it in session_child() before they exec.
+ */
+void loop_init(void)
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (signal_fd == -1 || epoll_fd == -1) {
+        perror("loop_init");
+        return;
+    }
+    struct epoll_event event = { .events = EPOLLIN, .data.fd = signal_fd };
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &event);
+    event.data.fd = STDIN_FILENO;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &event);
+    jobs_watch(epoll_fd);
+
+    /* Readline's own handlers would never run with the signals blocked */
+    rl_catch_signals = 0;
+}
+
+static void line_handler(char *line)
+{
+    line_read = line;
+    line_done = true;
+    rl_callback_handler_remove();
+}
+
+//^C while editing: drop the line and start over on a fresh prompt
+static void interrupt_line(void)
+{
+    TRACE_INSTANT(TRACE_SIGINT, SIGINT);
+    rl_replace_line("", 0);
+    rl_crlf();
+    rl_on_new_line();
+    rl_redisplay();
+}
+
+//print notices for finished jobs above the line being edited
+static void notify_jobs(void)
+{
+    if (jobs_finished() == 0) {
+        return;
+    }
+    rl_clear_visible_line();
+    jobs_notify(rl_outstream);
+    rl_forced_update_display();
+}
+
+/**
+ * Empty the signalfd, returning true if SIGCHLD was among the signals. A
+ * SIGINT only interrupts the line while editing; one left over from a
+ * foreground command just moves the prompt off the ^C.
+ */
+static bool read_signals(bool editing)
+{
+    bool child = false;
+    struct signalfd_siginfo info;
+    while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGINT && editing) {
+            interrupt_line();
+        } else if (info.ssi_signo == SIGINT) {
+            fputc('\n', stdout);
+        } else if (info.ssi_signo == SIGCHLD) {
+            child = true;
+        }
+    }
+    return child;
+}
+
+/**
+ * Show the prompt and run the event loop until readline has a full line.
+ * Returns the line (to be freed by the caller), or NULL at end of input.
+ */
+char *loop_readline(const char *prompt)
+{
+    if (epoll_fd == -1) {
+        return readline(prompt);
+    }
+
+    /* Jobs that finished while the last command ran are reported first */
+    read_signals(false);
+    jobs_notify(stdout);
+
+    line_read = NULL;
+    line_done = false;
+    rl_callback_handler_install(prompt, line_handler);
+    while (!line_done) {
+        struct epoll_event events[LOOP_EVENTS];
+        int ready = epoll_wait(epoll_fd, events, LOOP_EVENTS, LOOP_TICK_MS);
+        if (ready == -1 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+        metrics_tick();
+
+        bool jobs_changed = false;
+        for (int i = 0; i < ready && !line_done; i++) {
+            int fd = events[i].data.fd;
+            if (fd == STDIN_FILENO) {
+                rl_callback_read_char();
+            } else if (fd == signal_fd) {
+                jobs_changed |= read_signals(true);
+            } else {
+                /* A job's pidfd: the job has exited */
+                jobs_changed = true;
+            }
+        }
+        if (jobs_changed && !line_done) {
+            notify_jobs();
+        }
+    }
+    if (!line_done) {
+        rl_callback_handler_remove();
+    }
+    return line_read;
+}
@@ -0,0 +1,20 @@
+/**
+ * @file
+ *
+ * EVENT LOOP
+ * The interactive shell waits for input in one place: an epoll set holding
+ * the terminal, a signalfd for SIGCHLD and SIGINT, and the pidfd of every
+ * background job. Readline is driven through its callback interface, so
+ * signals and finished jobs are handled synchronously between keystrokes
+ * instead of in signal handlers.
+ */
+
+#ifndef _LOOP_H_
+#define _LOOP_H_
+
+#define LOOP_TICK_MS 1000 //longest the loop sleeps before running its timers
+
+void loop_init(void);
+char *loop_readline(const char *);
+
+#endif
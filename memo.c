@@ -0,0 +1,363 @@
+/**
+ * @file
+ *
+ * memo
+ *
+ * the memo builtin's content-addressed store of command results
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "memo.h"
+#include "metrics.h"
+#include "session.h"
+#include "shell.h"
+
+#define MEMO_VERSION "swish-memo-1" //hashed first, so a format change misses
+
+typedef unsigned __int128 memo_hash;
+
+#define FNV128_OFFSET ((memo_hash) 0x6c62272e07bb0142ULL << 64 | 0x62b821756295c58dULL)
+#define FNV128_PRIME ((memo_hash) 1 << 88 | 0x13b)
+
+//FNV-1a, 128 bits wide so distinct outputs don't end up sharing a file
+static void hash_bytes(memo_hash *hash, const void *data, size_t len)
+{
+    const unsigned char *bytes = data;
+    memo_hash h = *hash;
+    for (size_t i = 0; i < len; i++) {
+        h ^= bytes[i];
+        h *= FNV128_PRIME;
+    }
+    *hash = h;
+}
+
+//hash a string along with its terminator, so "ab" "c" differs from "a" "bc"
+static void hash_string(memo_hash *hash, const char *str)
+{
+    hash_bytes(hash, str, strlen(str) + 1);
+}
+
+//hash everything fd has from offset 0; returns -1 if it can't be read
+static int hash_fd(memo_hash *hash, int fd)
+{
+    char block[MEMO_BLOCK];
+    off_t offset = 0;
+    ssize_t n;
+    while ((n = pread(fd, block, sizeof(block), offset)) > 0) {
+        hash_bytes(hash, block, n);
+        offset += n;
+    }
+    return n == 0 ? 0 : -1;
+}
+
+static void hash_hex(memo_hash hash, char hex[MEMO_HASH_HEX])
+{
+    snprintf(hex, MEMO_HASH_HEX, "%016llx%016llx",
+            (unsigned long long) (hash >> 64), (unsigned long long) hash);
+}
+
+//find the store, creating its directories if needed; false if there is none
+static bool store_location(char store[PATH_MAX])
+{
+    char *dir = getenv("SWISH_MEMO_DIR");
+    char *xdg = getenv("XDG_CACHE_HOME");
+    char *home = getenv("HOME");
+    if (dir != NULL && dir[0] != '\0') {
+        snprintf(store, PATH_MAX, "%s", dir);
+    } else if (xdg != NULL && xdg[0] != '\0') {
+        snprintf(store, PATH_MAX, "%s/swish", xdg);
+        mkdir(xdg, 0700);
+        mkdir(store, 0700);
+        strncat(store, "/memo", PATH_MAX - strlen(store) - 1);
+    } else if (home != NULL) {
+        snprintf(store, PATH_MAX, "%s/.cache", home);
+        mkdir(store, 0700);
+        strncat(store, "/swish", PATH_MAX - strlen(store) - 1);
+        mkdir(store, 0700);
+        strncat(store, "/memo", PATH_MAX - strlen(store) - 1);
+    } else {
+        return false;
+    }
+    mkdir(store, 0700);
+    char sub[PATH_MAX + 8];
+    snprintf(sub, sizeof(sub), "%s/keys", store);
+    mkdir(sub, 0700);
+    snprintf(sub, sizeof(sub), "%s/objects", store);
+    return mkdir(sub, 0700) == 0 || errno == EEXIST;
+}
+
+/**
+ * The key a result is stored under: the working directory, the arguments,
+ * the declared environment variables, and the declared files by size and
+ * mtime or by content. A file that can't be opened counts as missing.
+ */
+static void memo_key(char **args, const struct memo_inputs *inputs, char key[MEMO_HASH_HEX])
+{
+    memo_hash hash = FNV128_OFFSET;
+    hash_string(&hash, MEMO_VERSION);
+
+    char cwd[PATH_MAX] = "";
+    struct session *session = session_current();
+    if (session->cwd_fd != -1) {
+        char link[32];
+        snprintf(link, sizeof(link), "/proc/self/fd/%d", session->cwd_fd);
+        ssize_t len = readlink(link, cwd, sizeof(cwd) - 1);
+        cwd[len > 0 ? len : 0] = '\0';
+    } else if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        cwd[0] = '\0';
+    }
+    hash_string(&hash, cwd);
+
+    for (size_t i = 0; args[i] != NULL; i++) {
+        hash_string(&hash, args[i]);
+    }
+    for (size_t i = 0; i < inputs->env_count; i++) {
+        char *value = getenv(inputs->env[i]);
+        hash_string(&hash, "env");
+        hash_string(&hash, inputs->env[i]);
+        hash_string(&hash, value != NULL ? value : "\x01unset");
+    }
+    for (size_t i = 0; i < inputs->stamped_count; i++) {
+        struct stat info;
+        int fd = session_open(inputs->stamped[i], O_PATH);
+        hash_string(&hash, "stamp");
+        hash_string(&hash, inputs->stamped[i]);
+        if (fd != -1 && fstat(fd, &info) == 0) {
+            long long stamp[] = { info.st_dev, info.st_ino, info.st_size,
+                info.st_mtim.tv_sec, info.st_mtim.tv_nsec };
+            hash_bytes(&hash, stamp, sizeof(stamp));
+        } else {
+            hash_string(&hash, "\x01missing");
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+    for (size_t i = 0; i < inputs->hashed_count; i++) {
+        int fd = session_open(inputs->hashed[i], O_RDONLY);
+        hash_string(&hash, "content");
+        hash_string(&hash, inputs->hashed[i]);
+        memo_hash content = FNV128_OFFSET;
+        if (fd != -1 && hash_fd(&content, fd) == 0) {
+            hash_bytes(&hash, &content, sizeof(content));
+        } else {
+            hash_string(&hash, "\x01missing");
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+    hash_hex(hash, key);
+}
+
+/**
+ * Copy all of fd to out_fd with sendfile, so it goes from the page cache to
+ * its destination without a trip through the shell. Falls back on read and
+ * write for destinations sendfile can't write to.
+ */
+static int replay(int fd, int out_fd)
+{
+    off_t offset = 0;
+    ssize_t n;
+    while ((n = sendfile(out_fd, fd, &offset, MEMO_BLOCK * 64)) > 0) {
+        continue;
+    }
+    if (n == -1 && (errno == EINVAL || errno == ENOSYS)) {
+        char block[MEMO_BLOCK];
+        while ((n = pread(fd, block, sizeof(block), offset)) > 0) {
+            if (write(out_fd, block, n) != n) {
+                return -1;
+            }
+            offset += n;
+        }
+    }
+    return n == 0 ? 0 : -1;
+}
+
+//replay the result stored under key; returns its exit status, or -1 on a miss
+static int lookup(const char *store, const char *key, int out_fd)
+{
+    char path[PATH_MAX + 64];
+    snprintf(path, sizeof(path), "%s/keys/%s", store, key);
+    FILE *entry = fopen(path, "re");
+    if (entry == NULL) {
+        return -1;
+    }
+    int code;
+    char object[MEMO_HASH_HEX];
+    int fields = fscanf(entry, "%d %32s", &code, object);
+    fclose(entry);
+    if (fields != 2) {
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/objects/%s", store, object);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    /* Once anything has been replayed, running it again would repeat it */
+    if (replay(fd, out_fd) == -1) {
+        perror("memo");
+    }
+    close(fd);
+    return code;
+}
+
+/**
+ * File the output in fd under its content hash (it may already be there from
+ * another command), then point key at it along with the exit code. tmp_path
+ * is where fd was made, or empty if it is an unnamed O_TMPFILE.
+ */
+static void remember(const char *store, const char *key, int fd, const char *tmp_path, int code)
+{
+    memo_hash content = FNV128_OFFSET;
+    char object[MEMO_HASH_HEX];
+    if (hash_fd(&content, fd) == -1) {
+        if (tmp_path[0] != '\0') {
+            unlink(tmp_path);
+        }
+        return;
+    }
+    hash_hex(content, object);
+
+    char path[PATH_MAX + 64];
+    snprintf(path, sizeof(path), "%s/objects/%s", store, object);
+    if (tmp_path[0] != '\0') {
+        rename(tmp_path, path);
+    } else {
+        char link[32];
+        snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+        if (linkat(AT_FDCWD, link, AT_FDCWD, path, AT_SYMLINK_FOLLOW) == -1 && errno != EEXIST) {
+            perror("memo");
+            return;
+        }
+    }
+
+    /* Written aside and renamed, so a reader never sees half an entry */
+    char entry_path[PATH_MAX + 96];
+    snprintf(path, sizeof(path), "%s/keys/%s", store, key);
+    snprintf(entry_path, sizeof(entry_path), "%s.%d", path, getpid());
+    FILE *entry = fopen(entry_path, "we");
+    if (entry == NULL) {
+        return;
+    }
+    fprintf(entry, "%d %s\n", code, object);
+    if (fclose(entry) == 0) {
+        rename(entry_path, path);
+    } else {
+        unlink(entry_path);
+    }
+}
+
+//run args with its output going to fd; returns its wait status, or -1
+static int run_to(char **args, int fd)
+{
+    struct session *session = session_current();
+    int output_fd = session->output_fd;
+    session->output_fd = fd;
+    pid_t child = launch(args, NULL);
+    session->output_fd = output_fd;
+    if (child == -1) {
+        return -1;
+    }
+    int status_local;
+    if (waitpid(child, &status_local, 0) == -1) {
+        return -1;
+    }
+    return status_local;
+}
+
+//true if command names a program that can be run, so its failure isn't kept
+static bool runnable(const char *command)
+{
+    if (strchr(command, '/') != NULL) {
+        return access(command, X_OK) == 0;
+    }
+    const char *path = getenv("PATH");
+    while (path != NULL && *path != '\0') {
+        size_t len = strcspn(path, ":");
+        char file[PATH_MAX];
+        snprintf(file, sizeof(file), "%.*s/%s", (int) len, path, command);
+        if (access(file, X_OK) == 0) {
+            return true;
+        }
+        path += len + (path[len] == ':');
+    }
+    return false;
+}
+
+/**
+ * Print the remembered output of args to out and return its wait status,
+ * running it (and remembering the result) if there is none yet or refresh is
+ * set. Returns -1 if the command couldn't be run.
+ */
+int memo_run(char **args, const struct memo_inputs *inputs, bool refresh, FILE *out)
+{
+    if (!runnable(args[0])) {
+        fprintf(stderr, "memo: %s: command not found\n", args[0]);
+        return 127 << 8;
+    }
+    fflush(out);
+    int out_fd = fileno(out);
+    char store[PATH_MAX];
+    bool stored = store_location(store);
+    char key[MEMO_HASH_HEX];
+    memo_key(args, inputs, key);
+
+    int code;
+    if (stored && !refresh && (code = lookup(store, key, out_fd)) != -1) {
+        METRIC_INC(METRIC_MEMO_HITS);
+        return code << 8;
+    }
+    METRIC_INC(METRIC_MEMO_MISSES);
+
+    /* The output goes to a file in the store, ready to be linked into place */
+    char tmp_path[PATH_MAX + 64] = "";
+    int fd = -1;
+    if (stored) {
+        snprintf(tmp_path, sizeof(tmp_path), "%s/objects", store);
+        fd = open(tmp_path, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+        tmp_path[0] = '\0';
+    }
+    if (fd == -1 && stored) {
+        snprintf(tmp_path, sizeof(tmp_path), "%s/objects/.tmpXXXXXX", store);
+        fd = mkostemp(tmp_path, O_CLOEXEC);
+    }
+    if (fd == -1) {
+        /* No store to write to: just run it */
+        stored = false;
+        tmp_path[0] = '\0';
+        fd = memfd_create("memo", MFD_CLOEXEC);
+    }
+    if (fd == -1) {
+        perror("memo");
+        return -1;
+    }
+
+    int status_local = run_to(args, fd);
+    if (status_local != -1 && WIFEXITED(status_local) && stored) {
+        remember(store, key, fd, tmp_path, WEXITSTATUS(status_local));
+    } else if (tmp_path[0] != '\0') {
+        unlink(tmp_path);
+    }
+    if (status_local != -1) {
+        replay(fd, out_fd);
+    }
+    close(fd);
+    return status_local;
+}
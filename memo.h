@@ -0,0 +1,42 @@
+/**
+ * @file
+ *
+ * MEMO
+ * memo runs a command once and replays its standard output and exit status
+ * on later runs, for the slow but repeatable commands scripts call over and
+ * over (code generators, dependency listings). A result is keyed by the
+ * working directory, the arguments, and whatever else the command is
+ * declared to depend on: environment variables, files by size and mtime,
+ * and files by content. Outputs are stored by the hash of their content
+ * under $SWISH_MEMO_DIR (default $XDG_CACHE_HOME/swish/memo), so commands
+ * that print the same thing share one file, and a hit is copied out with
+ * sendfile(2) without passing through the shell.
+ *
+ * Standard error is not kept, and a command killed by a signal is not
+ * remembered.
+ */
+
+#ifndef _MEMO_H_
+#define _MEMO_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#define MEMO_HASH_HEX 33 //a 128-bit hash in hex, with its NUL
+
+#define MEMO_BLOCK (128 * 1024) //bytes hashed or copied at a time
+
+//what a memoized command's output depends on besides its arguments
+struct memo_inputs {
+    char **env; //environment variables, by name
+    size_t env_count;
+    char **stamped; //files, by size and modification time
+    size_t stamped_count;
+    char **hashed; //files, by content
+    size_t hashed_count;
+};
+
+int memo_run(char **, const struct memo_inputs *, bool, FILE *);
+
+#endif
@@ -0,0 +1,178 @@
+/**
+ * @file
+ *
+ * metrics
+ *
+ * shell self-metrics counters and OpenMetrics export
+ */
+
+#include <malloc.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "logger.h"
+#include "metrics.h"
+
+#define DEFAULT_INTERVAL 15 //seconds between metrics file updates
+
+//name and help text of every counter
+static const struct {
+    const char *name;
+    const char *help;
+} metric_info[METRIC_COUNT] = {
+    [METRIC_FORKS] = { "forks", "Processes forked by the shell" },
+    [METRIC_EXECS] = { "execs", "Programs the shell tried to exec" },
+    [METRIC_EXEC_FAILURES] = { "exec_failures", "Execs that failed" },
+    [METRIC_PIPELINES] = { "pipelines", "Pipelines and redirections built" },
+    [METRIC_JOBS_STARTED] = { "jobs_started", "Background jobs started" },
+    [METRIC_JOBS_REAPED] = { "jobs_reaped", "Background jobs reaped" },
+    [METRIC_HISTORY_INSERTS] = { "history_inserts", "Commands added to the history" },
+    [METRIC_HISTORY_EVICTIONS] = { "history_evictions", "Commands dropped from a full history" },
+    [METRIC_COMPLETION_SCANS] = { "completion_scans", "Tab completions computed" },
+    [METRIC_CACHE_HITS] = { "cache_hits", "PATH directories reused from the on-disk cache" },
+    [METRIC_CACHE_MISSES] = { "cache_misses", "PATH directories that had to be rescanned" },
+    [METRIC_FAST_BUILTINS] = { "fast_builtins", "Utilities run in the shell without a fork" },
+    [METRIC_MEMO_HITS] = { "memo_hits", "memo commands replayed from the store" },
+    [METRIC_MEMO_MISSES] = { "memo_misses", "memo commands that had to run" },
+};
+
+static uint64_t *counters; //shared with children until they exec
+
+static char *metrics_file; //where to write the OpenMetrics text, if anywhere
+
+static long metrics_interval; //seconds between writes
+
+static time_t last_write; //when the file was last written
+
+static pid_t metrics_pid; //the shell itself, not a child that exits without exec
+
+/* Server sessions tick from their own threads and share the temporary file */
+static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void metrics_flush(void);
+
+//map the counters and pick up the export settings from the environment
+void metrics_init(void)
+{
+    if (counters == NULL) {
+        void *map = mmap(NULL, sizeof(uint64_t) * METRIC_COUNT,
+                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (map != MAP_FAILED) {
+            counters = map;
+        }
+    }
+
+    if (metrics_pid == 0) {
+        atexit(metrics_flush);
+    }
+    metrics_pid = getpid();
+    metrics_file = getenv("SWISH_METRICS_FILE");
+    char *interval = getenv("SWISH_METRICS_INTERVAL");
+    metrics_interval = interval != NULL ? strtol(interval, NULL, 10) : 0;
+    if (metrics_interval <= 0) {
+        metrics_interval = DEFAULT_INTERVAL;
+    }
+}
+
+void metric_add(enum metric metric, uint64_t amount)
+{
+    if (counters != NULL) {
+        __atomic_fetch_add(&counters[metric], amount, __ATOMIC_RELAXED);
+    }
+}
+
+uint64_t metric_get(enum metric metric)
+{
+    return counters != NULL ? __atomic_load_n(&counters[metric], __ATOMIC_RELAXED) : 0;
+}
+
+//bytes currently handed out by malloc
+static size_t heap_bytes(void)
+{
+    return mallinfo2().uordblks;
+}
+
+//print the counters for the stats builtin
+void metrics_print(FILE *out)
+{
+    for (int i = 0; i < METRIC_COUNT; i++) {
+        fprintf(out, "%-20s %llu\n", metric_info[i].name,
+                (unsigned long long) metric_get(i));
+    }
+    fprintf(out, "%-20s %zu\n", "bytes_allocated", heap_bytes());
+    fprintf(out, "%-20s %zu\n", "arena_high_water", arena_high_water());
+}
+
+//write the counters in the OpenMetrics text format, replacing path atomically
+int metrics_write(const char *path)
+{
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, getpid());
+    FILE *out = fopen(tmp_path, "w");
+    if (out == NULL) {
+        return -1;
+    }
+
+    pid_t pid = getpid();
+    for (int i = 0; i < METRIC_COUNT; i++) {
+        fprintf(out, "# TYPE swish_%s counter\n", metric_info[i].name);
+        fprintf(out, "# HELP swish_%s %s.\n", metric_info[i].name, metric_info[i].help);
+        fprintf(out, "swish_%s_total{pid=\"%d\"} %llu\n", metric_info[i].name,
+                pid, (unsigned long long) metric_get(i));
+    }
+    fprintf(out, "# TYPE swish_bytes_allocated gauge\n");
+    fprintf(out, "# HELP swish_bytes_allocated Heap bytes currently allocated.\n");
+    fprintf(out, "swish_bytes_allocated{pid=\"%d\"} %zu\n", pid, heap_bytes());
+    fprintf(out, "# TYPE swish_arena_high_water_bytes gauge\n");
+    fprintf(out, "# HELP swish_arena_high_water_bytes Most arena memory one command has used.\n");
+    fprintf(out, "swish_arena_high_water_bytes{pid=\"%d\"} %zu\n", pid, arena_high_water());
+    fprintf(out, "# EOF\n");
+
+    if (fclose(out) != 0 || rename(tmp_path, path) == -1) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+//write the metrics file if one is configured and it is due
+void metrics_tick(void)
+{
+    if (metrics_file == NULL || pthread_mutex_trylock(&write_lock) != 0) {
+        return;
+    }
+    time_t now = time(NULL);
+    if (now - last_write >= metrics_interval) {
+        last_write = now;
+        if (metrics_write(metrics_file) == -1) {
+            LOG("Could not write metrics to %s\n", metrics_file);
+        }
+    }
+    pthread_mutex_unlock(&write_lock);
+}
+
+/**
+ * Write the metrics file now if one is configured, so the last counts are
+ * kept when the shell exits or becomes a -c command. Runs at exit, where a
+ * forked child that never exec'd must leave the file alone.
+ */
+void metrics_flush(void)
+{
+    if (metrics_file == NULL || getpid() != metrics_pid) {
+        return;
+    }
+    pthread_mutex_lock(&write_lock);
+    last_write = time(NULL);
+    if (metrics_write(metrics_file) == -1) {
+        LOG("Could not write metrics to %s\n", metrics_file);
+    }
+    pthread_mutex_unlock(&write_lock);
+}
@@ -0,0 +1,49 @@
+/**
+ * @file
+ *
+ * METRICS
+ * Always-on counters describing what the shell has been doing. Bumping a
+ * counter is a single relaxed atomic add, safe from signal handlers and
+ * forked children (the counters live in memory shared with them until they
+ * exec). `stats` prints the counters and, if SWISH_METRICS_FILE is set, they
+ * are periodically written there in the OpenMetrics text format: after a
+ * command or while the prompt waits, once SWISH_METRICS_INTERVAL seconds have
+ * passed, and once more when the shell exits.
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+//the counters the shell keeps
+enum metric {
+    METRIC_FORKS,
+    METRIC_EXECS,
+    METRIC_EXEC_FAILURES,
+    METRIC_PIPELINES,
+    METRIC_JOBS_STARTED,
+    METRIC_JOBS_REAPED,
+    METRIC_HISTORY_INSERTS,
+    METRIC_HISTORY_EVICTIONS,
+    METRIC_COMPLETION_SCANS,
+    METRIC_CACHE_HITS,
+    METRIC_CACHE_MISSES,
+    METRIC_FAST_BUILTINS,
+    METRIC_MEMO_HITS,
+    METRIC_MEMO_MISSES,
+    METRIC_COUNT
+};
+
+void metrics_init(void);
+void metric_add(enum metric, uint64_t);
+uint64_t metric_get(enum metric);
+void metrics_print(FILE *);
+int metrics_write(const char *);
+void metrics_tick(void);
+void metrics_flush(void);
+
+#define METRIC_INC(metric) metric_add((metric), 1)
+
+#endif
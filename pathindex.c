@@ -0,0 +1,558 @@
+/**
+ * @file
+ *
+ * path index
+ *
+ * scans the PATH in the background so tab completion doesn't have to
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "fuzzy.h"
+#include "logger.h"
+#include "metrics.h"
+#include "pathindex.h"
+#include "trace.h"
+
+#define MAX_WORKERS 8
+
+#define CACHE_MAGIC "SWISHIDX"
+#define CACHE_VERSION 1
+
+//the executables found in a single PATH directory
+struct dir_scan {
+    char *path;
+    char **names;
+    size_t count;
+    bool exists;
+    bool cached;
+    struct stat stats;
+};
+
+/**
+ * On-disk cache layout. Everything after the header is an array of fixed-size
+ * records followed by a string table, so the file can be used straight out of
+ * an mmap:
+ *
+ *   struct cache_header
+ *   struct cache_dir dirs[dir_count]
+ *   uint64_t names[name_count]    (string table offsets, sorted, unique)
+ *   uint64_t refs[ref_count]      (indices into names, grouped by directory)
+ *   char strtab[strtab_size]
+ */
+struct cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t dir_count;
+    uint64_t name_count;
+    uint64_t ref_count;
+    uint64_t strtab_size;
+    uint64_t path_env;
+};
+
+//a PATH directory as it looked when it was scanned
+struct cache_dir {
+    uint64_t path;
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t first_ref;
+    uint64_t ref_count;
+};
+
+static const struct cache_header *cache; //the mapped cache file, if valid
+
+static size_t cache_size; //size of the mapping
+
+static const struct cache_dir *cache_dirs;
+
+static const uint64_t *cache_names;
+
+static const uint64_t *cache_refs;
+
+static const char *cache_strtab;
+
+static char *cache_file; //where the cache lives on disk
+
+static char *path_env; //the PATH this index was built from
+
+static struct dir_scan *scans; //one entry per PATH directory
+
+static size_t scan_count; //number of PATH directories
+
+static size_t next_scan; //next directory to be claimed by a worker
+
+static size_t active_workers; //workers that have not finished yet
+
+static struct path_index *published; //the finished index, NULL until ready
+
+//true for regular files that somebody is allowed to execute
+bool is_executable(const struct stat *stats)
+{
+    return S_ISREG(stats->st_mode)
+        && (stats->st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)) != 0;
+}
+
+//find where the cache lives, creating its directory if needed
+static char *cache_location(void)
+{
+    char dir[PATH_MAX];
+    char *xdg = getenv("XDG_CACHE_HOME");
+    char *home = getenv("HOME");
+    if (xdg != NULL && xdg[0] != '\0') {
+        snprintf(dir, sizeof(dir), "%s", xdg);
+    } else if (home != NULL) {
+        snprintf(dir, sizeof(dir), "%s/.cache", home);
+    } else {
+        return NULL;
+    }
+    mkdir(dir, 0700);
+    strncat(dir, "/swish", sizeof(dir) - strlen(dir) - 1);
+    mkdir(dir, 0700);
+
+    char file[PATH_MAX + 16];
+    snprintf(file, sizeof(file), "%s/pathindex", dir);
+    return strdup(file);
+}
+
+//map the cache file and make sure it is sane before anything trusts it
+static void cache_open(void)
+{
+    int fd = open(cache_file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+    struct stat stats;
+    if (fstat(fd, &stats) == -1 || stats.st_size < sizeof(struct cache_header)) {
+        close(fd);
+        return;
+    }
+    void *map = mmap(NULL, stats.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return;
+    }
+
+    const struct cache_header *header = map;
+    size_t size = stats.st_size;
+    size_t tables = sizeof(struct cache_header)
+        + header->dir_count * sizeof(struct cache_dir)
+        + header->name_count * sizeof(uint64_t)
+        + header->ref_count * sizeof(uint64_t);
+    if (memcmp(header->magic, CACHE_MAGIC, 8) != 0
+            || header->version != CACHE_VERSION
+            || header->name_count > size || header->ref_count > size
+            || tables > size || size - tables != header->strtab_size
+            || header->strtab_size == 0
+            || ((const char *) map)[size - 1] != '\0') {
+        LOGP("Ignoring stale or corrupt PATH cache\n");
+        munmap(map, size);
+        return;
+    }
+
+    cache_dirs = (const struct cache_dir *) (header + 1);
+    cache_names = (const uint64_t *) (cache_dirs + header->dir_count);
+    cache_refs = cache_names + header->name_count;
+    cache_strtab = (const char *) (cache_refs + header->ref_count);
+
+    /* Bad offsets would send us outside the mapping */
+    bool valid = header->path_env < header->strtab_size;
+    for (uint64_t i = 0; valid && i < header->name_count; i++) {
+        valid = cache_names[i] < header->strtab_size;
+    }
+    for (uint64_t i = 0; valid && i < header->ref_count; i++) {
+        valid = cache_refs[i] < header->name_count;
+    }
+    for (uint32_t i = 0; valid && i < header->dir_count; i++) {
+        valid = cache_dirs[i].path < header->strtab_size
+            && cache_dirs[i].first_ref <= header->ref_count
+            && cache_dirs[i].ref_count <= header->ref_count - cache_dirs[i].first_ref;
+    }
+    if (!valid) {
+        LOGP("Ignoring corrupt PATH cache\n");
+        munmap(map, size);
+        return;
+    }
+
+    cache = header;
+    cache_size = size;
+}
+
+//serve the cached index straight out of the mapping until the scan is done
+static void cache_publish(void)
+{
+    if (cache == NULL || strcmp(cache_strtab + cache->path_env, path_env) != 0) {
+        return;
+    }
+
+    struct path_index *index = malloc(sizeof(struct path_index));
+    index->names = malloc(sizeof(char *) * (cache->name_count + 1));
+    index->count = cache->name_count;
+    index->masks = malloc(sizeof(uint64_t) * (cache->name_count + 1));
+    for (uint64_t i = 0; i < cache->name_count; i++) {
+        index->names[i] = (char *) cache_strtab + cache_names[i];
+        index->masks[i] = fuzzy_mask(index->names[i]);
+    }
+    index->names[index->count] = NULL;
+
+    __atomic_store_n(&published, index, __ATOMIC_RELEASE);
+    LOG("Serving %zu cached PATH entries\n", index->count);
+}
+
+//reuse a directory's cached names if it hasn't changed since the last scan
+static bool cache_reuse(struct dir_scan *scan)
+{
+    if (cache == NULL) {
+        return false;
+    }
+    for (uint32_t i = 0; i < cache->dir_count; i++) {
+        const struct cache_dir *dir = &cache_dirs[i];
+        if (strcmp(cache_strtab + dir->path, scan->path) != 0) {
+            continue;
+        }
+        if (dir->dev != scan->stats.st_dev || dir->ino != scan->stats.st_ino
+                || dir->mtime_sec != scan->stats.st_mtim.tv_sec
+                || dir->mtime_nsec != scan->stats.st_mtim.tv_nsec) {
+            return false;
+        }
+        scan->names = malloc(sizeof(char *) * (dir->ref_count + 1));
+        for (uint64_t j = 0; j < dir->ref_count; j++) {
+            uint64_t name = cache_refs[dir->first_ref + j];
+            scan->names[scan->count++] = strdup(cache_strtab + cache_names[name]);
+        }
+        scan->cached = true;
+        return true;
+    }
+    return false;
+}
+
+//collect the names of the executables in one directory
+static void scan_directory(struct dir_scan *scan)
+{
+    DIR *directory_stream = opendir(scan->path);
+    if (directory_stream == NULL) {
+        return;
+    }
+    if (fstat(dirfd(directory_stream), &scan->stats) == -1) {
+        closedir(directory_stream);
+        return;
+    }
+    scan->exists = true;
+    if (cache_reuse(scan)) {
+        METRIC_INC(METRIC_CACHE_HITS);
+        closedir(directory_stream);
+        return;
+    }
+    METRIC_INC(METRIC_CACHE_MISSES);
+
+    size_t max = 64;
+    scan->names = malloc(sizeof(char *) * max);
+
+    struct dirent *entry;
+    while ((entry = readdir(directory_stream)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        if (entry->d_type != DT_REG && entry->d_type != DT_LNK
+                && entry->d_type != DT_UNKNOWN) {
+            continue;
+        }
+        struct stat stats;
+        if (fstatat(dirfd(directory_stream), entry->d_name, &stats, 0) == -1
+                || !is_executable(&stats)) {
+            continue;
+        }
+        if (scan->count == max) {
+            max *= 2;
+            char **temp_names = realloc(scan->names, sizeof(char *) * max);
+            if (temp_names == NULL) {
+                break;
+            }
+            scan->names = temp_names;
+        }
+        scan->names[scan->count++] = strdup(entry->d_name);
+    }
+    closedir(directory_stream);
+}
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+//write the fresh index out for the next shell, replacing the old file atomically
+static void cache_write(struct path_index *index)
+{
+    char tmp_file[PATH_MAX];
+    snprintf(tmp_file, sizeof(tmp_file), "%s.XXXXXX", cache_file);
+    int fd = mkstemp(tmp_file);
+    if (fd == -1) {
+        return;
+    }
+    FILE *out = fdopen(fd, "w");
+
+    struct cache_header header = { .magic = CACHE_MAGIC, .version = CACHE_VERSION };
+    uint64_t *name_offsets = malloc(sizeof(uint64_t) * (index->count + 1));
+
+    /* The PATH goes first in the string table, then every unique name */
+    header.path_env = 0;
+    header.strtab_size = strlen(path_env) + 1;
+    for (size_t i = 0; i < index->count; i++) {
+        name_offsets[i] = header.strtab_size;
+        header.strtab_size += strlen(index->names[i]) + 1;
+    }
+    header.name_count = index->count;
+
+    struct cache_dir *dirs = calloc(scan_count + 1, sizeof(struct cache_dir));
+    for (size_t i = 0; i < scan_count; i++) {
+        if (!scans[i].exists) {
+            continue;
+        }
+        struct cache_dir *dir = &dirs[header.dir_count++];
+        dir->path = header.strtab_size;
+        header.strtab_size += strlen(scans[i].path) + 1;
+        dir->dev = scans[i].stats.st_dev;
+        dir->ino = scans[i].stats.st_ino;
+        dir->mtime_sec = scans[i].stats.st_mtim.tv_sec;
+        dir->mtime_nsec = scans[i].stats.st_mtim.tv_nsec;
+        dir->first_ref = header.ref_count;
+        dir->ref_count = scans[i].count;
+        header.ref_count += scans[i].count;
+    }
+
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(dirs, sizeof(struct cache_dir), header.dir_count, out);
+    fwrite(name_offsets, sizeof(uint64_t), index->count, out);
+    for (size_t i = 0; i < scan_count; i++) {
+        if (!scans[i].exists) {
+            continue;
+        }
+        for (size_t j = 0; j < scans[i].count; j++) {
+            char **found = bsearch(&scans[i].names[j], index->names,
+                    index->count, sizeof(char *), compare_names);
+            uint64_t ref = found - index->names;
+            fwrite(&ref, sizeof(uint64_t), 1, out);
+        }
+    }
+    fwrite(path_env, 1, strlen(path_env) + 1, out);
+    for (size_t i = 0; i < index->count; i++) {
+        fwrite(index->names[i], 1, strlen(index->names[i]) + 1, out);
+    }
+    for (size_t i = 0; i < scan_count; i++) {
+        if (scans[i].exists) {
+            fwrite(scans[i].path, 1, strlen(scans[i].path) + 1, out);
+        }
+    }
+
+    if (fclose(out) != 0 || rename(tmp_file, cache_file) == -1) {
+        unlink(tmp_file);
+    }
+    free(dirs);
+    free(name_offsets);
+}
+
+//merge the per-directory results into a single sorted index and publish it
+static void publish_index(void)
+{
+    size_t total = 0;
+    /* A reordered or shorter PATH rescans nothing, but the cache keyed on
+     * the old one would never be served again */
+    bool changed = cache == NULL || strcmp(cache_strtab + cache->path_env, path_env) != 0;
+    for (size_t i = 0; i < scan_count; i++) {
+        total += scans[i].count;
+        changed = changed || (scans[i].exists && !scans[i].cached);
+    }
+
+    struct path_index *index = malloc(sizeof(struct path_index));
+    index->names = malloc(sizeof(char *) * (total + 1));
+    index->count = 0;
+    char **duplicates = malloc(sizeof(char *) * (total + 1));
+    size_t duplicate_count = 0;
+
+    for (size_t i = 0; i < scan_count; i++) {
+        for (size_t j = 0; j < scans[i].count; j++) {
+            index->names[index->count++] = scans[i].names[j];
+        }
+    }
+
+    qsort(index->names, index->count, sizeof(char *), compare_names);
+
+    /* The same command may live in several PATH directories */
+    size_t unique = 0;
+    for (size_t i = 0; i < index->count; i++) {
+        if (unique > 0 && strcmp(index->names[unique - 1], index->names[i]) == 0) {
+            duplicates[duplicate_count++] = index->names[i];
+            continue;
+        }
+        index->names[unique++] = index->names[i];
+    }
+    index->count = unique;
+    index->names[unique] = NULL;
+
+    index->masks = malloc(sizeof(uint64_t) * (unique + 1));
+    for (size_t i = 0; i < unique; i++) {
+        index->masks[i] = fuzzy_mask(index->names[i]);
+    }
+
+    __atomic_store_n(&published, index, __ATOMIC_RELEASE);
+
+    if (changed && cache_file != NULL) {
+        LOGP("Rewriting PATH cache\n");
+        cache_write(index);
+    }
+
+    /* The cached index (if any) stays mapped: readers never take a lock */
+    for (size_t i = 0; i < duplicate_count; i++) {
+        free(duplicates[i]);
+    }
+    free(duplicates);
+    for (size_t i = 0; i < scan_count; i++) {
+        free(scans[i].names);
+        free(scans[i].path);
+    }
+    free(scans);
+    scans = NULL;
+}
+
+//worker thread: claim directories until none are left
+static void *index_worker(void *arg)
+{
+    size_t i;
+    while ((i = __atomic_fetch_add(&next_scan, 1, __ATOMIC_RELAXED)) < scan_count) {
+        TRACE_BEGIN(TRACE_SCAN);
+        scan_directory(&scans[i]);
+        TRACE_END(TRACE_SCAN);
+    }
+
+    /* The last worker out merges everybody's results */
+    if (__atomic_sub_fetch(&active_workers, 1, __ATOMIC_ACQ_REL) == 0) {
+        publish_index();
+    }
+    return NULL;
+}
+
+/**
+ * Split the PATH and start the worker threads, without waiting for them. If a
+ * cache from an earlier shell matches this PATH it is published right away and
+ * the workers only rescan the directories whose mtime or inode changed.
+ */
+void pathindex_start(void)
+{
+    char *env_path = getenv("PATH");
+    if (env_path == NULL || scans != NULL) {
+        return;
+    }
+    path_env = strdup(env_path);
+
+    cache_file = cache_location();
+    if (cache_file != NULL) {
+        cache_open();
+        cache_publish();
+    }
+
+    char *path = strdup(env_path);
+    size_t max = 1;
+    for (char *c = path; *c != '\0'; c++) {
+        if (*c == ':') {
+            max++;
+        }
+    }
+    scans = calloc(max, sizeof(struct dir_scan));
+    scan_count = 0;
+    next_scan = 0;
+
+    char *saveptr;
+    for (char *dir = strtok_r(path, ":", &saveptr); dir != NULL;
+            dir = strtok_r(NULL, ":", &saveptr)) {
+        scans[scan_count++].path = strdup(dir);
+    }
+    free(path);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t workers = cpus > 0 ? (size_t) cpus : 1;
+    if (workers > MAX_WORKERS) {
+        workers = MAX_WORKERS;
+    }
+    if (workers > scan_count) {
+        workers = scan_count;
+    }
+    if (workers == 0) {
+        workers = 1;
+    }
+    active_workers = workers;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    /* Workers inherit a full signal mask so signals are left to the event
+     * loop's signalfd on the main thread */
+    sigset_t all, old_mask;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old_mask);
+
+    for (size_t i = 0; i < workers; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, index_worker, NULL) != 0) {
+            perror("pthread_create");
+            if (i == 0) {
+                /* No threads at all; scan here rather than never */
+                active_workers = 1;
+                index_worker(NULL);
+            } else if (__atomic_sub_fetch(&active_workers, workers - i,
+                        __ATOMIC_ACQ_REL) == 0) {
+                /* The workers that did start already finished */
+                publish_index();
+            }
+            break;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    pthread_attr_destroy(&attr);
+    LOG("Indexing %zu PATH directories with %zu workers\n", scan_count, workers);
+}
+
+//get the published index, or NULL if the workers are still scanning
+const struct path_index *pathindex_get(void)
+{
+    return __atomic_load_n(&published, __ATOMIC_ACQUIRE);
+}
+
+//find the names that start with prefix, returning the first index and count
+size_t pathindex_prefix_range(const struct path_index *index,
+        const char *prefix, size_t *count)
+{
+    size_t len = strlen(prefix);
+    size_t low = 0;
+    size_t high = index->count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (strncmp(index->names[mid], prefix, len) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    size_t end = low;
+    while (end < index->count && strncmp(index->names[end], prefix, len) == 0) {
+        end++;
+    }
+    *count = end - low;
+    return low;
+}
@@ -0,0 +1,31 @@
+/**
+ * @file
+ *
+ * PATH INDEX
+ * Background indexer for the executables found on the PATH. The directories
+ * are scanned concurrently by a small pool of worker threads while the user
+ * types their first command, and the finished index is published atomically
+ * so the completion code can read it without taking any locks.
+ */
+
+#ifndef _PATHINDEX_H_
+#define _PATHINDEX_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+//an immutable, sorted and de-duplicated list of executable names
+struct path_index {
+    size_t count;
+    char **names;
+    uint64_t *masks; //fuzzy_mask() of each name
+};
+
+void pathindex_start(void);
+const struct path_index *pathindex_get(void);
+size_t pathindex_prefix_range(const struct path_index *, const char *, size_t *);
+bool is_executable(const struct stat *);
+
+#endif
@@ -0,0 +1,383 @@
+/**
+ * @file
+ *
+ * pipes
+ *
+ * pipe buffer sizes, the pipestat report and |+ fan-out
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "logger.h"
+#include "pipes.h"
+#include "session.h"
+
+//what pipestat learns about one stage
+struct stage {
+    pid_t pid;
+    const char *name;
+    int fd; //read end of the pipe the stage writes, -1 once it isn't watched
+    size_t capacity;
+    size_t peak; //most bytes seen waiting in the pipe
+    size_t full; //samples where the stage was stalled writing
+    size_t starved; //samples where the stage's input was empty
+    unsigned long long read; //from /proc/PID/io
+    unsigned long long written;
+    int status;
+};
+
+/**
+ * Parse a pipe size: bytes with an optional K, M or G suffix, max for the
+ * largest the system allows, or 0 or default for the kernel's default.
+ */
+int pipes_parse_size(const char *text, size_t *size)
+{
+    if (strcmp(text, "max") == 0) {
+        *size = PIPE_SIZE_MAX;
+        return 0;
+    } else if (strcmp(text, "default") == 0) {
+        *size = 0;
+        return 0;
+    }
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (end == text || text[0] == '-' || errno != 0) {
+        return -1;
+    }
+    int shift = 0;
+    switch (*end) {
+        case 'k': case 'K': shift = 10; end++; break;
+        case 'm': case 'M': shift = 20; end++; break;
+        case 'g': case 'G': shift = 30; end++; break;
+    }
+    if (*end != '\0' || value > (PIPE_SIZE_MAX >> shift)) {
+        return -1;
+    }
+    *size = value << shift;
+    return 0;
+}
+
+//the size pipelines of this session get when they don't ask for one
+size_t pipes_default(void)
+{
+    struct session *session = session_current();
+    if (session->pipe_size != 0) {
+        return session->pipe_size;
+    }
+    size_t size = 0;
+    const char *setting = getenv("SWISH_PIPE_SIZE");
+    if (setting != NULL && pipes_parse_size(setting, &size) == -1) {
+        size = 0;
+    }
+    return size;
+}
+
+//the largest buffer an unprivileged process may give a pipe
+static size_t max_size(void)
+{
+    size_t size = 1024 * 1024;
+    FILE *file = fopen("/proc/sys/fs/pipe-max-size", "re");
+    if (file != NULL) {
+        if (fscanf(file, "%zu", &size) != 1) {
+            size = 1024 * 1024;
+        }
+        fclose(file);
+    }
+    return size;
+}
+
+/**
+ * Give the pipe fd a buffer of size bytes (0 leaves it alone), capped at the
+ * system maximum. The kernel rounds sizes up to a power of two pages and
+ * refuses to grow a user's pipes past pipe-user-pages-soft, in which case
+ * the pipe keeps the buffer it has. Returns the capacity the pipe ends up
+ * with.
+ */
+int pipes_tune(int fd, size_t size)
+{
+    if (size != 0) {
+        size_t max = max_size();
+        if (size > max) {
+            size = max;
+        }
+        if (fcntl(fd, F_SETPIPE_SZ, (int) size) == -1) {
+            LOG("Pipe stays at its size: %s\n", strerror(errno));
+        }
+    }
+    return fcntl(fd, F_GETPIPE_SZ);
+}
+
+/**
+ * Read the bytes a process has read and written, which works until it's
+ * reaped. These are all its reads and writes, files and the dynamic loader
+ * included, not just the pipes: the pipes' own traffic passes through no
+ * counter the shell can see without copying it.
+ */
+static void read_io(struct stage *stage)
+{
+    char path[32];
+    snprintf(path, sizeof(path), "/proc/%d/io", stage->pid);
+    FILE *file = fopen(path, "re");
+    if (file == NULL) {
+        return;
+    }
+    char line[64];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        sscanf(line, "rchar: %llu", &stage->read);
+        sscanf(line, "wchar: %llu", &stage->written);
+    }
+    fclose(file);
+}
+
+//note how full each watched pipe is
+static void sample(struct stage *stages, size_t count)
+{
+    for (size_t i = 0; i + 1 < count; i++) {
+        int queued;
+        if (stages[i].fd == -1 || ioctl(stages[i].fd, FIONREAD, &queued) == -1) {
+            continue;
+        }
+        if ((size_t) queued > stages[i].peak) {
+            stages[i].peak = queued;
+        }
+        if ((size_t) queued + PIPESTAT_FULL_SLACK > stages[i].capacity) {
+            stages[i].full++;
+        } else if (queued == 0) {
+            stages[i + 1].starved++;
+        }
+    }
+}
+
+//stop watching the pipe into or out of a stage that has exited
+static void unwatch(struct stage *stages, size_t count, size_t i)
+{
+    /* Our copy of a read end would keep the writer from getting SIGPIPE once
+     * the reader is gone */
+    if (i > 0 && stages[i - 1].fd != -1) {
+        close(stages[i - 1].fd);
+        stages[i - 1].fd = -1;
+    }
+    if (stages[i].fd != -1) {
+        close(stages[i].fd);
+        stages[i].fd = -1;
+    }
+}
+
+//reap every stage that has exited, reading its I/O first; returns how many
+static size_t reap(struct stage *stages, size_t count)
+{
+    size_t reaped = 0;
+    siginfo_t info;
+    memset(&info, 0, sizeof(info));
+    while (waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid != 0) {
+        size_t i = 0;
+        while (i < count && stages[i].pid != info.si_pid) {
+            i++;
+        }
+        if (i < count) {
+            read_io(&stages[i]);
+            waitpid(stages[i].pid, &stages[i].status, 0);
+            unwatch(stages, count, i);
+            reaped++;
+        } else {
+            waitpid(info.si_pid, NULL, 0);
+        }
+        memset(&info, 0, sizeof(info));
+    }
+    return reaped;
+}
+
+static void report(const struct stage *stages, size_t count, size_t samples, double seconds)
+{
+    fprintf(stderr, "pipestat: %zu stages, %zu samples over %.3fs\n", count, samples, seconds);
+    fprintf(stderr, "%-5s %-16s %14s %14s %10s %8s %8s %8s %6s\n", "stage", "command",
+            "io read", "io written", "pipe", "peak", "full", "starved", "status");
+    for (size_t i = 0; i < count; i++) {
+        const struct stage *s = &stages[i];
+        int status = WIFEXITED(s->status) ? WEXITSTATUS(s->status) : 128 + WTERMSIG(s->status);
+        if (i + 1 < count) {
+            fprintf(stderr, "%-5zu %-16.16s %14llu %14llu %10zu %8zu %8zu %8zu %6d\n", i,
+                    s->name, s->read, s->written, s->capacity, s->peak, s->full,
+                    s->starved, status);
+        } else {
+            fprintf(stderr, "%-5zu %-16.16s %14llu %14llu %10s %8s %8s %8zu %6d\n", i,
+                    s->name, s->read, s->written, "-", "-", "-", s->starved, status);
+        }
+    }
+    fprintf(stderr, "io: all of a stage's reads and writes, not only its pipes\n");
+}
+
+/**
+ * Watch a running pipeline until every stage has exited, then print the
+ * pipestat report to stderr. pids and names hold the count stages and fds
+ * the read ends of the count - 1 pipes between them, which are closed.
+ * Returns the wait status of the last stage.
+ */
+int pipes_monitor(pid_t *pids, char **names, int *fds, size_t count)
+{
+    struct stage stages[count];
+    memset(stages, 0, sizeof(stages));
+    for (size_t i = 0; i < count; i++) {
+        stages[i].pid = pids[i];
+        stages[i].name = names[i];
+        stages[i].fd = i + 1 < count ? fds[i] : -1;
+        stages[i].capacity = i + 1 < count ? pipes_tune(fds[i], 0) : 0;
+    }
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct timespec interval = { 0, PIPESTAT_INTERVAL_US * 1000L };
+    size_t samples = 0;
+    size_t running = count;
+    while (running > 0) {
+        sample(stages, count);
+        samples++;
+        running -= reap(stages, count);
+        if (running > 0) {
+            nanosleep(&interval, NULL);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double seconds = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+    report(stages, count, samples, seconds);
+    return stages[count - 1].status;
+}
+
+/**
+ * Stage the next chunk of in for every open output: tee it into each staging
+ * pipe but the last, then splice it into the last, which consumes it. The
+ * staging pipes are empty and all the same size, so whatever the first tee
+ * takes fits in the rest. Returns the chunk's size, 0 at EOF or -1.
+ */
+static ssize_t stage_chunk(int in, int (*staged)[2], const bool *open, size_t count,
+        size_t capacity)
+{
+    ssize_t len = -1;
+    size_t last = count;
+    while (last > 0 && !open[last - 1]) {
+        last--;
+    }
+    for (size_t i = 0; i < count && last > 0; i++) {
+        if (!open[i]) {
+            continue;
+        }
+        ssize_t moved;
+        size_t want = len == -1 ? capacity : (size_t) len;
+        if (i == last - 1 && len == -1) {
+            moved = splice(in, NULL, staged[i][1], NULL, want, 0);
+        } else if (i == last - 1) {
+            moved = 0;
+            while (moved < (ssize_t) want) {
+                ssize_t n = splice(in, NULL, staged[i][1], NULL, want - moved, 0);
+                if (n <= 0) {
+                    break;
+                }
+                moved += n;
+            }
+        } else {
+            moved = tee(in, staged[i][1], want, 0);
+        }
+        if (moved <= 0 || (len != -1 && moved != len)) {
+            return moved == 0 && len == -1 ? 0 : -1;
+        }
+        len = moved;
+    }
+    return len;
+}
+
+/**
+ * Copy everything read from the pipe in to each of the count pipes in outs,
+ * without it passing through this process: tee(2) duplicates the pages into
+ * a staging pipe per output and splice(2) moves them on. Outputs are fed as
+ * they have room, so a slow consumer holds the others back by at most one
+ * chunk, and the producer by a pipe's worth. A consumer that quits is
+ * dropped; once all have, in is closed too. Closes outs.
+ */
+int pipes_fanout(int in, int *outs, size_t count)
+{
+    signal(SIGPIPE, SIG_IGN);
+    int staged[count][2];
+    bool open[count];
+    size_t pending[count];
+    size_t capacity = pipes_tune(in, 0);
+    for (size_t i = 0; i < count; i++) {
+        open[i] = pipe2(staged[i], O_CLOEXEC) == 0;
+        if (open[i] && (size_t) pipes_tune(staged[i][0], capacity) < capacity) {
+            capacity = pipes_tune(staged[i][0], 0);
+        }
+    }
+    /* Equal sizes, so a chunk that fits one staging pipe fits them all */
+    for (size_t i = 0; i < count; i++) {
+        if (open[i]) {
+            fcntl(staged[i][0], F_SETPIPE_SZ, (int) capacity);
+        }
+    }
+
+    size_t alive = 0;
+    for (size_t i = 0; i < count; i++) {
+        alive += open[i];
+    }
+    ssize_t len;
+    while (alive > 0 && (len = stage_chunk(in, staged, open, count, capacity)) > 0) {
+        for (size_t i = 0; i < count; i++) {
+            pending[i] = open[i] ? len : 0;
+        }
+        size_t waiting = alive;
+        while (waiting > 0) {
+            struct pollfd fds[count];
+            nfds_t nfds = 0;
+            for (size_t i = 0; i < count; i++) {
+                if (pending[i] == 0) {
+                    continue;
+                }
+                ssize_t n = splice(staged[i][0], NULL, outs[i], NULL, pending[i],
+                        SPLICE_F_NONBLOCK);
+                if (n > 0) {
+                    pending[i] -= n;
+                } else if (n == -1 && errno == EAGAIN) {
+                    fds[nfds++] = (struct pollfd) { .fd = outs[i], .events = POLLOUT };
+                    continue;
+                } else {
+                    /* The consumer has gone, and its staging pipe with it */
+                    LOG("Fan-out consumer %zu quit: %s\n", i, strerror(errno));
+                    close(staged[i][0]);
+                    close(staged[i][1]);
+                    close(outs[i]);
+                    open[i] = false;
+                    pending[i] = 0;
+                    alive--;
+                }
+                if (pending[i] == 0) {
+                    waiting--;
+                }
+            }
+            if (nfds > 0 && poll(fds, nfds, -1) == -1 && errno != EINTR) {
+                break;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (open[i]) {
+            close(staged[i][0]);
+            close(staged[i][1]);
+            close(outs[i]);
+        }
+    }
+    return alive > 0 ? 0 : -1;
+}
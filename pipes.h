@@ -0,0 +1,49 @@
+/**
+ * @file
+ *
+ * PIPES
+ * Buffer sizes for the pipes between pipeline stages, and the pipestat
+ * report. The kernel gives a pipe 64 KiB, so a stage moving bulk data blocks
+ * and wakes its neighbour every 64 KiB; F_SETPIPE_SZ raises that up to
+ * /proc/sys/fs/pipe-max-size. The size comes from pipesize, for one pipeline
+ * or as the session's default, or from SWISH_PIPE_SIZE.
+ *
+ * pipestat watches a pipeline while it runs: every PIPESTAT_INTERVAL_US it
+ * samples how full each pipe is with FIONREAD, counting the samples where a
+ * stage's output was full (it was stalled writing) or its input was empty (it
+ * was starved), and as each stage exits it reads the bytes the stage read
+ * and wrote from /proc/PID/io. Those count all of its I/O, files and the
+ * dynamic loader included, not just the pipes.
+ *
+ * A |+ in a pipeline fans the output before it out to each command after
+ * one, duplicated in the kernel with tee(2) and splice(2) rather than copied
+ * through the shell.
+ */
+
+#ifndef _PIPES_H_
+#define _PIPES_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#define PIPE_SIZE_MAX ((size_t) -1) //pipesize max: as large as the system allows
+
+#define PIPESTAT_INTERVAL_US 1000 //time between FIONREAD samples
+
+#define PIPESTAT_FULL_SLACK 4096 //a pipe within a page of its capacity is full
+
+//how the pipes of one pipeline are set up
+struct pipe_options {
+    size_t size; //buffer size, 0 for the kernel's default
+    bool stats; //watch the stages and report on them at the end
+};
+
+int pipes_parse_size(const char *, size_t *);
+size_t pipes_default(void);
+int pipes_tune(int, size_t);
+int pipes_monitor(pid_t *, char **, int *, size_t);
+int pipes_fanout(int, int *, size_t);
+
+#endif
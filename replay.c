@@ -0,0 +1,278 @@
+/**
+ * @file
+ *
+ * replay
+ *
+ * session recording and timed replay
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include "arena.h"
+#include "replay.h"
+#include "shell.h"
+#include "trace.h"
+#include "ui.h"
+
+#define RECORD_HEADER "# swish record v2\n"
+
+#define RECORD_HEADER_V1 "# swish record v1\n" //commands written unescaped
+
+//latency samples for one phase of running a command
+struct phase_samples {
+    const char *name;
+    int64_t *values;
+    size_t count;
+    size_t max;
+};
+
+static FILE *record_out; //where the session is being recorded, if anywhere
+
+static long long session_start; //when recording started
+
+static long long command_start; //when the current command started
+
+static char *command_line; //copy of the current command, before parsing
+
+static long long now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+//turn a wait status into the number a shell script would see
+static int exit_code(int status)
+{
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return WEXITSTATUS(status);
+}
+
+//start recording the session to a file
+int record_open(const char *path)
+{
+    record_out = fopen(path, "w");
+    if (record_out == NULL) {
+        return -1;
+    }
+    fputs(RECORD_HEADER, record_out);
+    fputs("# start_us\tduration_us\tstatus\tcommand\n", record_out);
+    session_start = now_ns();
+    return 0;
+}
+
+//note that a command is about to run
+void record_begin(const char *command)
+{
+    if (record_out == NULL) {
+        return;
+    }
+    free(command_line);
+    command_line = strdup(command);
+    command_start = now_ns();
+}
+
+/**
+ * Write a command as one field of a record line: newlines, tabs and
+ * backslashes (heredoc bodies have the first two) are escaped C-style.
+ */
+static void write_escaped(const char *command, FILE *out)
+{
+    for (const char *c = command; *c != '\0'; c++) {
+        if (*c == '\n') {
+            fputs("\\n", out);
+        } else if (*c == '\t') {
+            fputs("\\t", out);
+        } else if (*c == '\\') {
+            fputs("\\\\", out);
+        } else {
+            fputc(*c, out);
+        }
+    }
+}
+
+//undo write_escaped in place
+static void unescape(char *command)
+{
+    char *out = command;
+    for (char *c = command; *c != '\0'; c++) {
+        if (*c == '\\' && (c[1] == 'n' || c[1] == 't' || c[1] == '\\')) {
+            c++;
+            *out++ = *c == 'n' ? '\n' : *c == 't' ? '\t' : '\\';
+        } else {
+            *out++ = *c;
+        }
+    }
+    *out = '\0';
+}
+
+//log the command that just finished
+void record_end(void)
+{
+    if (record_out == NULL || command_line == NULL) {
+        return;
+    }
+    long long end = now_ns();
+    fprintf(record_out, "%lld\t%lld\t%d\t",
+            (command_start - session_start) / 1000, (end - command_start) / 1000,
+            exit_code(prompt_status()));
+    write_escaped(command_line, record_out);
+    fputc('\n', record_out);
+    fflush(record_out);
+    free(command_line);
+    command_line = NULL;
+}
+
+void record_close(void)
+{
+    if (record_out != NULL) {
+        fclose(record_out);
+        record_out = NULL;
+    }
+}
+
+static void add_sample(struct phase_samples *phase, int64_t value)
+{
+    if (phase->count == phase->max) {
+        phase->max = phase->max == 0 ? 64 : phase->max * 2;
+        phase->values = realloc(phase->values, sizeof(int64_t) * phase->max);
+    }
+    phase->values[phase->count++] = value;
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a;
+    int64_t y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+//the value below which a fraction of the (sorted) samples fall, in microseconds
+static double percentile(struct phase_samples *phase, double fraction)
+{
+    size_t i = (size_t) (fraction * phase->count + 0.999999);
+    i = i == 0 ? 0 : i - 1;
+    return phase->values[i] / 1000.0;
+}
+
+static void report(struct phase_samples *phases, size_t count)
+{
+    fprintf(stderr, "%-10s %8s %10s %10s %10s %10s %10s\n",
+            "phase", "count", "mean_us", "p50_us", "p90_us", "p99_us", "max_us");
+    for (size_t i = 0; i < count; i++) {
+        struct phase_samples *phase = &phases[i];
+        if (phase->count == 0) {
+            continue;
+        }
+        qsort(phase->values, phase->count, sizeof(int64_t), compare_samples);
+        double sum = 0;
+        for (size_t j = 0; j < phase->count; j++) {
+            sum += phase->values[j];
+        }
+        fprintf(stderr, "%-10s %8zu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                phase->name, phase->count, sum / phase->count / 1000.0,
+                percentile(phase, 0.50), percentile(phase, 0.90),
+                percentile(phase, 0.99), percentile(phase, 1.0));
+        free(phase->values);
+    }
+}
+
+/**
+ * Run every command in a recorded session and report per-phase latencies.
+ * With paced set, each command starts at its original offset from the start
+ * of the session; otherwise they run back to back. The per-phase times come
+ * from the trace buffer, so they measure exactly what `trace dump` shows.
+ */
+int replay_session(const char *path, bool paced)
+{
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    enum { TOTAL, RECORDED, PARSE, FORK, WAIT, PHASE_COUNT };
+    struct phase_samples phases[PHASE_COUNT] = {
+        [TOTAL] = { .name = "command" },
+        [RECORDED] = { .name = "recorded" },
+        [PARSE] = { .name = "parse" },
+        [FORK] = { .name = "fork" },
+        [WAIT] = { .name = "wait" },
+    };
+    int mismatches = 0;
+
+    char *line = NULL;
+    size_t line_sz = 0;
+    ssize_t read_sz;
+    long long start = now_ns();
+    bool escaped = true;
+    while ((read_sz = getline(&line, &line_sz, in)) != -1) {
+        if (strcmp(line, RECORD_HEADER_V1) == 0) {
+            escaped = false;
+        }
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+        if (line[read_sz - 1] == '\n') {
+            line[read_sz - 1] = '\0';
+        }
+
+        char *field = line;
+        long long offset = strtoll(field, &field, 10);
+        long long duration = strtoll(field, &field, 10);
+        int status = strtol(field, &field, 10);
+        if (*field != '\t') {
+            fprintf(stderr, "%s: skipping malformed line\n", path);
+            continue;
+        }
+        char *command = field + 1;
+        if (escaped) {
+            unescape(command);
+        }
+
+        if (paced) {
+            long long wait = start + offset * 1000 - now_ns();
+            if (wait > 0) {
+                struct timespec delay = { wait / 1000000000, wait % 1000000000 };
+                while (nanosleep(&delay, &delay) == -1 && errno == EINTR) {
+                }
+            }
+        }
+
+        int64_t totals[TRACE_EVENT_COUNT];
+        uint64_t position = trace_position();
+        long long before = now_ns();
+        int result = run_command(command);
+        add_sample(&phases[TOTAL], now_ns() - before);
+        add_sample(&phases[RECORDED], duration * 1000);
+
+        trace_phase_totals(position, totals);
+        add_sample(&phases[PARSE], totals[TRACE_PARSE]);
+        if (totals[TRACE_FORK] > 0) {
+            add_sample(&phases[FORK], totals[TRACE_FORK]);
+            add_sample(&phases[WAIT], totals[TRACE_WAIT]);
+        }
+        if (exit_code(prompt_status()) != status) {
+            mismatches++;
+        }
+        if (result == -1) {
+            break;
+        }
+    }
+    free(line);
+    fclose(in);
+
+    fprintf(stderr, "replayed %zu commands in %.3f s, %d exit status mismatches\n",
+            phases[TOTAL].count, (now_ns() - start) / 1e9, mismatches);
+    report(phases, PHASE_COUNT);
+    return 0;
+}
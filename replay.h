@@ -0,0 +1,23 @@
+/**
+ * @file
+ *
+ * RECORD AND REPLAY
+ * `swish --record FILE` logs every input line with when it started, how long
+ * it took and its exit status, one tab-separated line per command with its
+ * newlines, tabs and backslashes escaped. `swish --replay FILE` runs such a session again,
+ * as fast as possible or at the original pacing (--paced), and reports the
+ * latency distribution of each phase of command execution.
+ */
+
+#ifndef _REPLAY_H_
+#define _REPLAY_H_
+
+#include <stdbool.h>
+
+int record_open(const char *);
+void record_begin(const char *);
+void record_end(void);
+void record_close(void);
+int replay_session(const char *, bool);
+
+#endif
@@ -0,0 +1,207 @@
+/**
+ * @file
+ *
+ * schedule
+ *
+ * CPU affinity, niceness and I/O priority for the commands the shell starts
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "logger.h"
+#include "schedule.h"
+
+#define IOPRIO_WHO_PROCESS 1 //ioprio_set(2) target: a single process
+
+//the I/O scheduling classes, by the names ionice(1) also accepts
+static const struct {
+    const char *name;
+    int class;
+} io_classes[] = {
+    { "rt", 1 }, { "realtime", 1 },
+    { "be", 2 }, { "best-effort", 2 },
+    { "idle", 3 },
+};
+
+#define IO_CLASS_COUNT (sizeof(io_classes) / sizeof(io_classes[0]))
+
+//true if nothing is set, so the shell's own attributes are inherited
+bool schedule_empty(const struct schedule *sched)
+{
+    return !sched->has_cpus && !sched->has_nice && sched->ioprio == 0;
+}
+
+//override the attributes in into with those set in from
+void schedule_merge(struct schedule *into, const struct schedule *from)
+{
+    if (from->has_cpus) {
+        into->has_cpus = true;
+        into->cpus = from->cpus;
+    }
+    if (from->has_nice) {
+        into->has_nice = true;
+        into->nice = from->nice;
+    }
+    if (from->ioprio != 0) {
+        into->ioprio = from->ioprio;
+    }
+}
+
+//parse a CPU list such as 0-3,6 into cpus; returns -1 if it is malformed
+int schedule_cpus(const char *text, cpu_set_t *cpus)
+{
+    CPU_ZERO(cpus);
+    const char *p = text;
+    while (*p != '\0') {
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p || first < 0) {
+            return -1;
+        }
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first) {
+                return -1;
+            }
+        }
+        if (last >= CPU_SETSIZE) {
+            return -1;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, cpus);
+        }
+        if (*end == ',') {
+            end++;
+        } else if (*end != '\0') {
+            return -1;
+        }
+        p = end;
+    }
+    return CPU_COUNT(cpus) > 0 ? 0 : -1;
+}
+
+//parse a niceness from -20 to 19
+int schedule_nice(const char *text, int *nice)
+{
+    char *end;
+    long value = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || value < -20 || value > 19) {
+        return -1;
+    }
+    *nice = value;
+    return 0;
+}
+
+/**
+ * Parse an I/O priority written CLASS[:LEVEL]: idle, or rt or be with a
+ * level from 0 (highest) to 7 that defaults to 4, as the kernel's does.
+ */
+int schedule_ioprio(const char *text, int *ioprio)
+{
+    size_t name_len = strcspn(text, ":");
+    int class = 0;
+    for (size_t i = 0; i < IO_CLASS_COUNT; i++) {
+        if (strlen(io_classes[i].name) == name_len
+                && strncmp(text, io_classes[i].name, name_len) == 0) {
+            class = io_classes[i].class;
+        }
+    }
+    long level = IOPRIO_LEVELS / 2;
+    if (text[name_len] == ':') {
+        char *end;
+        level = strtol(text + name_len + 1, &end, 10);
+        if (end == text + name_len + 1 || *end != '\0' || level < 0
+                || level >= IOPRIO_LEVELS || class == 3) {
+            return -1;
+        }
+    }
+    if (class == 0) {
+        return -1;
+    }
+    *ioprio = class << IOPRIO_CLASS_SHIFT | (class == 3 ? 0 : level);
+    return 0;
+}
+
+/**
+ * Give a process (0 for the calling one) the attributes set in sched. Every
+ * attribute is tried; returns -1 with errno set if any could not be applied.
+ */
+int schedule_apply(pid_t pid, const struct schedule *sched)
+{
+    int result = 0;
+    int error = 0;
+    if (sched->has_cpus && sched_setaffinity(pid, sizeof(cpu_set_t), &sched->cpus) == -1) {
+        result = -1;
+        error = errno;
+    }
+    if (sched->has_nice && setpriority(PRIO_PROCESS, pid, sched->nice) == -1) {
+        result = -1;
+        error = errno;
+    }
+    if (sched->ioprio != 0
+            && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, pid, sched->ioprio) == -1) {
+        result = -1;
+        error = errno;
+    }
+    if (result == -1) {
+        LOG("Could not schedule %d: %s\n", pid, strerror(error));
+    }
+    errno = error;
+    return result;
+}
+
+//describe sched for the jobclass listing, as the options that would set it
+void schedule_format(const struct schedule *sched, char *buf, size_t size)
+{
+    size_t len = 0;
+    buf[0] = '\0';
+    if (sched->has_cpus) {
+        len += snprintf(buf + len, size - len, "-a ");
+        for (int cpu = 0; cpu < CPU_SETSIZE && len < size; cpu++) {
+            if (!CPU_ISSET(cpu, &sched->cpus)) {
+                continue;
+            }
+            int last = cpu;
+            while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, &sched->cpus)) {
+                last++;
+            }
+            bool first = buf[len - 1] == ' ';
+            if (last > cpu) {
+                len += snprintf(buf + len, size - len, "%s%d-%d", first ? "" : ",", cpu, last);
+            } else {
+                len += snprintf(buf + len, size - len, "%s%d", first ? "" : ",", cpu);
+            }
+            cpu = last;
+        }
+        len += len < size ? snprintf(buf + len, size - len, " ") : 0;
+    }
+    if (sched->has_nice && len < size) {
+        len += snprintf(buf + len, size - len, "-n %d ", sched->nice);
+    }
+    if (sched->ioprio != 0 && len < size) {
+        int class = sched->ioprio >> IOPRIO_CLASS_SHIFT;
+        int level = sched->ioprio & ((1 << IOPRIO_CLASS_SHIFT) - 1);
+        const char *name = class == 1 ? "rt" : class == 2 ? "be" : "idle";
+        if (class == 3) {
+            len += snprintf(buf + len, size - len, "-i %s ", name);
+        } else {
+            len += snprintf(buf + len, size - len, "-i %s:%d ", name, level);
+        }
+    }
+    if (len > 0 && len <= size) {
+        buf[len - 1] = '\0'; //the trailing space
+    }
+}
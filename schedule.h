@@ -0,0 +1,40 @@
+/**
+ * @file
+ *
+ * SCHEDULE
+ * Scheduling attributes for the commands the shell starts: the CPUs they may
+ * run on, their niceness and their I/O priority. A job is given these in the
+ * child before it execs, so nothing it starts escapes them; a job class's
+ * defaults can also be reapplied to jobs that are already running.
+ */
+
+#ifndef _SCHEDULE_H_
+#define _SCHEDULE_H_
+
+#include <sched.h> //cpu_set_t needs _GNU_SOURCE from the includer
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define IOPRIO_CLASS_SHIFT 13 //the class sits above the level in an I/O priority
+
+#define IOPRIO_LEVELS 8 //levels 0 (highest) to 7 within the rt and be classes
+
+//scheduling attributes; anything not set is inherited from the shell
+struct schedule {
+    bool has_cpus;
+    cpu_set_t cpus;
+    bool has_nice;
+    int nice;
+    int ioprio; //class and level as ioprio_set(2) takes them, 0 if not set
+};
+
+bool schedule_empty(const struct schedule *);
+void schedule_merge(struct schedule *, const struct schedule *);
+int schedule_cpus(const char *, cpu_set_t *);
+int schedule_nice(const char *, int *);
+int schedule_ioprio(const char *, int *);
+int schedule_apply(pid_t, const struct schedule *);
+void schedule_format(const struct schedule *, char *, size_t);
+
+#endif
@@ -0,0 +1,270 @@
+/**
+ * @file
+ *
+ * serve
+ *
+ * warm shell server on a Unix-domain socket
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "logger.h"
+#include "pathindex.h"
+#include "serve.h"
+#include "session.h"
+
+#define SERVE_WORKERS 8 //requests handled at once
+
+#define SERVE_IDLE_MS 1000 //how often an idle worker reaps its background jobs
+
+#define SERVE_REQUEST_TIMEOUT 5 //seconds a client gets to send its request
+
+#define SERVE_WARM_MS 5000 //longest the PATH index may take before serving starts
+
+static int listen_fd = -1;
+
+/**
+ * Read a request: the command line and exactly SERVE_FDS descriptors. Anything
+ * else is rejected, closing whatever descriptors came with it.
+ */
+static int receive_request(int conn, char *line, int *fds)
+{
+    struct iovec iov = { .iov_base = line, .iov_len = SERVE_MAX_LINE };
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * SERVE_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    ssize_t len = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+    if (len <= 0) {
+        return -1;
+    }
+
+    size_t received = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+            cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            int *passed = (int *) CMSG_DATA(cmsg);
+            for (size_t i = 0; i < count; i++) {
+                if (received < SERVE_FDS) {
+                    fds[received++] = passed[i];
+                } else {
+                    close(passed[i]);
+                }
+            }
+        }
+    }
+
+    if (received != SERVE_FDS || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+        fprintf(stderr, "swish: rejected a malformed request\n");
+        for (size_t i = 0; i < received; i++) {
+            close(fds[i]);
+        }
+        return -1;
+    }
+    line[len] = '\0';
+    return 0;
+}
+
+/**
+ * Take requests until the socket fails. The worker keeps one session, so its
+ * history and background jobs carry over from one request to the next; it is
+ * replaced when a request runs exit.
+ */
+static void *serve_worker(void *arg)
+{
+    char *line = malloc(SERVE_MAX_LINE + 1);
+    struct session *session = session_create();
+    if (line == NULL || session == NULL) {
+        perror("serve");
+        free(line);
+        session_destroy(session);
+        return NULL;
+    }
+
+    while (true) {
+        struct pollfd listener = { .fd = listen_fd, .events = POLLIN };
+        int ready = poll(&listener, 1, SERVE_IDLE_MS);
+        if (ready == 0) {
+            session_collect(session);
+            continue;
+        } else if (ready == -1 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+
+        /* Another worker may have taken the connection already, so the
+         * listening socket is non-blocking; the connection itself isn't */
+        int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (conn == -1) {
+            if (errno == EAGAIN || errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            perror("accept");
+            break;
+        }
+
+        /* A client that connects and sends nothing must not hold the worker */
+        struct timeval timeout = { .tv_sec = SERVE_REQUEST_TIMEOUT };
+        setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        int fds[SERVE_FDS];
+        if (receive_request(conn, line, fds) == -1) {
+            close(conn);
+            continue;
+        }
+
+        struct serve_reply reply = { .status = -1 };
+        if (session_redirect(session, fds[0], fds[1], fds[2], fds[3]) == 0) {
+            reply.status = session_execute(session, line);
+        }
+        /* Let go of the client's descriptors so it sees EOF on its pipes */
+        session_redirect(session, -1, -1, -1, -1);
+        send(conn, &reply, sizeof(reply), MSG_NOSIGNAL);
+        close(conn);
+
+        if (session->exited) {
+            session_destroy(session);
+            if ((session = session_create()) == NULL) {
+                perror("serve");
+                break;
+            }
+        }
+    }
+    session_destroy(session);
+    free(line);
+    return NULL;
+}
+
+/**
+ * Clear the way to bind at path: only a socket nobody is listening on, left
+ * behind by a server that died, is removed. Anything else there, a live
+ * server's socket included, is left alone and serving fails.
+ */
+static int claim_path(const struct sockaddr_un *addr)
+{
+    struct stat info;
+    if (lstat(addr->sun_path, &info) == -1) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        perror(addr->sun_path);
+        return -1;
+    } else if (!S_ISSOCK(info.st_mode)) {
+        fprintf(stderr, "swish: %s exists and is not a socket\n", addr->sun_path);
+        return -1;
+    }
+    int probe = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (probe == -1) {
+        perror("socket");
+        return -1;
+    }
+    int connected = connect(probe, (const struct sockaddr *) addr, sizeof(*addr));
+    int error = connected == -1 ? errno : 0;
+    close(probe);
+    if (error != ECONNREFUSED) {
+        fprintf(stderr, "swish: %s is in use\n", addr->sun_path);
+        return -1;
+    }
+    if (unlink(addr->sun_path) == -1) {
+        perror(addr->sun_path);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Build the PATH index before the first request, so the server starts warm
+ * and keeps the on-disk copy the interactive shells read fresh. Waits at
+ * most SERVE_WARM_MS; a slow PATH finishes in the background.
+ */
+static void warm_up(void)
+{
+    pathindex_start();
+    struct timespec pause = { 0, 1000000 };
+    for (int waited = 0; pathindex_get() == NULL && waited < SERVE_WARM_MS; waited++) {
+        nanosleep(&pause, NULL);
+    }
+    const struct path_index *index = pathindex_get();
+    LOG("PATH index: %zu commands\n", index != NULL ? index->count : 0);
+}
+
+//listen on a Unix-domain socket at path and serve requests until killed
+int serve(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "swish: socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (listen_fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    if (claim_path(&addr) == -1) {
+        close(listen_fd);
+        return -1;
+    }
+    /* Whoever can connect can run commands as us, so only we may */
+    mode_t mask = umask(0077);
+    int bound = bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr));
+    umask(mask);
+    if (bound == -1 || chmod(path, 0600) == -1) {
+        perror(path);
+        close(listen_fd);
+        return -1;
+    }
+
+    warm_up();
+    if (listen(listen_fd, SOMAXCONN) == -1) {
+        perror(path);
+        close(listen_fd);
+        unlink(path);
+        return -1;
+    }
+
+    /* A client that goes away mid-command must not take the server with it */
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_t workers[SERVE_WORKERS];
+    size_t started = 0;
+    for (size_t i = 0; i < SERVE_WORKERS; i++) {
+        if (pthread_create(&workers[i], NULL, serve_worker, NULL) != 0) {
+            perror("pthread_create");
+            break;
+        }
+        started++;
+    }
+    LOG("Serving on %s with %zu workers\n", path, started);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    close(listen_fd);
+    unlink(path);
+    return started > 0 ? 0 : -1;
+}
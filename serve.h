@@ -0,0 +1,34 @@
+/**
+ * @file
+ *
+ * SERVER
+ * Keeps a warm shell running behind a Unix-domain socket. A client (swishc)
+ * sends one command line per connection along with its working directory,
+ * stdin, stdout and stderr as SCM_RIGHTS descriptors; the command runs
+ * against them and the exit status is sent back. Each worker thread keeps
+ * its own session between requests. The PATH index is built before the
+ * first request is taken. History is not shared between workers: their
+ * clients are unrelated, and one client's !! must not run another's command.
+ *
+ * The socket is made 0600, since whoever can connect runs commands as the
+ * server, and an existing path is only replaced if it is a dead server's
+ * socket.
+ */
+
+#ifndef _SERVE_H_
+#define _SERVE_H_
+
+#include <stdint.h>
+
+#define SERVE_MAX_LINE 65536 //longest command line a client may send
+
+#define SERVE_FDS 4 //cwd, stdin, stdout, stderr, in that order
+
+//what the server sends back once the command has finished
+struct serve_reply {
+    int32_t status; //exit status, or -1 if the line ran exit
+};
+
+int serve(const char *);
+
+#endif
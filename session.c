@@ -0,0 +1,312 @@
+/**
+ * @file
+ *
+ * session
+ *
+ * per-session shell state and the embedding API of libshell.so
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "history.h"
+#include "jobs.h"
+#include "logger.h"
+#include "metrics.h"
+#include "session.h"
+#include "shell.h"
+#include "trace.h"
+
+#define SESSION_HISTORY 100 //history entries kept per session
+
+//the interactive shell's session, used by threads that haven't entered one
+static struct session main_session = {
+    .cwd_fd = -1,
+    .stdin_fd = -1,
+    .output_fd = -1,
+    .stderr_fd = -1,
+};
+
+static __thread struct session *current; //the session this thread is running
+
+static pthread_once_t process_once = PTHREAD_ONCE_INIT;
+
+//the session commands on this thread belong to
+struct session *session_current(void)
+{
+    return current != NULL ? current : &main_session;
+}
+
+//where builtins of the current session should print
+FILE *session_stdout(void)
+{
+    struct session *session = session_current();
+    return session->out != NULL ? session->out : stdout;
+}
+
+//the current session's stdin
+int session_stdin(void)
+{
+    struct session *session = session_current();
+    return session->stdin_fd != -1 ? session->stdin_fd : STDIN_FILENO;
+}
+
+//open a file relative to the current session's working directory
+int session_open(const char *path, int flags)
+{
+    struct session *session = session_current();
+    int dir = session->cwd_fd != -1 ? session->cwd_fd : AT_FDCWD;
+    return openat(dir, path, flags | O_CLOEXEC);
+}
+
+//change the current session's working directory
+int session_chdir(const char *path)
+{
+    struct session *session = session_current();
+    if (session->cwd_fd == -1) {
+        return chdir(path);
+    }
+    int fd = openat(session->cwd_fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    close(session->cwd_fd);
+    session->cwd_fd = fd;
+    return 0;
+}
+
+/**
+ * Move a freshly forked child into its session's directory and stdio. Only
+ * async-signal-safe calls are made, since the parent may have other threads.
+ */
+void session_child(void)
+{
+    struct session *session = session_current();
+    if (session->cwd_fd != -1 && fchdir(session->cwd_fd) == -1) {
+        _exit(126);
+    }
+    if (session->stdin_fd != -1) {
+        dup2(session->stdin_fd, STDIN_FILENO);
+    }
+    if (session->output_fd != -1) {
+        dup2(session->output_fd, STDOUT_FILENO);
+    }
+    if (session->stderr_fd != -1) {
+        dup2(session->stderr_fd, STDERR_FILENO);
+    }
+    /* A server ignores SIGPIPE for itself and the event loop blocks SIGCHLD
+     * and SIGINT; commands should start with neither */
+    signal(SIGPIPE, SIG_DFL);
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+}
+
+/**
+ * Let builtins print through a second descriptor for the session's output.
+ * It shares the file offset, so builtin and child output stay in order.
+ */
+static int open_out(struct session *session)
+{
+    int out_fd = fcntl(session->output_fd, F_DUPFD_CLOEXEC, 0);
+    if (out_fd == -1) {
+        return -1;
+    }
+    if ((session->out = fdopen(out_fd, "w")) == NULL) {
+        close(out_fd);
+        return -1;
+    }
+    return 0;
+}
+
+//close a descriptor the session owns, if it has one
+static void close_fd(int *fd)
+{
+    if (*fd != -1) {
+        close(*fd);
+        *fd = -1;
+    }
+}
+
+//process-wide setup shared by every embedded session
+static void process_init(void)
+{
+    trace_init();
+    metrics_init();
+}
+
+/**
+ * Create an independent session, starting in the process's current working
+ * directory. Returns NULL if its files could not be opened.
+ */
+struct session *session_create(void)
+{
+    pthread_once(&process_once, process_init);
+
+    struct session *session = calloc(1, sizeof(struct session));
+    if (session == NULL) {
+        return NULL;
+    }
+    session->cwd_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    session->stdin_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    session->output_fd = memfd_create("swish-output", MFD_CLOEXEC);
+    session->stderr_fd = -1;
+    session->capture = true;
+    if (session->cwd_fd == -1 || session->stdin_fd == -1 || session->output_fd == -1
+            || open_out(session) == -1) {
+        session_destroy(session);
+        return NULL;
+    }
+
+    struct session *previous = current;
+    current = session;
+    hist_init(SESSION_HISTORY);
+    current = previous;
+    return session;
+}
+
+/**
+ * Run one line of input in a session and return its exit status, or -1 once
+ * the session has run exit. The standard output of the line replaces
+ * whatever session_output() held before.
+ */
+int session_execute(struct session *session, const char *line)
+{
+    if (session->exited) {
+        return -1;
+    }
+    fflush(session->out);
+    if (session->capture && (ftruncate(session->output_fd, 0) == -1
+            || lseek(session->output_fd, 0, SEEK_SET) == -1)) {
+        perror("session_execute");
+        return -1;
+    }
+
+    struct session *previous = current;
+    current = session;
+    char *command = strdup(line);
+    if (run_command(command) == -1) {
+        session->exited = true;
+    }
+    free(command);
+    fflush(session->out);
+    current = previous;
+
+    return session->exited ? -1 : session_status(session);
+}
+
+/**
+ * The standard output of the last line run, NUL terminated, with its length
+ * stored in len if that isn't NULL. The string belongs to the session and
+ * stays valid until the next call. It is empty once the session has been
+ * redirected.
+ */
+const char *session_output(struct session *session, size_t *len)
+{
+    struct stat info = { 0 };
+    if (session->capture && fstat(session->output_fd, &info) == -1) {
+        return NULL;
+    }
+    char *output = realloc(session->output, info.st_size + 1);
+    if (output == NULL) {
+        return NULL;
+    }
+    session->output = output;
+
+    size_t total = 0;
+    while (total < (size_t) info.st_size) {
+        ssize_t read_sz = pread(session->output_fd, output + total,
+                info.st_size - total, total);
+        if (read_sz <= 0) {
+            break;
+        }
+        total += read_sz;
+    }
+    output[total] = '\0';
+    if (len != NULL) {
+        *len = total;
+    }
+    return output;
+}
+
+//exit status of the last command, 128 + the signal if it was killed
+int session_status(const struct session *session)
+{
+    if (WIFSIGNALED(session->status)) {
+        return 128 + WTERMSIG(session->status);
+    }
+    return WEXITSTATUS(session->status);
+}
+
+/**
+ * Point a session at another working directory and stdio, for example ones
+ * passed in by a client. The session takes over the four descriptors (any
+ * may be -1 to inherit the process's) and closes the ones it had, including
+ * its capture file. Returns -1 if builtins can't be given the new output.
+ */
+int session_redirect(struct session *session, int cwd_fd, int stdin_fd,
+        int stdout_fd, int stderr_fd)
+{
+    if (session->out != NULL) {
+        fclose(session->out);
+        session->out = NULL;
+    }
+    close_fd(&session->cwd_fd);
+    close_fd(&session->stdin_fd);
+    close_fd(&session->output_fd);
+    close_fd(&session->stderr_fd);
+    session->cwd_fd = cwd_fd;
+    session->stdin_fd = stdin_fd;
+    session->output_fd = stdout_fd;
+    session->stderr_fd = stderr_fd;
+    session->capture = false;
+    return stdout_fd != -1 ? open_out(session) : 0;
+}
+
+//forget the session's background jobs that have finished
+size_t session_collect(struct session *session)
+{
+    struct session *previous = current;
+    current = session;
+    size_t collected = jobs_collect();
+    current = previous;
+    return collected;
+}
+
+/**
+ * Free a session. Background jobs it started keep running but are no longer
+ * tracked.
+ */
+void session_destroy(struct session *session)
+{
+    if (session == NULL) {
+        return;
+    }
+    struct session *previous = current;
+    current = session;
+    free_jobs();
+    hist_destroy();
+    arena_destroy();
+    current = previous;
+
+    if (session->out != NULL) {
+        fclose(session->out);
+    }
+    close_fd(&session->cwd_fd);
+    close_fd(&session->stdin_fd);
+    close_fd(&session->output_fd);
+    close_fd(&session->stderr_fd);
+    free(session->output);
+    free(session);
+}
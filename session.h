@@ -0,0 +1,57 @@
+/**
+ * @file
+ *
+ * SESSIONS
+ * Everything one shell needs of its own: history, background jobs, the last
+ * exit status and where its commands read, write and run. The interactive
+ * shell uses a built-in session; programs embedding libshell.so create as
+ * many as they like and may drive each from its own thread. A session's
+ * commands run in its working directory with stdin from /dev/null, and their
+ * standard output is captured for session_output() unless the session has
+ * been pointed at other descriptors with session_redirect().
+ */
+
+#ifndef _SESSION_H_
+#define _SESSION_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+struct arena;
+struct hist_state;
+struct job_table;
+
+//one independent shell
+struct session {
+    struct hist_state *history;
+    struct job_table *jobs;
+    struct arena *arena; //scratch memory for the command being run
+    int status; //status of the last command, as returned by waitpid
+    bool exited; //true once the session has run exit
+    int cwd_fd; //working directory, -1 to use the process's
+    int stdin_fd; //stdin for children, -1 to inherit
+    int output_fd; //standard output for children, -1 to inherit
+    int stderr_fd; //standard error for children, -1 to inherit
+    bool capture; //true while output_fd is a memfd for session_output
+    FILE *out; //where builtins print
+    size_t pipe_size; //buffer size for pipeline pipes, 0 for SWISH_PIPE_SIZE
+    char *output; //the last copy handed out by session_output
+};
+
+struct session *session_create(void);
+int session_execute(struct session *, const char *);
+const char *session_output(struct session *, size_t *);
+int session_status(const struct session *);
+int session_redirect(struct session *, int, int, int, int);
+size_t session_collect(struct session *);
+void session_destroy(struct session *);
+
+struct session *session_current(void);
+FILE *session_stdout(void);
+int session_stdin(void);
+int session_open(const char *, int);
+int session_chdir(const char *);
+void session_child(void);
+
+#endif
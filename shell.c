@@ -4,70 +4,42 @@
  * shell (main)
  */
 
+#define _GNU_SOURCE
+#include <errno.h>
 #include <fcntl.h>
 #include <pwd.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/param.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <ctype.h>
 
+#include "arena.h"
+#include "builtin.h"
+#include "fastpath.h"
 #include "history.h"
+#include "jobs.h"
 #include "logger.h"
+#include "loop.h"
+#include "memo.h"
+#include "metrics.h"
+#include "pipes.h"
+#include "replay.h"
+#include "schedule.h"
+#include "serve.h"
+#include "session.h"
 #include "ui.h"
 #include "shell.h"
+#include "trace.h"
+#include "zygote.h"
 
-static bool piping = false; //boolean true when piping is called for
-
-static size_t job_size = 0; //number of jobs currently running in the background
-
-static struct process jobs[10]; //a list of background jobs
-
-static bool running = true; //boolean true if running background jobs
-
-//don't allow simple ^C to exit
-void sigint_handler(int signo)
-{
-    LOGP("Attempted to Exit\n");
-}
-
-//remove background job that has completed
-void sigchld_handler(int signo)
-{
-    if (running) {
-        int status_local;
-        pid_t pid = waitpid(-1,&status_local,WNOHANG);
-        
-        if(pid>0){
-            for(int i = 0; i<job_size; i++){
-                if(jobs[i].background_pid==pid) {
-                    LOG("Match Found at %d Replacing... %s\n", jobs[i].background_pid, jobs[i].command);
-                    jobs[i].background_pid = 0;
-                    free(jobs[i].command);
-                    jobs[i].command = NULL;
-                    for(int j = i; j<job_size; j++) {
-                        jobs[j] = jobs[j+1];
-                    }
-                    job_size--;
-                }
-            }
-        }
-    }
-}
-
-//empty the job list
-void free_jobs(void)
-{
-    running = false;
-    for(int i = 0; i<=job_size; i++){
-        LOG("Freeing: %s\n", jobs[i].command);
-        free(jobs[i].command);
-    }
-}
+static bool exec_in_place; //true while running the only line of a -c string
 
 //helps parse tokens
 char *next_token(char **str_ptr, const char *delim)
@@ -98,6 +70,71 @@ char *next_token(char **str_ptr, const char *delim)
     return current_ptr;
 }
 
+/**
+ * If token is a heredoc operator (<<WORD, <<-WORD, or << and <<- followed by
+ * the word in next), return its delimiter with any quotes removed, setting
+ * strip_tabs for <<-. Returns NULL for anything else.
+ */
+char *heredoc_delimiter(char *token, char *next, bool *strip_tabs)
+{
+    if (strncmp(token, "<<", 2) != 0 || token[2] == '<') {
+        return NULL;
+    }
+    char *delim = token + 2;
+    *strip_tabs = *delim == '-';
+    if (*strip_tabs) {
+        delim++;
+    }
+    if (*delim == '\0') {
+        delim = next;
+    }
+    if (delim == NULL) {
+        return NULL;
+    }
+    /* 'EOF' means EOF: there is no expansion for the quotes to turn off */
+    char *out = delim;
+    for (char *c = delim; *c != '\0'; c++) {
+        if (*c != '\'' && *c != '"') {
+            *out++ = *c;
+        }
+    }
+    *out = '\0';
+    return *delim != '\0' ? delim : NULL;
+}
+
+/**
+ * Take the next heredoc body off *text: the lines up to the one holding only
+ * delim, which is dropped. With strip_tabs, leading tabs are removed from
+ * every line, in place. Without a delimiter the body runs to the end.
+ */
+static size_t next_heredoc(char **text, const char *delim, bool strip_tabs, const char **body)
+{
+    char *start = *text;
+    char *out = start;
+    char *line = start;
+    *body = start != NULL ? start : "";
+    *text = NULL;
+    while (line != NULL && *line != '\0') {
+        char *end = strchr(line, '\n');
+        size_t len = end != NULL ? (size_t) (end - line) : strlen(line);
+        while (strip_tabs && len > 0 && *line == '\t') {
+            line++;
+            len--;
+        }
+        if (len == strlen(delim) && strncmp(line, delim, len) == 0) {
+            *text = end != NULL ? end + 1 : NULL;
+            break;
+        }
+        memmove(out, line, len);
+        out += len;
+        if (end != NULL) {
+            *out++ = '\n';
+        }
+        line = end != NULL ? end + 1 : NULL;
+    }
+    return start != NULL ? (size_t) (out - start) : 0;
+}
+
 //return the sive of the command
 size_t get_size(size_t size, char **args)
 {
@@ -110,119 +147,231 @@ size_t get_size(size_t size, char **args)
 
 }
 
-int main(void)
+//parse and run one line of input, returning -1 once the shell should exit
+int run_command(char *command)
 {
-    init_ui();
-    
-    piping = false;
+    int result = 0;
+    bool piping = false; //true when piping is called for
 
-    signal(SIGINT, sigint_handler);
-    signal(SIGCHLD, sigchld_handler);
+    /* Heredoc bodies follow the command line itself */
+    char *heredocs = strchr(command, '\n');
+    if (heredocs != NULL) {
+        *heredocs++ = '\0';
+    }
 
-    char *command;
-    while (true) {
-        command = read_command();
-        if (command == NULL) {
-            break;
-        }
+    TRACE_BEGIN(TRACE_PARSE);
+    char **args = arena_alloc(11 * sizeof(char *));
 
-        char **args = (char **) calloc(11, sizeof(char *));
-
-        int arg_max=10;
-        int tokens = 0;
-        int arg_size = 0;
-        char *next_tok = command;
-        char *curr_tok;
-        while((curr_tok = next_token(&next_tok, " \t\r\n")) != NULL) {
-            arg_size++;
-            if(!(arg_size<arg_max)) {
-                arg_max*=2;
-                char **temp_args = realloc(args, sizeof(char *)*arg_max);
-                if (temp_args==NULL) {
-                    free(args);
-                    exit(0);
-                } else {
-                    args = temp_args;
-                }
-            }
-            if(curr_tok[0]=='|'||curr_tok[0]=='>'||curr_tok[0]=='<'){
-                piping=true;
+    int arg_max=10;
+    int tokens = 0;
+    int arg_size = 0;
+    char *next_tok = command;
+    char *curr_tok;
+    while((curr_tok = next_token(&next_tok, " \t\r\n")) != NULL) {
+        arg_size++;
+        if(!(arg_size<arg_max)) {
+            arg_max*=2;
+            char **temp_args = arena_alloc(sizeof(char *)*(arg_max+1));
+            if (temp_args==NULL) {
+                exit(0);
+            } else {
+                memcpy(temp_args, args, sizeof(char *)*tokens);
+                args = temp_args;
             }
-            args[tokens++] = curr_tok;
         }
-        args[tokens] = NULL;
+        if(curr_tok[0]=='|'||curr_tok[0]=='>'||curr_tok[0]=='<'){
+            piping=true;
+        }
+        args[tokens++] = curr_tok;
+    }
+    args[tokens] = NULL;
+    TRACE_END(TRACE_PARSE);
 
-        if(args[0] == (char *) 0) {
-            goto cleanup;
+    if(args[0] == (char *) 0) {
+        goto cleanup;
+    }
+
+    if(piping){
+        if(construct_pipeline(args, arg_size, heredocs)==0) {
+            //the pipeline has been constructed
+        } else {
+            LOGP("Pipeline Failure\n");
         }
+        goto cleanup;
+    } 
 
-        if(piping){
-            if(construct_pipeline(args, arg_size)==0) {
-                //the pipeline has been constructed
-            } else {
-                LOGP("Pipeline Failure\n");
-            }
-            piping = false;
+    //check for builtins
+    int builtin = builtins(args, arg_size, false);
+
+    if(builtin!=0){
+        if(builtin==-1){
+            LOGP("Exiting\n");
+            result = -1;
             goto cleanup;
-        } 
+        } else if(builtin==1){
+            goto cleanup;
+        }
+    }
 
-        //check for builtins
-        int builtin = builtins(args, arg_size, false);
 
-        if(builtin!=0){
-            if(builtin==-1){
-                LOGP("Exiting\n");
-                free(command);
-                hist_destroy();
-                free_jobs();
-                exit(0);
-            } else if(builtin==1){
-                goto cleanup;
-            }
+    if(args[0] == (char *) 0) {
+        goto cleanup;
+    } else {
+
+        //need to find new size of array if there was comments
+        for(int i = 0; i<arg_size; i++){
+            if(args[i]==NULL || strcmp(args[i], "")==0){
+                arg_size = i;
+                break;
+            } 
         }
 
+        args[arg_size] = NULL;
 
-        if(args[0] == (char *) 0) {
-            goto cleanup;
+        //convert the new array to something we can pass to history
+        char *hist_buf = arena_alloc(get_size(arg_size, args)+1);
+        strcpy(hist_buf, args[0]);
+
+        for(int i = 1; i<arg_size; i++){
+            strcat(hist_buf, " ");
+            strcat(hist_buf, args[i]);
+        }
+
+        //add to history
+        hist_add(hist_buf);
+
+        execute(args);
+    }
+
+
+cleanup:
+    /* Everything the command needed from the arena goes at once */
+    arena_reset();
+    metrics_tick();
+    return result;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: swish [--record FILE | --replay FILE [--paced] | --serve SOCKET]\n"
+            "       swish -c COMMAND\n"
+            "       swish SCRIPT\n");
+    exit(2);
+}
+
+/**
+ * Run a script, or a -c string as if it were one, and return the status of
+ * its last command. Nothing an interactive shell needs is set up: no helper
+ * process (a fork from a shell this small is just as quick), no event loop,
+ * no readline and no history. Tools like make call $SHELL -c thousands of
+ * times, so startup to the first exec is what counts here.
+ */
+static int run_script(char *command_string, const char *script)
+{
+    FILE *file;
+    if (command_string != NULL) {
+        file = fmemopen(command_string, strlen(command_string), "r");
+    } else {
+        file = fopen(script, "re");
+    }
+    if (file == NULL) {
+        perror(command_string != NULL ? "swish: -c" : script);
+        return 127;
+    }
+    init_script(file);
+    exec_in_place = command_string != NULL && strchr(command_string, '\n') == NULL;
+
+    char *command;
+    while ((command = read_command()) != NULL) {
+        int result = run_command(command);
+        free(command);
+        if (result == -1) {
+            break;
+        }
+    }
+    fclose(file);
+    free_jobs();
+    arena_destroy();
+    return session_status(session_current());
+}
+
+int main(int argc, char *argv[])
+{
+    char *record_file = NULL;
+    char *replay_file = NULL;
+    char *serve_socket = NULL;
+    char *command_string = NULL;
+    char *script = NULL;
+    bool paced = false;
+    for (int i = 1; i < argc && script == NULL; i++) {
+        if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            command_string = argv[++i];
+            break; //anything after it belongs to the command, like sh
+        } else if (argv[i][0] != '-') {
+            script = argv[i];
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            record_file = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replay_file = argv[++i];
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            serve_socket = argv[++i];
+        } else if (strcmp(argv[i], "--paced") == 0) {
+            paced = true;
         } else {
+            usage();
+        }
+    }
 
-            //need to find new size of array if there was comments
-            for(int i = 0; i<arg_size; i++){
-                if(args[i]==NULL || strcmp(args[i], "")==0){
-                    arg_size = i;
-                    break;
-                } 
-            }
+    trace_init();
+    metrics_init();
 
-            args[arg_size] = NULL;
+    /* The server has no terminal of its own; skip readline and the prompt */
+    if (serve_socket != NULL) {
+        return serve(serve_socket) == -1 ? 1 : 0;
+    }
 
-            //convert the new array to something we can pass to history
-            char hist_buf[get_size(arg_size, args)+1];
-            strcpy(hist_buf, args[0]);
+    if (command_string != NULL || script != NULL) {
+        return run_script(command_string, script);
+    }
 
-            for(int i = 1; i<arg_size; i++){
-                strcat(hist_buf, " ");
-                strcat(hist_buf, args[i]);
-            }
+    /* Before readline and history, while the address space is still small */
+    zygote_start();
+    loop_init();
+    init_ui();
 
-            //add to history
-            hist_add(hist_buf);
+    if (replay_file != NULL) {
+        int replayed = replay_session(replay_file, paced);
+        free_jobs();
+        hist_destroy();
+        arena_destroy();
+        return replayed == -1 ? 1 : 0;
+    }
+    if (record_file != NULL && record_open(record_file) == -1) {
+        perror(record_file);
+        return 1;
+    }
 
-            if(execute(args)==-1){
-                goto cleanup;
-            }
-            
+    char *command;
+    while (true) {
+        command = read_command();
+        if (command == NULL) {
+            break;
         }
 
+        record_begin(command);
+        int result = run_command(command);
+        record_end();
 
-cleanup:
         /* We are done with command; free it */
         free(command);
-        free(args);
-        arg_size = 0;
+        if (result == -1) {
+            break;
+        }
     }
+    record_close();
     free_jobs();
     hist_destroy();
+    arena_destroy();
     return 0;
 }
 
@@ -234,73 +383,377 @@ int seperate_args(char **args, char *original, size_t size){
     char *curr_tok;
     while((curr_tok = next_token(&next_tok, " \t\r\n")) != NULL) {
         counter++;
-        if(curr_tok[0]=='|'||curr_tok[0]=='>'||curr_tok[0]=='<'){
-            piping=true;
-        }
         args[tokens++] = curr_tok;
     }
     args[tokens] = NULL;
     return counter;
 }
 
-//execute a constructed pipeline
-int execute_pipeline(struct command_line *cmds)
+/**
+ * Put a heredoc body in a sealed memfd: it never touches the disk and, unlike
+ * a pipe, the command can read it at its own pace without a writer process.
+ */
+static int here_fd(const struct command_line *cmd)
+{
+    int fd = memfd_create("heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1) {
+        return -1;
+    }
+    const char *data = cmd->here_body;
+    size_t left = cmd->here_len;
+    while (left > 0) {
+        ssize_t written = write(fd, data, left);
+        if (written == -1) {
+            close(fd);
+            return -1;
+        }
+        data += written;
+        left -= written;
+    }
+    if ((cmd->here_newline && write(fd, "\n", 1) != 1)
+            || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1
+            || lseek(fd, 0, SEEK_SET) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * The exit status of a child whose exec failed with error, as sh reports it:
+ * 127 if there was no such program, 126 if it couldn't be run.
+ */
+int exec_status(int error)
+{
+    return error == ENOENT || error == ENOTDIR ? 127 : 126;
+}
+
+//point stdin at a command's input file or heredoc, if it has one
+static void redirect_stdin(const struct command_line *cmd)
+{
+    int fd = -1;
+    if (cmd->here_body != NULL) {
+        fd = here_fd(cmd);
+        if (fd == -1) {
+            perror("heredoc");
+            _exit(1);
+        }
+    } else if (cmd->stdin_file != NULL) {
+        fd = open(cmd->stdin_file, O_RDONLY);
+    }
+    if (fd != -1) {
+        dup2(fd, STDIN_FILENO);
+        close(fd);
+    }
+}
+
+//send the last stage's output to its file, if it has one
+static void redirect_stdout(const struct command_line *cmd)
+{
+    if (cmd->stdout_file!=NULL) {
+        if (cmd->append) {
+            int fd = open(cmd->stdout_file, O_WRONLY | O_APPEND, 0666);
+            dup2(fd, STDOUT_FILENO);
+            close(fd);
+        } else {
+            int fd = open(cmd->stdout_file, O_WRONLY | O_TRUNC | O_CREAT, 0666);
+            dup2(fd, STDOUT_FILENO);
+            close(fd);
+        }
+    }
+}
+
+/**
+ * Execute a constructed pipeline. The last stage runs in place of this
+ * process, unless the pipeline is being watched for pipestat, when it is
+ * started like the others and this process stays to watch them.
+ */
+int execute_pipeline(struct command_line *cmds, const struct pipe_options *options)
 {
     int counter = 0;
+    pid_t pids[MAX_PIPELINE];
+    char *names[MAX_PIPELINE];
+    int read_fds[MAX_PIPELINE];
     while(cmds[counter].stdout_pipe){
         /* Creates a pipe. */
         int fd[2];
-        if (pipe(fd) == -1) {
+        if (pipe2(fd, options->stats ? O_CLOEXEC : 0) == -1) {
             perror("pipe");
             return -1;
         }
+        pipes_tune(fd[0], options->size);
         
+        METRIC_INC(METRIC_FORKS);
         pid_t pid = fork();
         if (pid == 0) {
             dup2(fd[1], STDOUT_FILENO);
             close(fd[0]);
+            redirect_stdin(&cmds[counter]);
+            TRACE_INSTANT(TRACE_EXEC, 0);
+            METRIC_INC(METRIC_EXECS);
             execvp(cmds[counter].tokens[0], cmds[counter].tokens);
+            METRIC_INC(METRIC_EXEC_FAILURES);
+            int error = errno;
+            perror("execvp");
+            _exit(exec_status(error));
         } else {
             dup2(fd[0], STDIN_FILENO);
             close(fd[1]);
+            if (options->stats) {
+                pids[counter] = pid;
+                names[counter] = cmds[counter].tokens[0];
+                read_fds[counter] = fd[0];
+            } else {
+                /* Later stages mustn't hold the read end, or this stage
+                 * would never see SIGPIPE when its reader quits */
+                close(fd[0]);
+            }
             counter++;
         }
     }
 
-    if (cmds[counter].stdout_file!=NULL) {
-        if (cmds[counter].append) {
-            int fd = open(cmds[counter].stdout_file, O_WRONLY | O_APPEND, 0666);
-            dup2(fd, STDOUT_FILENO);
-            close(fd);
-        } else {
-            int fd = open(cmds[counter].stdout_file, O_WRONLY | O_TRUNC | O_CREAT, 0666);
-            dup2(fd, STDOUT_FILENO);
-            close(fd);
+    if (options->stats) {
+        METRIC_INC(METRIC_FORKS);
+        pids[counter] = fork();
+        names[counter] = cmds[counter].tokens[0];
+        if (pids[counter] == 0) {
+            redirect_stdout(&cmds[counter]);
+            redirect_stdin(&cmds[counter]);
+            TRACE_INSTANT(TRACE_EXEC, 0);
+            METRIC_INC(METRIC_EXECS);
+            execvp(cmds[counter].tokens[0], cmds[counter].tokens);
+            METRIC_INC(METRIC_EXEC_FAILURES);
+            int error = errno;
+            perror("execvp");
+            _exit(exec_status(error));
+        }
+        close(STDIN_FILENO);
+        int status_local = pipes_monitor(pids, names, read_fds, counter + 1);
+        if (WIFSIGNALED(status_local)) {
+            signal(WTERMSIG(status_local), SIG_DFL);
+            raise(WTERMSIG(status_local));
         }
+        _exit(WIFEXITED(status_local) ? WEXITSTATUS(status_local) : 1);
     }
 
-    if (cmds[counter].stdin_file != NULL) {
-        int fd = open(cmds[counter].stdin_file, O_RDONLY);
-        dup2(fd, STDIN_FILENO);
-        close(fd);
-    }
+    redirect_stdout(&cmds[counter]);
+    redirect_stdin(&cmds[counter]);
 
+    TRACE_INSTANT(TRACE_EXEC, 0);
+    METRIC_INC(METRIC_EXECS);
     execvp(cmds[counter].tokens[0], cmds[counter].tokens);
+    METRIC_INC(METRIC_EXEC_FAILURES);
+    int error = errno;
+    perror("execvp");
+    _exit(exec_status(error));
+}
 
-    return 0;
-    
+/**
+ * Execute a pipeline split with |+: the first segment's output is duplicated
+ * to each of the others, and this process moves it between them. Exits with
+ * the status of the last segment.
+ */
+static void execute_fanout(struct command_line *cmds, const size_t *starts, size_t segments,
+        const struct pipe_options *options)
+{
+    pid_t pids[MAX_FANOUT + 1];
+    int outs[MAX_FANOUT];
+    int producer[2];
+    if (pipe2(producer, O_CLOEXEC) == -1) {
+        perror("pipe");
+        _exit(1);
+    }
+    pipes_tune(producer[0], options->size);
+
+    for (size_t i = 0; i < segments; i++) {
+        int consumer[2] = { -1, -1 };
+        if (i > 0 && pipe2(consumer, O_CLOEXEC) == -1) {
+            perror("pipe");
+            _exit(1);
+        }
+        if (i > 0) {
+            pipes_tune(consumer[0], options->size);
+            outs[i - 1] = consumer[1];
+        }
+        METRIC_INC(METRIC_FORKS);
+        pids[i] = fork();
+        if (pids[i] == -1) {
+            perror("fork");
+            _exit(1);
+        } else if (pids[i] == 0) {
+            dup2(i == 0 ? producer[1] : consumer[0], i == 0 ? STDOUT_FILENO : STDIN_FILENO);
+            /* pipestat keeps a process around that never execs, so the
+             * other segments' pipes must go now rather than on exec */
+            for (size_t j = 0; j < i; j++) {
+                close(outs[j]);
+            }
+            if (i > 0) {
+                close(consumer[0]);
+            }
+            close(producer[0]);
+            close(producer[1]);
+            execute_pipeline(&cmds[starts[i]], options);
+            _exit(1);
+        }
+        if (i > 0) {
+            close(consumer[0]);
+        }
+    }
+    close(producer[1]);
+
+    pipes_fanout(producer[0], outs, segments - 1);
+    close(producer[0]);
+    int status_local = 0;
+    for (size_t i = 0; i < segments; i++) {
+        waitpid(pids[i], &status_local, 0);
+    }
+    if (WIFSIGNALED(status_local)) {
+        signal(WTERMSIG(status_local), SIG_DFL);
+        raise(WTERMSIG(status_local));
+    }
+    _exit(WIFEXITED(status_local) ? WEXITSTATUS(status_local) : 1);
 }
 
-//constructs a pipeline to later be executed
-int construct_pipeline(char **args, size_t size)
+/**
+ * Start the command of a process substitution with one end of a pipe as its
+ * stdout (for <(cmd), reading) or stdin (for >(cmd)), returning its pid and
+ * leaving the other end, close-on-exec for now, in *fd.
+ */
+static pid_t substitute(char **argv, bool reading, int *fd)
 {
-    
-    struct command_line cmds[400] = { 0 };
-    if(size>0){
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        perror("pipe");
+        return -1;
+    }
+    METRIC_INC(METRIC_FORKS);
+    pid_t child = fork();
+    if (child == -1) {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    } else if (child == 0) {
+        session_child();
+        dup2(reading ? fds[1] : fds[0], reading ? STDOUT_FILENO : STDIN_FILENO);
+        TRACE_INSTANT(TRACE_EXEC, 0);
+        METRIC_INC(METRIC_EXECS);
+        execvp(argv[0], argv);
+        METRIC_INC(METRIC_EXEC_FAILURES);
+        int error = errno;
+        perror("execvp");
+        _exit(exec_status(error));
+    }
+    close(reading ? fds[1] : fds[0]);
+    *fd = reading ? fds[0] : fds[1];
+    return child;
+}
+
+/**
+ * Replace every <(cmd) and >(cmd) in args with a /dev/fd path to a pipe fed
+ * by (or feeding) cmd, which starts right away. The tokens of cmd run up to
+ * the first one ending in ')'. Returns the new size of args, or -1.
+ */
+static int substitute_args(char **args, size_t size, struct substitution *subs, size_t *count)
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < size; i++) {
+        if ((args[i][0] != '<' && args[i][0] != '>') || args[i][1] != '(') {
+            args[kept++] = args[i];
+            continue;
+        }
+        bool reading = args[i][0] == '<';
+        size_t end = i;
+        while (end < size && args[end][strlen(args[end]) - 1] != ')') {
+            end++;
+        }
+        if (end == size || *count == MAX_SUBSTITUTIONS) {
+            fprintf(stderr, end == size ? "swish: missing ) after %s\n"
+                    : "swish: too many process substitutions at %s\n", args[i]);
+            return -1;
+        }
+
+        char *argv[end - i + 2];
+        size_t argc = 0;
+        args[end][strlen(args[end]) - 1] = '\0';
+        for (size_t j = i; j <= end; j++) {
+            char *word = j == i ? args[j] + 2 : args[j];
+            if (*word != '\0') {
+                argv[argc++] = word;
+            }
+        }
+        argv[argc] = NULL;
+        if (argc == 0) {
+            fprintf(stderr, "swish: empty process substitution\n");
+            return -1;
+        }
+
+        struct substitution *sub = &subs[*count];
+        if ((sub->pid = substitute(argv, reading, &sub->fd)) == -1) {
+            return -1;
+        }
+        (*count)++;
+        snprintf(sub->path, sizeof(sub->path), "/dev/fd/%d", sub->fd);
+        args[kept++] = sub->path;
+        i = end;
+    }
+    args[kept] = NULL;
+    return kept;
+}
+
+/**
+ * Constructs a pipeline to later be executed. heredocs holds the lines after
+ * the command line, where the bodies of its heredocs are found, or NULL.
+ */
+int construct_pipeline(char **args, size_t size, char *heredocs)
+{
+    struct command_line cmds[MAX_PIPELINE] = { 0 };
+    struct substitution subs[MAX_SUBSTITUTIONS];
+    size_t sub_count = 0;
+    int result = -1;
+
+    /* pipestat and pipesize SIZE may come before the first command */
+    struct pipe_options options = { .size = pipes_default() };
+    while (size > 0) {
+        if (strcmp(args[0], "pipestat") == 0) {
+            options.stats = true;
+        } else if (strcmp(args[0], "pipesize") == 0 && size > 1
+                && pipes_parse_size(args[1], &options.size) == 0) {
+            args++;
+            size--;
+        } else if (strcmp(args[0], "pipesize") == 0) {
+            fprintf(stderr, "usage: pipesize [SIZE[K|M|G] | max | default] [COMMAND...]\n");
+            return -1;
+        } else {
+            break;
+        }
+        args++;
+        size--;
+    }
+    if (size == 0) {
+        fprintf(stderr, "swish: no command to run\n");
+        return -1;
+    }
+
+    int substituted = substitute_args(args, size, subs, &sub_count);
+    if(substituted>0){
+        size = substituted;
         int cmds_counter = 0;
+        size_t starts[MAX_FANOUT + 1] = { 0 };
+        size_t segments = 1;
         cmds[0].tokens = &args[0];
         for(int i = 0; i<size; i++){
-            if(args[i][0]=='|') {
+            if(strcmp(args[i], "|+")==0) {
+                if (segments == MAX_FANOUT + 1 || args[i + 1] == NULL) {
+                    fprintf(stderr, args[i + 1] == NULL ? "swish: missing command after |+\n"
+                            : "swish: too many consumers for |+\n");
+                    goto cleanup;
+                }
+                args[i] = NULL; // ends the segment before it
+                cmds_counter++;
+                starts[segments++] = cmds_counter;
+                cmds[cmds_counter].tokens = &args[i + 1];
+            } else if(args[i][0]=='|') {
                 args[i] = NULL;
                 cmds[cmds_counter].stdout_pipe = true;
                 cmds_counter++;
@@ -312,93 +765,606 @@ int construct_pipeline(char **args, size_t size)
                 args[i] = NULL; // remove > from args
                 cmds[cmds_counter].stdout_file = args[i + 1];
 
+            } else if(strncmp(args[i], "<<<", 3) == 0){
+                char *word = args[i][3] != '\0' ? args[i] + 3 : args[i + 1];
+                if (word == NULL) {
+                    fprintf(stderr, "swish: here-string without a word\n");
+                    goto cleanup;
+                }
+                args[i] = NULL; // remove <<< from args
+                cmds[cmds_counter].here_body = word;
+                cmds[cmds_counter].here_len = strlen(word);
+                cmds[cmds_counter].here_newline = true;
+            } else if(strncmp(args[i], "<<", 2) == 0){
+                bool strip_tabs;
+                char *delim = heredoc_delimiter(args[i], args[i + 1], &strip_tabs);
+                if (delim == NULL) {
+                    fprintf(stderr, "swish: heredoc without a delimiter\n");
+                    goto cleanup;
+                }
+                args[i] = NULL; // remove << from args
+                cmds[cmds_counter].here_len = next_heredoc(&heredocs, delim, strip_tabs,
+                        &cmds[cmds_counter].here_body);
             } else if(args[i][0] == '<'){
                 args[i] = NULL; // remove < from args
                 cmds[cmds_counter].stdin_file = args[i + 1];
             }
         }
 
+        /* Only the pipeline may inherit the substitutions' pipes */
+        for (size_t i = 0; i < sub_count; i++) {
+            fcntl(subs[i].fd, F_SETFD, 0);
+        }
+
+        METRIC_INC(METRIC_PIPELINES);
+        METRIC_INC(METRIC_FORKS);
+        TRACE_BEGIN(TRACE_FORK);
         pid_t child = fork();
         if(child == -1) {
             perror("fork");
-            return -1;
+            goto cleanup;
         } else if (child == 0) {
-            if(execute_pipeline(cmds) != 0) {
+            session_child();
+            if (segments > 1) {
+                execute_fanout(cmds, starts, segments, &options);
+            } else if(execute_pipeline(cmds, &options) != 0) {
                 close(fileno(stdin));
                 perror("execute_pipeline");
-                exit(1);
+                _exit(1);
             } 
         } else {
+            TRACE_END(TRACE_FORK);
+            /* Our copies would keep the substitutions from seeing EOF */
+            for (size_t i = 0; i < sub_count; i++) {
+                close(subs[i].fd);
+                subs[i].fd = -1;
+            }
             int status_local;
-            wait(&status_local);
+            TRACE_BEGIN(TRACE_WAIT);
+            waitpid(child, &status_local, 0);
+            TRACE_END(TRACE_WAIT);
             set_status(status_local);
         }
-        return 0;
-        
+        result = 0;
+    }
+
+cleanup:
+    /* Substitutions finish once the pipeline lets go of their pipes */
+    for (size_t i = 0; i < sub_count; i++) {
+        if (subs[i].fd != -1) {
+            close(subs[i].fd);
+        }
+        waitpid(subs[i].pid, NULL, 0);
     }
-    return -1;
+    return result;
 }
 
-//normal execution without piping or background execution
-int execute(char **args)
+/**
+ * Start args as a child of the shell, through the zygote if it is running
+ * and there are no scheduling attributes (sched may be NULL) to give the
+ * child before it execs. Returns the child's pid, or -1 if it couldn't be
+ * started.
+ */
+pid_t launch(char **args, const struct schedule *sched)
 {
-    pid_t child = fork();
+    METRIC_INC(METRIC_FORKS);
+    TRACE_BEGIN(TRACE_FORK);
+    bool scheduled = sched != NULL && !schedule_empty(sched);
+    pid_t child = scheduled ? -1 : zygote_spawn(args);
+    if (child == -1) {
+        child = fork();
+    }
     if(child == -1) {
         perror("fork");
         return -1;
     } else if (child == 0) {
+        session_child();
+        if (scheduled && schedule_apply(0, sched) == -1) {
+            perror("sched");
+        }
+        TRACE_INSTANT(TRACE_EXEC, 0);
+        METRIC_INC(METRIC_EXECS);
         if(execvp(args[0], args) != 0) {
+            int error = errno;
+            METRIC_INC(METRIC_EXEC_FAILURES);
             close(fileno(stdin));
+            errno = error;
             perror("execvp");
-            exit(1);
+            _exit(exec_status(error));
         } 
-    } else {
-        int status_local;
-        waitpid(child, &status_local, 0);
-        set_status(status_local);
     }
+    TRACE_END(TRACE_FORK);
+    return child;
+}
+
+//normal execution without piping or background execution
+int execute(char **args)
+{
+    int fast = fastpath_run(args);
+    if (fast != FASTPATH_FALLBACK) {
+        set_status(fast << 8);
+        return 0;
+    }
+
+    if (exec_in_place) {
+        /* Nothing runs after this command, so become it, as sh -c does */
+        session_child();
+        TRACE_INSTANT(TRACE_EXEC, 0);
+        METRIC_INC(METRIC_EXECS);
+        metrics_flush();
+        execvp(args[0], args);
+        int error = errno;
+        METRIC_INC(METRIC_EXEC_FAILURES);
+        metrics_flush();
+        errno = error;
+        perror("execvp");
+        _exit(exec_status(error));
+    }
+
+    pid_t child = launch(args, NULL);
+    if(child == -1) {
+        return -1;
+    }
+    int status_local;
+    TRACE_BEGIN(TRACE_WAIT);
+    waitpid(child, &status_local, 0);
+    TRACE_END(TRACE_WAIT);
+    set_status(status_local);
     return 0;
 }
 
 
 //execute the command in the background
-int background_execute(char **args, size_t arg_size)
+//run a command in the background, in a job class (or -1) and with sched (or NULL)
+int background_execute(char **args, size_t arg_size, int job_class,
+        const struct schedule *sched)
 {
-    pid_t child = fork();
-    if(child == -1) {
-        perror("fork");
+    if (jobs_running() >= MAX_JOBS && jobs_collect() == 0) {
+        fprintf(stderr, "swish: too many background jobs\n");
         return -1;
-    } else if (child == 0) {
-        if(execvp(args[0], args) != 0) {
-            close(fileno(stdin));
-            perror("execvp");
-            exit(1);
-        }
+    }
+
+    char *hist_buf = arena_alloc(get_size(arg_size, args)+1);
+    strcpy(hist_buf, args[0]);
+
+    for(int i = 1; i<arg_size; i++){
+        strcat(hist_buf, " ");
+        strcat(hist_buf, args[i]);
+    }
+
+    LOG("Adding: %s\n", hist_buf);
+    return job_start(args, hist_buf, job_class, sched);
+}
+
+/**
+ * Parse a timeout duration: a number, possibly fractional, with an optional
+ * s, m, h or d suffix (seconds by default). Returns milliseconds, or -1.
+ */
+static long long parse_duration(const char *text)
+{
+    char *end;
+    double value = strtod(text, &end);
+    if (end == text || value < 0) {
+        return -1;
+    }
+    double scale;
+    if (strcmp(end, "") == 0 || strcmp(end, "s") == 0) {
+        scale = 1000;
+    } else if (strcmp(end, "m") == 0) {
+        scale = 60 * 1000;
+    } else if (strcmp(end, "h") == 0) {
+        scale = 60 * 60 * 1000;
+    } else if (strcmp(end, "d") == 0) {
+        scale = 24 * 60 * 60 * 1000;
     } else {
+        return -1;
+    }
+    return (long long) (value * scale + 0.5);
+}
 
-        LOG("Saving PID: %d\n", child);
-        char hist_buf[get_size(arg_size, args)+1];
-        strcpy(hist_buf, args[0]);
+/**
+ * timeout [-k KILL_AFTER] DURATION COMMAND...: run a command with a deadline.
+ * Exits 124 if the command had to be stopped with SIGTERM, like timeout(1),
+ * and 125 if it couldn't be started or waited for.
+ */
+static int timeout_builtin(char **args, size_t arg_size, FILE *out)
+{
+    size_t first = 1;
+    long long kill_after = TIMEOUT_KILL_AFTER_MS;
+    if (arg_size > 2 && strcmp(args[1], "-k") == 0) {
+        kill_after = parse_duration(args[2]);
+        first = 3;
+    }
+    long long duration = first < arg_size ? parse_duration(args[first]) : -1;
+    if (kill_after == -1 || duration == -1 || first + 1 >= arg_size) {
+        fprintf(stderr, "usage: timeout [-k KILL_AFTER] DURATION COMMAND...\n");
+        return 125;
+    }
 
-        for(int i = 1; i<arg_size; i++){
-            strcat(hist_buf, " ");
-            strcat(hist_buf, args[i]);
+    pid_t child = launch(&args[first + 1], NULL);
+    if (child == -1) {
+        return 125;
+    }
+    int status_local;
+    TRACE_BEGIN(TRACE_WAIT);
+    int timed_out = wait_timeout(child, duration, kill_after, &status_local);
+    TRACE_END(TRACE_WAIT);
+    if (timed_out == -1) {
+        perror("timeout");
+        return 125;
+    }
+    if (timed_out && WIFSIGNALED(status_local) && WTERMSIG(status_local) == SIGTERM) {
+        status_local = 124 << 8;
+    }
+    set_status(status_local);
+    return BUILTIN_STATUS_SET;
+}
+
+/**
+ * wait [-n] [PID...]: wait for background jobs (all of them by default), or
+ * with -n for the next one to finish.
+ */
+static int wait_builtin(char **args, size_t arg_size, FILE *out)
+{
+    bool any = arg_size > 1 && strcmp(args[1], "-n") == 0;
+    size_t first = any ? 2 : 1;
+    pid_t pids[arg_size];
+    size_t count = 0;
+    for (size_t i = first; i < arg_size; i++) {
+        char *end;
+        long pid = strtol(args[i], &end, 10);
+        if (end == args[i] || *end != '\0' || pid <= 0) {
+            fprintf(stderr, "usage: wait [-n] [PID...]\n");
+            return 2;
         }
+        pids[count++] = pid;
+    }
 
-        LOG("Adding: %s\n", hist_buf);
-        
-        if (job_size<10) {
-            struct process job_struct = { .command=strdup(hist_buf), .background_pid=child};
-            jobs[job_size] = job_struct;
-            if (job_size!=9) {
-                job_size++;
-            }
+    int status_local;
+    TRACE_BEGIN(TRACE_WAIT);
+    int waited = jobs_wait(pids, count, any, &status_local);
+    TRACE_END(TRACE_WAIT);
+    if (waited == -1) {
+        status_local = (errno == EINTR ? 128 + SIGINT : 127) << 8;
+    }
+    set_status(status_local);
+    return BUILTIN_STATUS_SET;
+}
+
+/**
+ * Parse the scheduling options shared by sched and jobclass, starting at
+ * args[*first] and leaving *first at the first argument that isn't one: -a
+ * CPUS, -n NICE and -i CLASS[:LEVEL], plus -c JOBCLASS if class_name isn't
+ * NULL and -j MAX if max isn't NULL. Returns -1 on a bad option.
+ */
+static int parse_schedule(char **args, size_t arg_size, size_t *first,
+        struct schedule *sched, char **class_name, int *max)
+{
+    size_t i = *first;
+    for (; i + 1 < arg_size && args[i][0] == '-' && args[i][1] != '\0' && args[i][2] == '\0'; i += 2) {
+        char *value = args[i + 1];
+        char *end;
+        if (args[i][1] == 'a' && schedule_cpus(value, &sched->cpus) == 0) {
+            sched->has_cpus = true;
+        } else if (args[i][1] == 'n' && schedule_nice(value, &sched->nice) == 0) {
+            sched->has_nice = true;
+        } else if (args[i][1] == 'i' && schedule_ioprio(value, &sched->ioprio) == 0) {
+            continue;
+        } else if (args[i][1] == 'c' && class_name != NULL) {
+            *class_name = value;
+        } else if (args[i][1] == 'j' && max != NULL
+                && (*max = strtol(value, &end, 10)) >= 0 && end != value && *end == '\0') {
+            continue;
+        } else {
+            return -1;
         }
-    
     }
+    *first = i;
     return 0;
 }
 
+/**
+ * sched [-a CPUS] [-n NICE] [-i CLASS[:LEVEL]] [-c JOBCLASS] COMMAND... [&]:
+ * run a command on the given CPUs, at the given niceness and I/O priority.
+ * In the background it joins the job class, made on first use, and queues
+ * while the class is at its limit; in the foreground only the class's
+ * attributes apply.
+ */
+static int sched_builtin(char **args, size_t arg_size, FILE *out)
+{
+    bool background = arg_size > 1 && strcmp(args[arg_size - 1], "&") == 0;
+    if (background) {
+        args[--arg_size] = NULL;
+    }
+    struct schedule sched = { 0 };
+    char *class_name = NULL;
+    size_t first = 1;
+    int job_class = -1;
+    if (parse_schedule(args, arg_size, &first, &sched, &class_name, NULL) == -1
+            || first >= arg_size) {
+        fprintf(stderr, "usage: sched [-a CPUS] [-n NICE] [-i CLASS[:LEVEL]] "
+                "[-c JOBCLASS] COMMAND... [&]\n");
+        return 2;
+    }
+    if (class_name != NULL && (job_class = job_class_find(class_name, true)) == -1) {
+        fprintf(stderr, "sched: can't make job class %s\n", class_name);
+        return 1;
+    }
+
+    if (background) {
+        return background_execute(&args[first], arg_size - first, job_class, &sched)
+            == 0 ? 0 : 1;
+    }
+    struct schedule effective = { 0 };
+    if (job_class != -1) {
+        effective = job_class_get(job_class)->sched;
+    }
+    schedule_merge(&effective, &sched);
+    pid_t child = launch(&args[first], &effective);
+    if (child == -1) {
+        return 1;
+    }
+    int status_local;
+    TRACE_BEGIN(TRACE_WAIT);
+    waitpid(child, &status_local, 0);
+    TRACE_END(TRACE_WAIT);
+    set_status(status_local);
+    return BUILTIN_STATUS_SET;
+}
+
+/**
+ * jobclass [NAME [-j MAX] [-a CPUS] [-n NICE] [-i CLASS[:LEVEL]]]: list the
+ * job classes, or make or change one. MAX 0 lifts the limit. Changed
+ * attributes also apply to the class's running jobs.
+ */
+static int jobclass_builtin(char **args, size_t arg_size, FILE *out)
+{
+    if (arg_size == 1) {
+        job_classes_print(out);
+        return 0;
+    }
+    struct schedule sched = { 0 };
+    int max = -1;
+    size_t first = 2;
+    int job_class = -1;
+    if (args[1][0] == '-'
+            || parse_schedule(args, arg_size, &first, &sched, NULL, &max) == -1
+            || first != arg_size) {
+        fprintf(stderr, "usage: jobclass [NAME [-j MAX] [-a CPUS] [-n NICE] "
+                "[-i CLASS[:LEVEL]]]\n");
+        return 2;
+    }
+    if ((job_class = job_class_find(args[1], true)) == -1) {
+        fprintf(stderr, "jobclass: can't make job class %s\n", args[1]);
+        return 1;
+    }
+    struct job_class *class = job_class_get(job_class);
+    if (max != -1) {
+        class->max_running = max;
+    }
+    schedule_merge(&class->sched, &sched);
+    if (job_class_update(job_class) == -1) {
+        perror("jobclass");
+        return 1;
+    }
+    return 0;
+}
+
+static int exit_builtin(char **args, size_t arg_size, FILE *out)
+{
+    return BUILTIN_EXIT;
+}
+
+static int cd_builtin(char **args, size_t arg_size, FILE *out)
+{
+    if(arg_size==1){
+        session_chdir(getenv("HOME"));
+    } else if(arg_size==2) {
+        if(session_chdir(args[1])==-1){
+            perror("cd");
+            return 1;
+        }
+    } else {
+        LOGP("Invalid CD command\n");
+        return 2;
+    }
+    return 0;
+}
+
+static int history_builtin(char **args, size_t arg_size, FILE *out)
+{
+    hist_print(out);
+    return 0;
+}
+
+static int trace_builtin(char **args, size_t arg_size, FILE *out)
+{
+    if (arg_size>=2 && strcmp(args[1], "dump")==0) {
+        FILE *dump = out;
+        if (arg_size>=3 && (dump = fopen(args[2], "w"))==NULL) {
+            perror("trace");
+            return 1;
+        }
+        if (trace_dump(dump)==-1) {
+            fprintf(stderr, "trace: tracing is not available\n");
+        }
+        if (dump!=out) {
+            fclose(dump);
+        }
+    } else if (arg_size==2 && strcmp(args[1], "clear")==0) {
+        trace_clear();
+    } else {
+        fprintf(stderr, "usage: trace dump [file] | trace clear\n");
+        return 2;
+    }
+    return 0;
+}
+
+static int stats_builtin(char **args, size_t arg_size, FILE *out)
+{
+    metrics_print(out);
+    return 0;
+}
+
+static int jobs_builtin(char **args, size_t arg_size, FILE *out)
+{
+    jobs_print(out, arg_size>=2 && strcmp(args[1], "-l")==0);
+    return 0;
+}
+
+static int stress_builtin(char **args, size_t arg_size, FILE *out)
+{
+    size_t job_count = arg_size>=2 ? strtoul(args[1], NULL, 10) : 1000;
+    size_t pipeline_count = arg_size>=3 ? strtoul(args[2], NULL, 10) : job_count/10;
+    return jobs_stress(out, job_count, pipeline_count)==0 ? 0 : 1;
+}
+
+/**
+ * pipesize [SIZE[K|M|G] | max | default] [COMMAND...]: show or set the size
+ * of the pipes this session's pipelines get, or run a command with it. A
+ * line with pipes takes this as a prefix before it gets here.
+ */
+static int pipesize_builtin(char **args, size_t arg_size, FILE *out)
+{
+    size_t size;
+    if (arg_size == 1) {
+        int fds[2];
+        if (pipe(fds) == -1) {
+            perror("pipesize");
+            return 1;
+        }
+        fprintf(out, "%d\n", pipes_tune(fds[0], pipes_default()));
+        close(fds[0]);
+        close(fds[1]);
+        return 0;
+    } else if (pipes_parse_size(args[1], &size) == -1) {
+        fprintf(stderr, "usage: pipesize [SIZE[K|M|G] | max | default] [COMMAND...]\n");
+        return 2;
+    } else if (arg_size == 2) {
+        session_current()->pipe_size = size;
+        return 0;
+    }
+    return construct_pipeline(args, arg_size, NULL) == 0 ? BUILTIN_STATUS_SET : 1;
+}
+
+/**
+ * pipestat COMMAND [| COMMAND]...: run a pipeline and report the bytes each
+ * stage read and wrote and how often it stalled. A line with pipes takes
+ * this as a prefix before it gets here.
+ */
+static int pipestat_builtin(char **args, size_t arg_size, FILE *out)
+{
+    if (arg_size == 1) {
+        fprintf(stderr, "usage: pipestat COMMAND [| COMMAND]...\n");
+        return 2;
+    }
+    return construct_pipeline(args, arg_size, NULL) == 0 ? BUILTIN_STATUS_SET : 1;
+}
+
+/**
+ * memo [-r] [-e VAR]... [-f FILE]... [-c FILE]... COMMAND...: print the
+ * output and return the status COMMAND had the last time it ran with the
+ * same arguments, environment variables VAR, files FILE by mtime and files
+ * by content, running it only if it hasn't yet (or with -r, again).
+ */
+static int memo_builtin(char **args, size_t arg_size, FILE *out)
+{
+    char *env[arg_size];
+    char *stamped[arg_size];
+    char *hashed[arg_size];
+    struct memo_inputs inputs = { .env = env, .stamped = stamped, .hashed = hashed };
+    bool refresh = false;
+    size_t first = 1;
+    for (; first < arg_size && args[first][0] == '-' && args[first][1] != '\0'
+            && args[first][2] == '\0'; first++) {
+        char option = args[first][1];
+        if (option == 'r') {
+            refresh = true;
+        } else if (first + 1 == arg_size) {
+            break;
+        } else if (option == 'e') {
+            env[inputs.env_count++] = args[++first];
+        } else if (option == 'f') {
+            stamped[inputs.stamped_count++] = args[++first];
+        } else if (option == 'c') {
+            hashed[inputs.hashed_count++] = args[++first];
+        } else {
+            break;
+        }
+    }
+    if (first >= arg_size || args[first][0] == '-') {
+        fprintf(stderr, "usage: memo [-r] [-e VAR]... [-f FILE]... [-c FILE]... COMMAND...\n");
+        return 2;
+    }
+
+    int status_local = memo_run(&args[first], &inputs, refresh, out);
+    if (status_local == -1) {
+        return 127;
+    }
+    set_status(status_local);
+    return BUILTIN_STATUS_SET;
+}
+
+/**
+ * enable [-n] [-f LIB.so] [NAME...]: list the builtins, load builtins from a
+ * shared library, or turn builtins off (-n) and back on.
+ */
+static int enable_builtin(char **args, size_t arg_size, FILE *out)
+{
+    if (arg_size == 1) {
+        builtin_print(out);
+        return 0;
+    }
+    bool disable = false;
+    const char *library = NULL;
+    size_t first = 1;
+    for (; first < arg_size && args[first][0] == '-'; first++) {
+        if (strcmp(args[first], "-n") == 0) {
+            disable = true;
+        } else if (strcmp(args[first], "-f") == 0 && first + 1 < arg_size) {
+            library = args[++first];
+        } else {
+            first = arg_size;
+        }
+    }
+    if (first >= arg_size || (disable && library != NULL)) {
+        fprintf(stderr, "usage: enable [-n] [-f LIB.so] [NAME...]\n");
+        return 2;
+    }
+
+    int status = 0;
+    for (size_t i = first; i < arg_size; i++) {
+        if (library != NULL && builtin_load(library, args[i]) == -1) {
+            status = 1;
+        } else if (library == NULL && builtin_enable(args[i], !disable) == -1) {
+            fprintf(stderr, "enable: %s: not a builtin\n", args[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+//the shell's own builtins, registered on the first lookup
+const struct builtin shell_builtins[] = {
+    { "exit", exit_builtin, COMPLETE_NONE, 0 },
+    { "jobs", jobs_builtin, COMPLETE_NONE, 0 },
+    { "history", history_builtin, COMPLETE_NONE, BUILTIN_HISTORY },
+    { "cd", cd_builtin, COMPLETE_DIRS, 0 },
+    { "trace", trace_builtin, COMPLETE_FILES, 0 },
+    { "stats", stats_builtin, COMPLETE_NONE, 0 },
+    { "stress", stress_builtin, COMPLETE_NONE, 0 },
+    { "timeout", timeout_builtin, COMPLETE_COMMANDS, 0 },
+    { "wait", wait_builtin, COMPLETE_NONE, 0 },
+    { "sched", sched_builtin, COMPLETE_COMMANDS, BUILTIN_BACKGROUND },
+    { "jobclass", jobclass_builtin, COMPLETE_NONE, 0 },
+    { "enable", enable_builtin, COMPLETE_FILES, 0 },
+    { "pipesize", pipesize_builtin, COMPLETE_COMMANDS, 0 },
+    { "pipestat", pipestat_builtin, COMPLETE_COMMANDS, 0 },
+    { "memo", memo_builtin, COMPLETE_COMMANDS, 0 },
+};
+
+const size_t shell_builtin_count = sizeof(shell_builtins) / sizeof(shell_builtins[0]);
+
 //handle built-in functions (such as exit and cd) and remove comments
 int builtins(char **args, size_t arg_size, bool bang) 
 {
@@ -419,29 +1385,7 @@ int builtins(char **args, size_t arg_size, bool bang)
     }
     
     char *cmd = args[0];
-    if(strcmp(cmd, "exit") == 0){
-        return -1;
-    } else if(strcmp(cmd, "cd") == 0){
-        if(arg_size==1){
-            chdir(getenv("HOME"));
-        } else if(arg_size==2) {
-            if(strcmp(args[1], "..")==0){
-                chdir("..");
-            } else {
-                chdir(args[1]);
-            }
-        } else {
-            LOGP("Invalid CD command\n");
-        }
-        return 1;
-    } else if(strcmp(cmd, "history")==0){
-        if(!bang) {
-            hist_add("history");
-        }
-        hist_print();
-        fflush(stdout);
-        return 1;
-    } else if(cmd[0]=='!'){
+    if(cmd[0]=='!'){
         if(strlen(cmd)>2&&isdigit(cmd[1])){
             //get rid of that pesky !
             for(int i = 0; i<strlen(cmd); i++){
@@ -461,8 +1405,8 @@ int builtins(char **args, size_t arg_size, bool bang)
 
                 if(builtin!=0){
                     if(builtin==-1){
-                        hist_destroy();
-                        exit(0);
+                        free((char *) result);
+                        return -1;
                     } else if(builtin==1){
                         return 1;
                     }
@@ -488,10 +1432,8 @@ int builtins(char **args, size_t arg_size, bool bang)
 
                 if(builtin!=0){
                     if(builtin==-1){
-                        free_jobs();
-                        hist_destroy();
                         free((char *) result);
-                        exit(0);
+                        return -1;
                     } else if(builtin==1){
                         return 1;
                     }
@@ -514,7 +1456,8 @@ int builtins(char **args, size_t arg_size, bool bang)
 
                 if(builtin!=0){
                     if(builtin==-1){
-                        exit(0);
+                        free((char *) result);
+                        return -1;
                     } else if(builtin==1){
                         return 1;
                     }
@@ -528,21 +1471,35 @@ int builtins(char **args, size_t arg_size, bool bang)
             LOGP("error\n");
             return 0;
         }
-    } else if(strcmp(args[arg_size-1], "&")==0){
-        args[arg_size-1] = NULL;
-        
-        background_execute(args, arg_size-1);
+    }
 
-        return 1;
-    } else if (strcmp(cmd, "jobs")==0) {
-        for (int i = 0; i<job_size; i++) {
-            if (jobs[i].command!=NULL){
-                printf("%s\n", jobs[i].command);
+    struct builtin builtin;
+    bool background = strcmp(args[arg_size-1], "&")==0;
+    /* Fast path tools run from execute(), where they can fall back */
+    if (builtin_find(cmd, &builtin)==0 && !(builtin.flags & BUILTIN_FASTPATH)
+            && (!background || (builtin.flags & BUILTIN_BACKGROUND))) {
+        if ((builtin.flags & BUILTIN_HISTORY) && !bang) {
+            char *hist_buf = arena_alloc(get_size(arg_size, args)+1);
+            strcpy(hist_buf, args[0]);
+            for (size_t i = 1; i < arg_size; i++) {
+                strcat(hist_buf, " ");
+                strcat(hist_buf, args[i]);
             }
+            hist_add(hist_buf);
+        }
+        FILE *out = session_stdout();
+        int status = builtin.handler(args, arg_size, out);
+        fflush(out);
+        if (status == BUILTIN_EXIT) {
+            return -1;
+        } else if (status != BUILTIN_STATUS_SET) {
+            set_status((status & 0xff) << 8);
         }
         return 1;
+    } else if (background) {
+        args[arg_size-1] = NULL;
+        background_execute(args, arg_size-1, -1, NULL);
+        return 1;
     }
-    else {
-        return 0;
-    }
+    return 0;
 }
\ No newline at end of file
@@ -10,10 +10,21 @@
 #ifndef _SHELL_H_
 #define _SHELL_H_
 
-//struct containing info for a background process
-struct process {
-	char *command;
-	pid_t background_pid;
+#include "builtin.h"
+
+#define TIMEOUT_KILL_AFTER_MS 2000 //grace a timed out command gets before SIGKILL
+
+#define MAX_PIPELINE 400 //commands in one pipeline
+
+#define MAX_FANOUT 16 //consumers one |+ producer can feed
+
+#define MAX_SUBSTITUTIONS 16 //process substitutions in one command line
+
+//a <(cmd) or >(cmd): the command and the pipe the consumer sees as path
+struct substitution {
+    pid_t pid;
+    int fd;
+    char path[24];
 };
 
 //struct containing all info needed to execute a command
@@ -21,19 +32,30 @@ struct command_line {
     char **tokens;
     bool stdout_pipe;
     char *stdin_file;
+    const char *here_body; //heredoc or here-string fed to stdin, if any
+    size_t here_len;
+    bool here_newline; //a here-string gets a newline after its word
     bool append;
     char *stdout_file;
 };
 
-int background_execute(char **, size_t);
-void sigchld_handler(int);
-void sigint_handler(int);
-int construct_pipeline(char **, size_t);
-int execute_pipeline(struct command_line *);
+struct pipe_options;
+struct schedule;
+
+pid_t launch(char **, const struct schedule *);
+int background_execute(char **, size_t, int, const struct schedule *);
+int construct_pipeline(char **, size_t, char *);
+int execute_pipeline(struct command_line *, const struct pipe_options *);
 int seperate_args(char **, char *, size_t);
 char *next_token(char **, const char *);
+char *heredoc_delimiter(char *, char *, bool *);
 size_t get_size(size_t, char **);
 int execute(char **);
+int exec_status(int);
 int builtins(char **, size_t, bool);
 
+extern const struct builtin shell_builtins[];
+extern const size_t shell_builtin_count;
+int run_command(char *);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,165 @@
+/**
+ * @file
+ *
+ * trace
+ *
+ * lock-free event ring buffer and Chrome trace-event export
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define TRACE_CAPACITY 8192 //must be a power of two
+
+static const char *event_names[TRACE_EVENT_COUNT] = {
+    [TRACE_PARSE] = "parse",
+    [TRACE_FORK] = "fork",
+    [TRACE_EXEC] = "exec",
+    [TRACE_WAIT] = "wait",
+    [TRACE_PROMPT] = "prompt",
+    [TRACE_COMPLETION] = "completion",
+    [TRACE_SCAN] = "path scan",
+    [TRACE_SIGCHLD] = "sigchld",
+    [TRACE_SIGINT] = "sigint",
+    [TRACE_JOB_START] = "job start",
+};
+
+//the ring and its write position, shared with children until they exec
+struct trace_ring {
+    uint64_t head;
+    struct trace_record records[TRACE_CAPACITY];
+};
+
+static struct trace_ring *ring; //NULL until trace_init
+
+//map the ring buffer; events recorded before this are dropped
+void trace_init(void)
+{
+    if (ring != NULL) {
+        return;
+    }
+    void *map = mmap(NULL, sizeof(struct trace_ring), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (map != MAP_FAILED) {
+        ring = map;
+    }
+}
+
+/**
+ * Record an event. Only async-signal-safe calls are made and the slot is
+ * claimed with an atomic increment, so this may be called from any thread,
+ * a signal handler or a freshly forked child.
+ */
+void trace_emit(enum trace_event event, char phase, int64_t arg)
+{
+    if (ring == NULL) {
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    uint64_t position = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+    struct trace_record *record = &ring->records[position & (TRACE_CAPACITY - 1)];
+    __atomic_store_n(&record->seq, 0, __ATOMIC_RELAXED);
+    record->ts_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+    record->pid = getpid();
+    record->tid = gettid();
+    record->event = event;
+    record->phase = phase;
+    record->arg = arg;
+    __atomic_store_n(&record->seq, position + 1, __ATOMIC_RELEASE);
+}
+
+//forget everything recorded so far
+void trace_clear(void)
+{
+    if (ring == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < TRACE_CAPACITY; i++) {
+        __atomic_store_n(&ring->records[i].seq, 0, __ATOMIC_RELAXED);
+    }
+}
+
+//write the buffered events, oldest first, as Chrome trace-event JSON
+int trace_dump(FILE *out)
+{
+    if (ring == NULL) {
+        return -1;
+    }
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t first = head > TRACE_CAPACITY ? head - TRACE_CAPACITY : 0;
+
+    fputs("{\"traceEvents\":[", out);
+    int written = 0;
+    for (uint64_t position = first; position < head; position++) {
+        struct trace_record *slot = &ring->records[position & (TRACE_CAPACITY - 1)];
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        struct trace_record record = *slot;
+        /* Skip slots that were overwritten or are still being filled in */
+        if (seq != position + 1
+                || __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq
+                || record.event >= TRACE_EVENT_COUNT) {
+            continue;
+        }
+        fprintf(out, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,"
+                "\"pid\":%d,\"tid\":%d",
+                written++ ? "," : "",
+                event_names[record.event], record.phase,
+                record.ts_ns / 1000.0, record.pid, record.tid);
+        if (record.phase == 'i') {
+            fprintf(out, ",\"s\":\"t\",\"args\":{\"arg\":%lld}",
+                    (long long) record.arg);
+        }
+        fputs("}", out);
+    }
+    fputs("\n]}\n", out);
+    return written;
+}
+
+//where the next event will be recorded, for trace_phase_totals
+uint64_t trace_position(void)
+{
+    return ring != NULL ? __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) : 0;
+}
+
+/**
+ * Add up how long this thread spent in each kind of event since position,
+ * pairing every begin with the next end of the same event. totals must have
+ * room for TRACE_EVENT_COUNT entries and is filled in nanoseconds.
+ */
+void trace_phase_totals(uint64_t since, int64_t *totals)
+{
+    uint64_t begun[TRACE_EVENT_COUNT] = { 0 };
+    for (int i = 0; i < TRACE_EVENT_COUNT; i++) {
+        totals[i] = 0;
+    }
+    if (ring == NULL) {
+        return;
+    }
+
+    uint64_t head = trace_position();
+    if (head - since > TRACE_CAPACITY) {
+        since = head - TRACE_CAPACITY;
+    }
+    int32_t tid = gettid();
+    for (uint64_t position = since; position < head; position++) {
+        struct trace_record *record = &ring->records[position & (TRACE_CAPACITY - 1)];
+        if (__atomic_load_n(&record->seq, __ATOMIC_ACQUIRE) != position + 1
+                || record->tid != tid || record->event >= TRACE_EVENT_COUNT) {
+            continue;
+        }
+        if (record->phase == 'B') {
+            begun[record->event] = record->ts_ns;
+        } else if (record->phase == 'E' && begun[record->event] != 0) {
+            totals[record->event] += record->ts_ns - begun[record->event];
+            begun[record->event] = 0;
+        }
+    }
+}
@@ -0,0 +1,55 @@
+/**
+ * @file
+ *
+ * TRACING
+ * Records timestamped binary events into a lock-free ring buffer. Recording
+ * an event is a clock read and an atomic increment, so it is cheap enough to
+ * leave on everywhere (including signal handlers). The buffer is shared with
+ * forked children until they exec, so their side of a spawn shows up too.
+ * `trace dump` exports the buffer as Chrome trace-event JSON.
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+//the things worth timing
+enum trace_event {
+    TRACE_PARSE,
+    TRACE_FORK,
+    TRACE_EXEC,
+    TRACE_WAIT,
+    TRACE_PROMPT,
+    TRACE_COMPLETION,
+    TRACE_SCAN,
+    TRACE_SIGCHLD,
+    TRACE_SIGINT,
+    TRACE_JOB_START,
+    TRACE_EVENT_COUNT
+};
+
+//one recorded event
+struct trace_record {
+    uint64_t seq; //ring position + 1 once the record is complete
+    uint64_t ts_ns;
+    int32_t pid;
+    int32_t tid;
+    uint32_t event;
+    char phase; //'B'egin, 'E'nd or 'i'nstant, as in the trace-event format
+    int64_t arg;
+};
+
+void trace_init(void);
+void trace_emit(enum trace_event, char, int64_t);
+void trace_clear(void);
+int trace_dump(FILE *);
+uint64_t trace_position(void);
+void trace_phase_totals(uint64_t, int64_t *);
+
+#define TRACE_BEGIN(event) trace_emit((event), 'B', 0)
+#define TRACE_END(event) trace_emit((event), 'E', 0)
+#define TRACE_INSTANT(event, arg) trace_emit((event), 'i', (arg))
+
+#endif
@@ -4,6 +4,7 @@
  * user interface
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <readline/readline.h>
 #include <locale.h>
@@ -12,21 +13,34 @@
 #include <dirent.h>
 #include <sys/stat.h>
 #include <stddef.h>
-
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <pwd.h>
+#include <wchar.h>
+
+#include "arena.h"
+#include "builtin.h"
+#include "fuzzy.h"
 #include "history.h"
 #include "logger.h"
+#include "loop.h"
+#include "metrics.h"
+#include "pathindex.h"
+#include "session.h"
 #include "ui.h"
 #include "shell.h"
+#include "trace.h"
 
 static const char *good_str = "🤠";
 static const char *bad_str  = "🤮";
 
 static unsigned int current_num;
 
-static int glob_status = 0;
-
 static bool scripting = false;
 
+static FILE *script_file; //where scripting mode reads lines, stdin if NULL
+
 static int readline_init(void);
 
 static char *previous_hist = "";
@@ -49,7 +63,14 @@ static char **tab_completions;
 
 static int tab_max;
 
-static char *built_list[4] = {"exit", "jobs", "history", "cd"};
+
+static bool fuzzy_completion = true; //rank completions with the fuzzy matcher
+
+#define MAX_COMPLETIONS 256 //the most ranked completions offered at once
+
+static const char *suggestion; //the greyed out rest of the line, if any
+
+static bool suggestion_shown; //true while grey text is on the screen
 
 
 // initialize the user interface
@@ -68,6 +89,14 @@ void init_ui(void)
 
     hist_init(100);
 
+    char *matcher = getenv("SWISH_COMPLETION");
+    if (matcher != NULL && strcmp(matcher, "prefix") == 0) {
+        fuzzy_completion = false;
+    }
+
+    /* Scan the PATH for tab completion while the user types */
+    pathindex_start();
+
     tab_loc = 0;
     arrowing = false;
     do_prefix = false;
@@ -78,8 +107,20 @@ void init_ui(void)
     rl_startup_hook = readline_init;
 }
 
+/**
+ * Read commands from a script (or a -c string opened as one) instead of a
+ * terminal. Unlike init_ui() this sets up no locale, history, completion or
+ * readline, none of which a script uses, so swish starts about as fast as a
+ * shell can.
+ */
+void init_script(FILE *file)
+{
+    scripting = true;
+    script_file = file;
+}
+
 void set_status(int input_status){
-    glob_status = input_status;
+    session_current()->status = input_status;
 }
 
 void set_arrowing(void)
@@ -99,6 +140,7 @@ void destroy_ui(void)
 //display the location and status of the shell
 char *prompt_line(void)
 {
+    TRACE_BEGIN(TRACE_PROMPT);
     const char *status = prompt_status() ? bad_str : good_str;
 
     char cmd_num[25];
@@ -119,7 +161,7 @@ char *prompt_line(void)
         + strlen(cwd)
         + 1;
 
-    char *prompt_str =  malloc(sizeof(char) * prompt_sz);
+    char *prompt_str = arena_alloc(sizeof(char) * prompt_sz);
 
     snprintf(prompt_str, prompt_sz, format_str,
             status,
@@ -128,17 +170,24 @@ char *prompt_line(void)
             host,
             cwd);
 
+    TRACE_END(TRACE_PROMPT);
     return prompt_str;
 }
 
 char *prompt_username(void)
 {
-    return getlogin();
+    char *user = getlogin();
+    if (user == NULL) {
+        /* No login session (cron, containers, ssh without a tty) */
+        struct passwd *pw = getpwuid(getuid());
+        user = (pw != NULL) ? pw->pw_name : "?";
+    }
+    return user;
 }
 
 char *prompt_hostname(void)
 {
-    char *buf = malloc(253*sizeof(char));
+    char *buf = arena_alloc(253*sizeof(char));
     if(gethostname(buf, 253*sizeof(char))!=-1){
         return buf;
     } else {
@@ -150,7 +199,12 @@ char *prompt_hostname(void)
 //get the current working directory
 char *prompt_cwd(void)
 {
-    char *cwd = getcwd(NULL, 0);
+    char *real_cwd = getcwd(NULL, 0);
+    if(real_cwd == NULL) {
+        return "?";
+    }
+    char *cwd = arena_strdup(real_cwd);
+    free(real_cwd);
     char *home = getenv("HOME");
     char *temp;
 
@@ -173,7 +227,7 @@ char *prompt_cwd(void)
 
 int prompt_status(void)
 {
-    return glob_status;
+    return session_current()->status;
 }
 
 unsigned int prompt_cmd_num(void)
@@ -181,27 +235,94 @@ unsigned int prompt_cmd_num(void)
     return hist_last_cnum();
 }
 
-//read the inputed command
-char *read_command(void)
+//read one line, from the script or at the given prompt
+static char *read_line(const char *prompt)
 {
     if(scripting == true) {
         char *line = NULL;
         size_t line_sz = 0;
-        ssize_t read_sz = getline(&line, &line_sz, stdin);
-        line[read_sz - 1] = '\0';
+        ssize_t read_sz = getline(&line, &line_sz,
+                script_file != NULL ? script_file : stdin);
         if(read_sz == -1) {
             free(line);
             return NULL;
         }
+        if(read_sz > 0 && line[read_sz - 1] == '\n') {
+            line[read_sz - 1] = '\0';
+        }
         return line;
     } else {
-        char *command;
-        char *prompt = prompt_line();
-        command = readline(prompt); //this prints the prompt
-        free(prompt);
-        return command;
+        return loop_readline(prompt); //this prints the prompt
     }
-    
+}
+
+/**
+ * Read the bodies of any heredocs command opens, appending each line to the
+ * command after a newline, delimiters included, for run_command to take
+ * apart again.
+ */
+static char *read_heredocs(char *command)
+{
+    char *copy = strdup(command);
+    char *next_tok = copy;
+    char *curr_tok;
+    while((curr_tok = next_token(&next_tok, " \t\r\n")) != NULL) {
+        if(strncmp(curr_tok, "<<", 2) != 0 || curr_tok[2] == '<') {
+            continue;
+        }
+        bool alone = strcmp(curr_tok, "<<") == 0 || strcmp(curr_tok, "<<-") == 0;
+        bool strip_tabs;
+        char *delim = heredoc_delimiter(curr_tok,
+                alone ? next_token(&next_tok, " \t\r\n") : NULL, &strip_tabs);
+        if(delim == NULL) {
+            continue;
+        }
+
+        size_t length = strlen(command);
+        char *line;
+        while((line = read_line(HEREDOC_PROMPT)) != NULL) {
+            size_t line_len = strlen(line);
+            char *longer = realloc(command, length + line_len + 2);
+            if(longer == NULL) {
+                free(line);
+                break;
+            }
+            command = longer;
+            command[length++] = '\n';
+            memcpy(command + length, line, line_len + 1);
+            length += line_len;
+
+            char *text = line;
+            while(strip_tabs && *text == '\t') {
+                text++;
+            }
+            bool done = strcmp(text, delim) == 0;
+            free(line);
+            if(done) {
+                break;
+            }
+        }
+    }
+    free(copy);
+    return command;
+}
+
+//read the inputed command
+char *read_command(void)
+{
+    char *command;
+    if(scripting == true) {
+        command = read_line(NULL);
+    } else {
+        /* The arrow key state points into the last command's arena */
+        previous_hist = "";
+        current_psearch = "";
+        command = read_line(prompt_line());
+    }
+    if(command != NULL && strstr(command, "<<") != NULL) {
+        command = read_heredocs(command);
+    }
+    return command;
 }
 
 int readline_init(void)
@@ -209,11 +330,127 @@ int readline_init(void)
     rl_bind_keyseq("\\e[A", key_up);
     rl_bind_keyseq("\\e[B", key_down);
     rl_variable_bind("show-all-if-ambiguous", "on");
-    rl_variable_bind("colored-completion-prefix", "on");
+    if (!fuzzy_completion) {
+        /* Fuzzy matches don't share the typed prefix, so only color it here */
+        rl_variable_bind("colored-completion-prefix", "on");
+    }
+    rl_bind_keyseq("\\e[C", key_right);
+    rl_bind_keyseq("\\eOC", key_right);
+    rl_bind_key('\r', key_accept);
+    rl_bind_key('\n', key_accept);
+    rl_redisplay_function = suggest_redisplay;
     rl_attempted_completion_function = command_completion;
     return 0;
 }
 
+/**
+ * Terminal columns taken by the first len bytes of text, leaving out the
+ * \001...\002 spans readline uses to hide escape sequences in the prompt.
+ * With limit >= 0 it stops before passing limit columns, and fit gets the
+ * bytes that were counted, so text can be cut there without splitting a
+ * character. A byte that isn't valid in the locale counts as one column.
+ */
+static int text_width(const char *text, size_t len, int limit, size_t *fit)
+{
+    mbstate_t state;
+    memset(&state, 0, sizeof(state));
+    bool hidden = false;
+    int width = 0;
+    size_t i = 0;
+    while (i < len && text[i] != '\0') {
+        if (text[i] == RL_PROMPT_START_IGNORE || text[i] == RL_PROMPT_END_IGNORE) {
+            hidden = text[i++] == RL_PROMPT_START_IGNORE;
+            continue;
+        }
+        wchar_t wide;
+        size_t bytes = mbrtowc(&wide, text + i, len - i, &state);
+        int columns = 1;
+        if (bytes == (size_t) -1 || bytes == (size_t) -2) {
+            memset(&state, 0, sizeof(state));
+            bytes = 1;
+        } else if ((columns = wcwidth(wide)) < 0) {
+            columns = 0;
+        }
+        columns = hidden ? 0 : columns;
+        if (limit >= 0 && width + columns > limit) {
+            break;
+        }
+        width += columns;
+        i += bytes;
+    }
+    if (fit != NULL) {
+        *fit = i;
+    }
+    return width;
+}
+
+/**
+ * Draw the line as usual, then show the rest of the most recent history entry
+ * that starts with it in grey after the cursor. The cursor position is saved
+ * and restored around the suggestion so it never has to be measured.
+ */
+void suggest_redisplay(void)
+{
+    rl_redisplay();
+
+    const char *match = NULL;
+    if (rl_point == rl_end && rl_end > 0) {
+        match = hist_suggest(rl_line_buffer);
+    }
+    if (match == NULL && !suggestion_shown) {
+        suggestion = NULL;
+        return;
+    }
+
+    fputs("\033[J", rl_outstream);
+    suggestion = NULL;
+    suggestion_shown = false;
+    if (match != NULL) {
+        suggestion = match + rl_end;
+
+        /* Keep to the current row: a wrap at the bottom would scroll */
+        int rows, cols;
+        rl_get_screen_size(&rows, &cols);
+        cols = cols > 0 ? cols : 80;
+        const char *prompt = strrchr(rl_prompt, '\n');
+        prompt = prompt != NULL ? prompt + 1 : rl_prompt;
+        int used = (text_width(prompt, strlen(prompt), -1, NULL)
+                + text_width(rl_line_buffer, rl_end, -1, NULL)) % cols;
+        size_t fit = 0;
+        if (cols - used - 1 > 0) {
+            text_width(suggestion, strlen(suggestion), cols - used - 1, &fit);
+        }
+        if (fit > 0) {
+            fprintf(rl_outstream, "\0337\033[90m%.*s\033[0m\0338", (int) fit, suggestion);
+            suggestion_shown = true;
+        }
+    }
+    fflush(rl_outstream);
+}
+
+//accept the suggestion with the right arrow when the cursor is at the end
+int key_right(int count, int key)
+{
+    if (suggestion != NULL && rl_point == rl_end) {
+        rl_insert_text(suggestion);
+        rl_point = rl_end;
+        return 0;
+    }
+    return rl_forward_char(count, key);
+}
+
+//clear the suggestion before the line is accepted so it isn't left behind
+int key_accept(int count, int key)
+{
+    if (suggestion_shown) {
+        fputs("\033[J", rl_outstream);
+        fflush(rl_outstream);
+        suggestion_shown = false;
+    }
+    suggestion = NULL;
+    return rl_newline(count, key);
+}
+
 //navigate up with keyboard
 int key_up(int count, int key)
 {
@@ -222,6 +459,7 @@ int key_up(int count, int key)
     }
     bool firsttimer = false;
     const char *new_line = "";
+    char *found = NULL; //history's copy of new_line, if it came from there
     if(strcmp(rl_line_buffer, "")==0) {
         do_prefix = false;
     }
@@ -244,16 +482,16 @@ int key_up(int count, int key)
                 if(current_num!=0){
                     current_num--;
                     LOG("Decrease to index: %u\n", current_num);
-                    new_line = hist_search_cnum(index_to_cnum(current_num));
+                    new_line = found = (char *) hist_search_cnum(index_to_cnum(current_num));
                 } else {
-                    new_line = hist_search_cnum(index_to_cnum(0));
+                    new_line = found = (char *) hist_search_cnum(index_to_cnum(0));
                 }
             } else {
                 arrowing = false;
                 do_prefix = true;
                 LOGP("Reset Num\n");
                 current_num = hist_size();
-                current_psearch = strdup(rl_line_buffer);
+                current_psearch = arena_strdup(rl_line_buffer);
                 firsttimer = true;
                 up = true;
                 goto prefixup;
@@ -264,7 +502,7 @@ int key_up(int count, int key)
             struct index_navigator nav = hist_search_prefix_index(current_psearch, current_num, true);
             if(nav.index!=-1) {
                 current_num = nav.index;
-                new_line = nav.result;
+                new_line = found = (char *) nav.result;
                 LOG("prefix_index now: %u, %s\n", current_num, new_line);
             } else {
                 if(firsttimer) {
@@ -275,9 +513,10 @@ int key_up(int count, int key)
             }
         }
     }
-    previous_hist = (char *) strdup(new_line);
+    previous_hist = arena_strdup(new_line);
     /* Modify the command entry text: */
     rl_replace_line(new_line, 1);
+    free(found);
 
     /* Move the cursor to the end of the line: */
     rl_point = rl_end;
@@ -293,6 +532,7 @@ int key_down(int count, int key)
     }
     bool firsttimer = false;
     const char *new_line = "";
+    char *found = NULL; //history's copy of new_line, if it came from there
     if(strcmp(rl_line_buffer, "")==0) {
         do_prefix = false;
     }
@@ -315,7 +555,7 @@ int key_down(int count, int key)
                 if(current_num!=hist_size()-1){
                     current_num++;
                     LOG("Increase to index: %u\n", current_num);
-                    new_line = hist_search_cnum(index_to_cnum(current_num));
+                    new_line = found = (char *) hist_search_cnum(index_to_cnum(current_num));
                 } else {
                     new_line = "";
                 }
@@ -324,7 +564,7 @@ int key_down(int count, int key)
                 do_prefix = true;
                 LOGP("Reset Num\n");
                 current_num = hist_size();
-                current_psearch = strdup(rl_line_buffer);
+                current_psearch = arena_strdup(rl_line_buffer);
                 firsttimer = true;
                 down = true;
                 goto prefixup;
@@ -335,7 +575,7 @@ int key_down(int count, int key)
             struct index_navigator nav = hist_search_prefix_index(current_psearch, current_num, false);
             if(nav.index!=-1) {
                 current_num = nav.index;
-                new_line = nav.result;
+                new_line = found = (char *) nav.result;
                 LOG("prefix_index now: %u, %s\n", current_num, new_line);
             } else {
                 if(firsttimer) {
@@ -346,9 +586,10 @@ int key_down(int count, int key)
             }
         }
     } 
-    previous_hist = (char *) strdup(new_line);
+    previous_hist = arena_strdup(new_line);
     /* Modify the command entry text: */
     rl_replace_line(new_line, 1);
+    free(found);
 
     /* Move the cursor to the end of the line: */
     rl_point = rl_end;
@@ -356,13 +597,277 @@ int key_down(int count, int key)
     return 0;
 }
 
+//add a completion candidate, keeping the list NULL terminated
+static void add_completion(const char *name)
+{
+    if (tab_loc+1>=tab_max) {
+        tab_max*=2;
+        char **tab_completions_temp = realloc(tab_completions, sizeof(char *)*tab_max);
+        if(tab_completions_temp==NULL){
+            free(tab_completions);
+            exit(0);
+        } else {
+            tab_completions = tab_completions_temp;
+        }
+    }
+    tab_completions[tab_loc++] = strdup(name);
+    tab_completions[tab_loc] = NULL;
+}
+
+//scan every PATH directory for executables starting with text
+static void scan_path(const char *text)
+{
+    char *path = strdup(getenv("PATH"));
+    char *next_tok = path;
+    char *curr_tok;
+    while((curr_tok = next_token(&next_tok, ":")) != NULL) {
+        DIR *directory_stream = opendir(curr_tok);
+        if (directory_stream == NULL) {
+            continue;
+        }
+
+        struct dirent* entry = NULL;
+        while ((entry = readdir(directory_stream)) != NULL) {
+            if(entry->d_name[0]!='.'&&strncmp(entry->d_name, text, strlen(text))==0) {
+                struct stat stats;
+                if(fstatat(dirfd(directory_stream), entry->d_name, &stats, 0)==-1) {
+                    perror("stat");
+                } else if(is_executable(&stats)){
+                    add_completion(entry->d_name);
+                }
+            }
+        }
+        closedir(directory_stream);
+    }
+    free(path);
+}
+
+//turn ranked results into the NULL terminated list readline expects
+static char **build_matches(const char *text, char **results, size_t count)
+{
+    if (count == 0) {
+        return NULL;
+    }
+
+    /* readline frees the list and its strings, so they come from the heap */
+    char **matches = malloc(sizeof(char *) * (count + 2));
+    ALLOC_FORGET(matches);
+    for (size_t i = 0; i < count; i++) {
+        matches[i + 1] = strdup(results[i]);
+        ALLOC_FORGET(matches[i + 1]);
+    }
+    matches[count + 1] = NULL;
+
+    if (count == 1) {
+        matches[0] = matches[1];
+        matches[1] = NULL;
+        return matches;
+    }
+
+    /* Only replace what was typed if every match extends it */
+    size_t common = strlen(matches[1]);
+    for (size_t i = 2; i <= count; i++) {
+        size_t j = 0;
+        while (j < common && matches[i][j] == matches[1][j]) {
+            j++;
+        }
+        common = j;
+    }
+    if (common >= strlen(text) && strncmp(matches[1], text, strlen(text)) == 0) {
+        matches[0] = strndup(matches[1], common);
+    } else {
+        matches[0] = strdup(text);
+    }
+    ALLOC_FORGET(matches[0]);
+    return matches;
+}
+
+//favor the commands the user actually runs
+static int usage_boost(const char *name)
+{
+    unsigned int count = hist_usage_count(name);
+    return count == 0 ? 0 : (int) (12 * log2(1 + count));
+}
+
+//rank the executables on the PATH and the builtins against text
+static char **complete_command(const char *text)
+{
+    const struct path_index *index = pathindex_get();
+    size_t index_count = 0;
+    if (index != NULL) {
+        index_count = index->count;
+    } else {
+        //the background index isn't ready yet
+        free(tab_completions);
+        tab_completions = calloc(10, sizeof(char *));
+        tab_max = 10;
+        tab_loc = 0;
+        scan_path("");
+    }
+
+    size_t builtin_total = builtin_count();
+    size_t count = (index != NULL ? index_count : (size_t) tab_loc) + builtin_total;
+    const char **candidates = arena_alloc(sizeof(char *) * count);
+    uint64_t *masks = arena_alloc(sizeof(uint64_t) * count);
+    size_t n = 0;
+    if (index != NULL) {
+        memcpy(candidates, index->names, sizeof(char *) * index_count);
+        memcpy(masks, index->masks, sizeof(uint64_t) * index_count);
+        n = index_count;
+    } else {
+        for (int i = 0; i < tab_loc; i++) {
+            candidates[n] = tab_completions[i];
+            masks[n++] = fuzzy_mask(tab_completions[i]);
+        }
+    }
+    struct builtin builtin;
+    for (size_t i = 0; i < builtin_total && builtin_at(i, &builtin) == 0; i++) {
+        if (!(builtin.flags & BUILTIN_DISABLED)) {
+            candidates[n] = builtin.name;
+            masks[n++] = fuzzy_mask(builtin.name);
+        }
+    }
+
+    struct fuzzy_match top[MAX_COMPLETIONS];
+    size_t found = fuzzy_rank(text, candidates, masks, n, usage_boost,
+            top, MAX_COMPLETIONS);
+    char **results = arena_alloc(sizeof(char *) * (found + 1));
+    for (size_t i = 0; i < found; i++) {
+        results[i] = (char *) top[i].candidate;
+    }
+    char **matches = build_matches(text, results, found);
+
+    if (index == NULL) {
+        for (int i = 0; i < tab_loc; i++) {
+            free(tab_completions[i]);
+        }
+        free(tab_completions);
+        tab_completions = NULL;
+        tab_max = 0;
+        tab_loc = 0;
+    }
+    return matches;
+}
+
+/**
+ * Complete an argument: arguments previously given to this command come first,
+ * then the entries of the directory named in text, both ranked against what
+ * has been typed so far.
+ */
+static char **complete_argument(const char *text)
+{
+    char **results = arena_alloc(sizeof(char *) * (2 * MAX_COMPLETIONS));
+    size_t found = 0;
+    struct fuzzy_match top[MAX_COMPLETIONS];
+
+    size_t cmd_len = strcspn(rl_line_buffer + strspn(rl_line_buffer, " \t"), " \t");
+    char *cmd = arena_strndup(rl_line_buffer + strspn(rl_line_buffer, " \t"), cmd_len);
+
+    /* A builtin says what its arguments are */
+    struct builtin builtin;
+    enum builtin_complete complete = COMPLETE_FILES;
+    if (builtin_find(cmd, &builtin) == 0) {
+        complete = builtin.complete;
+    }
+    if (complete == COMPLETE_NONE) {
+        rl_attempted_completion_over = 1;
+        return NULL;
+    } else if (complete == COMPLETE_COMMANDS && strchr(text, '/') == NULL) {
+        return complete_command(text);
+    }
+
+    const char *used[MAX_COMPLETIONS];
+    size_t used_count = hist_used_args(cmd, used, MAX_COMPLETIONS);
+    size_t ranked = fuzzy_rank(text, used, NULL, used_count, NULL, top, MAX_COMPLETIONS);
+    for (size_t i = 0; i < ranked; i++) {
+        results[found++] = arena_strdup(top[i].candidate);
+    }
+
+    const char *slash = strrchr(text, '/');
+    const char *pattern = (slash != NULL) ? slash + 1 : text;
+    char *dir = arena_strndup(text, pattern - text);
+
+    DIR *directory_stream = opendir(dir[0] != '\0' ? dir : ".");
+    if (directory_stream == NULL) {
+        return build_matches(text, results, found);
+    }
+
+    size_t max = 64;
+    size_t n = 0;
+    char **names = arena_alloc(sizeof(char *) * max);
+    struct dirent *entry;
+    while ((entry = readdir(directory_stream)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        if (entry->d_name[0] == '.' && pattern[0] != '.') {
+            continue;
+        }
+        struct stat stats;
+        if (complete == COMPLETE_DIRS && entry->d_type != DT_DIR
+                && ((entry->d_type != DT_LNK && entry->d_type != DT_UNKNOWN)
+                    || fstatat(dirfd(directory_stream), entry->d_name, &stats, 0) == -1
+                    || !S_ISDIR(stats.st_mode))) {
+            continue;
+        }
+        if (n == max) {
+            max *= 2;
+            char **temp_names = arena_alloc(sizeof(char *) * max);
+            if (temp_names == NULL) {
+                break;
+            }
+            memcpy(temp_names, names, sizeof(char *) * n);
+            names = temp_names;
+        }
+        names[n++] = arena_strdup(entry->d_name);
+    }
+    closedir(directory_stream);
+
+    ranked = fuzzy_rank(pattern, (const char **) names, NULL, n, NULL,
+            top, MAX_COMPLETIONS);
+    size_t from_history = found;
+    for (size_t i = 0; i < ranked; i++) {
+        char *path = arena_alloc(strlen(dir) + strlen(top[i].candidate) + 1);
+        strcpy(path, dir);
+        strcat(path, top[i].candidate);
+
+        bool duplicate = false;
+        for (size_t j = 0; j < from_history && !duplicate; j++) {
+            duplicate = strcmp(results[j], path) == 0;
+        }
+        if (!duplicate) {
+            results[found++] = path;
+        }
+    }
+
+    /* Let readline mark directories and quote names for us */
+    rl_filename_completion_desired = 1;
+
+    return build_matches(text, results, found);
+}
+
 char **command_completion(const char *text, int start, int end)
 {
     /* Tell readline that if we don't find a suitable completion, it should fall
      * back on its built-in filename completion. */
     rl_attempted_completion_over = 0;
 
-    return rl_completion_matches(text, command_generator);
+    char **matches;
+    METRIC_INC(METRIC_COMPLETION_SCANS);
+    TRACE_BEGIN(TRACE_COMPLETION);
+    if (!fuzzy_completion) {
+        matches = rl_completion_matches(text, command_generator);
+    } else {
+        /* Ranked results come back best first; don't let readline re-sort them */
+        rl_sort_completion_matches = 0;
+        if (start == 0) {
+            matches = complete_command(text);
+        } else {
+            matches = complete_argument(text);
+        }
+    }
+    TRACE_END(TRACE_COMPLETION);
+    return matches;
 }
 
 /**
@@ -372,8 +877,7 @@ char **command_completion(const char *text, int start, int end)
  */
 char *command_generator(const char *text, int state)
 {
-    LOG("STATE: %d\n", state);
-
+    struct builtin builtin;
     if (state==0){
         free(tab_completions);
         tab_completions = calloc(10, sizeof(char *));
@@ -381,95 +885,24 @@ char *command_generator(const char *text, int state)
         tab_loc = 0;
         built_loc = 0;
 
-        char *path = strdup(getenv("PATH")); //strdup
-
-        LOG("text: %s\n", text);
-
-        char **args = calloc(10, sizeof(char *));
-        int arg_max = 10;
-        int arg_size = 0;
-        int tokens = 0;
-        char *next_tok = path;
-        char *curr_tok;
-        while((curr_tok = next_token(&next_tok, ":")) != NULL) {
-            arg_size++;
-            if(!(arg_size<arg_max)) {
-                arg_max*=2;
-                char **temp_args = realloc(args, sizeof(char *)*arg_max);
-                if(temp_args==NULL){
-                    free(args);
-                    exit(0);
-                } else {
-                    args = temp_args;
-                }
-            }
-            args[tokens++] = strdup(curr_tok);
-        }
-        args[tokens] = NULL;
-
-        for (int i = 0; i<arg_size; i++) {
-
-            char *loc_path = args[i];
-            LOG("path: %s\n", args[i]);
-            DIR *directory_stream = opendir(strdup(args[i]));
-
-            if (directory_stream == NULL) {
-                if(i==arg_size-1){
-                    goto builtins;
-                } else {
-                    continue;
-                }
-            }
-
-            struct dirent* entry = NULL;
-
-            while ((entry = readdir(directory_stream)) != NULL) {
-
-                if(entry->d_name[0]!='.') {
-                    struct stat stats;
-                    char *combined_path = malloc(sizeof(char) * (strlen(loc_path) + strlen(entry->d_name) + 1));
-                    strcpy(combined_path, loc_path);
-                    strcat(combined_path, "/");
-                    strcat(combined_path, entry->d_name);
-                    if(stat(combined_path, &stats)==-1) {
-                        free(combined_path);
-                        perror("stat");
-                    } else {
-                        free(combined_path);
-                        if(stats.st_mode==33261){
-                            if(strncmp(entry->d_name, text, strlen(text))==0){
-                                if (tab_loc<tab_max) {
-                                    LOG("Addding: %s\n", entry->d_name);
-                                    tab_completions[tab_loc] = strdup(entry->d_name);
-                                    tab_loc++;
-                                } else {
-                                    tab_max*=2;
-                                    char **tab_completions_temp = realloc(tab_completions, sizeof(char *)*tab_max);
-                                    if(tab_completions_temp==NULL){
-                                        free(tab_completions);
-                                        free(path);
-                                        exit(0);
-                                    } else {
-                                        tab_completions = tab_completions_temp;
-                                    }
-                                    LOG("Addding: %s\n", entry->d_name);
-                                    tab_completions[tab_loc] = strdup(entry->d_name);
-                                }
-                            }
-                        }
-                    }
-                }
+        const struct path_index *index = pathindex_get();
+        if (index != NULL) {
+            size_t count;
+            size_t first = pathindex_prefix_range(index, text, &count);
+            for (size_t i = first; i < first + count; i++) {
+                add_completion(index->names[i]);
             }
+        } else {
+            //the background index isn't ready yet
+            scan_path(text);
         }
 
-
         tab_loc = 0;
         built_loc = 0;
         if (tab_completions[tab_loc]==NULL){
-            free(path);
             goto builtins;
         }
-        free(path);
+        ALLOC_FORGET(tab_completions[tab_loc]); //readline frees what we return
         return tab_completions[tab_loc];
 
         
@@ -477,7 +910,7 @@ char *command_generator(const char *text, int state)
         if (tab_loc+1<tab_max) {
             tab_loc++;
             if (tab_completions[tab_loc]!=NULL){
-                LOG("Returning: %s\n", tab_completions[tab_loc]);
+                ALLOC_FORGET(tab_completions[tab_loc]);
                 return tab_completions[tab_loc];
             } else {
                 goto builtins;
@@ -488,18 +921,16 @@ char *command_generator(const char *text, int state)
     }
 
 builtins:
-    for(int i = built_loc; i<4; i++){
-        if(text[0]=='\0'){
-            built_loc++;
-            return built_list[i];
-        } else {
-            if(strlen(built_list[i])>strlen(text)&&strncmp(text, built_list[i], strlen(text))==0){
-                LOG("Returning: %s\n", built_list[i]);
-                built_loc++;
-                return built_list[i];
-            }
-        }
+    while(builtin_at(built_loc, &builtin)==0){
         built_loc++;
+        if(builtin.flags & BUILTIN_DISABLED){
+            continue;
+        }
+        if(text[0]=='\0'||(strlen(builtin.name)>strlen(text)&&strncmp(text, builtin.name, strlen(text))==0)){
+            char *match = strdup(builtin.name);
+            ALLOC_FORGET(match);
+            return match;
+        }
     }
 
     return NULL;
@@ -9,7 +9,12 @@
 #ifndef _UI_H_
 #define _UI_H_
 
+#include <stdio.h>
+
+#define HEREDOC_PROMPT "> " //prompt for the lines of a heredoc
+
 void init_ui(void);
+void init_script(FILE *);
 
 void set_status(int);
 void set_arrowing(void);
@@ -25,6 +30,10 @@ char *read_command(void);
 
 int key_up(int count, int key);
 int key_down(int count, int key);
+int key_right(int count, int key);
+int key_accept(int count, int key);
+
+void suggest_redisplay(void);
 
 char **command_completion(const char *text, int start, int end);
 char *command_generator(const char *text, int state);
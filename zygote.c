@@ -0,0 +1,301 @@
+/**
+ * @file
+ *
+ * zygote
+ *
+ * fork server that launches commands from a small address space
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "logger.h"
+#include "metrics.h"
+#include "session.h"
+#include "shell.h"
+#include "trace.h"
+#include "zygote.h"
+
+#define ZYGOTE_FDS 4 //cwd, stdin, stdout, stderr, in that order
+
+extern char **environ;
+
+//what comes before the NUL separated argv and environment strings
+struct zygote_request {
+    uint32_t argc;
+    uint32_t envc;
+};
+
+struct zygote_reply {
+    int32_t pid; //-1 if the clone failed
+    int32_t error;
+};
+
+static int zygote_fd = -1; //the shell's end of the socket, -1 without a helper
+
+//the helper's request buffer, and the shell's while it builds a request
+static char request_buf[ZYGOTE_MAX_REQUEST];
+
+//send a message, with fd_count descriptors attached
+static ssize_t send_fds(int sock, const void *data, size_t len, const int *fds, size_t fd_count)
+{
+    struct iovec iov = { .iov_base = (void *) data, .iov_len = len };
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * ZYGOTE_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+    if (fd_count > 0) {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fd_count);
+    }
+    ssize_t sent;
+    do {
+        sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (sent == -1 && errno == EINTR);
+    return sent;
+}
+
+/**
+ * Split a request into NULL terminated argv and envp arrays pointing into
+ * the buffer. Returns -1 if the strings don't add up to what the header says.
+ */
+static int parse_request(char *buf, size_t len, char ***argv, char ***envp)
+{
+    struct zygote_request header;
+    if (len < sizeof(header)) {
+        return -1;
+    }
+    memcpy(&header, buf, sizeof(header));
+    size_t count = (size_t) header.argc + header.envc;
+    if (header.argc == 0 || count > len) {
+        return -1;
+    }
+
+    char **strings = malloc(sizeof(char *) * (count + 2));
+    char *next = buf + sizeof(header);
+    char *end = buf + len;
+    for (size_t i = 0; i < count; i++) {
+        char *nul = memchr(next, '\0', end - next);
+        if (nul == NULL) {
+            free(strings);
+            return -1;
+        }
+        strings[i < header.argc ? i : i + 1] = next;
+        next = nul + 1;
+    }
+    strings[header.argc] = NULL;
+    strings[count + 1] = NULL;
+    *argv = strings;
+    *envp = strings + header.argc + 1;
+    return 0;
+}
+
+//the cloned child: take on the request's directory and stdio, then exec
+static void zygote_exec(char **argv, char **envp, const int *fds)
+{
+    if (fchdir(fds[0]) == -1) {
+        _exit(126);
+    }
+    for (int i = 1; i < ZYGOTE_FDS; i++) {
+        dup2(fds[i], i - 1);
+    }
+    for (int i = 0; i < ZYGOTE_FDS; i++) {
+        if (fds[i] > STDERR_FILENO) {
+            close(fds[i]);
+        }
+    }
+    signal(SIGINT, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+    environ = envp;
+
+    TRACE_INSTANT(TRACE_EXEC, 0);
+    METRIC_INC(METRIC_EXECS);
+    execvp(argv[0], argv);
+    METRIC_INC(METRIC_EXEC_FAILURES);
+    int error = errno;
+    perror("execvp");
+    _exit(exec_status(error));
+}
+
+//serve spawn requests until the shell goes away
+static void zygote_loop(int sock)
+{
+    while (true) {
+        struct iovec iov = { .iov_base = request_buf, .iov_len = sizeof(request_buf) };
+        union {
+            char buf[CMSG_SPACE(sizeof(int) * ZYGOTE_FDS)];
+            struct cmsghdr align;
+        } control;
+        struct msghdr msg = {
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = control.buf,
+            .msg_controllen = sizeof(control.buf),
+        };
+        ssize_t len = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (len == -1 && errno == EINTR) {
+            continue;
+        } else if (len <= 0) {
+            _exit(0);
+        }
+
+        int fds[ZYGOTE_FDS];
+        size_t fd_count = 0;
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * fd_count);
+        }
+
+        struct zygote_reply reply = { .pid = -1, .error = EINVAL };
+        char **argv;
+        char **envp;
+        if (fd_count == ZYGOTE_FDS && !(msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))
+                && parse_request(request_buf, len, &argv, &envp) == 0) {
+            /* CLONE_PARENT: the child belongs to the shell, not to us */
+            pid_t child = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, NULL, NULL, 0);
+            if (child == 0) {
+                zygote_exec(argv, envp, fds);
+            }
+            reply.pid = child;
+            reply.error = child == -1 ? errno : 0;
+            free(argv);
+        }
+        for (size_t i = 0; i < fd_count; i++) {
+            close(fds[i]);
+        }
+        send_fds(sock, &reply, sizeof(reply), NULL, 0);
+    }
+}
+
+/**
+ * Fork the helper. Call this as early as possible: everything the shell has
+ * allocated by now is what every command launch pays for.
+ */
+void zygote_start(void)
+{
+    char *spawn = getenv("SWISH_SPAWN");
+    if (spawn != NULL && strcmp(spawn, "fork") == 0) {
+        return;
+    }
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+        perror("socketpair");
+        return;
+    }
+    pid_t shell = getpid();
+    pid_t helper = fork();
+    if (helper == -1) {
+        perror("fork");
+        close(sv[0]);
+        close(sv[1]);
+        return;
+    } else if (helper == 0) {
+        close(sv[0]);
+        /* Leave with the shell, and leave ^C to the commands */
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        if (getppid() != shell) {
+            _exit(0);
+        }
+        signal(SIGINT, SIG_IGN);
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        zygote_loop(sv[1]);
+    }
+    close(sv[1]);
+    zygote_fd = sv[0];
+    LOG("Zygote %d started\n", helper);
+}
+
+//give up on the helper, for example after it died
+static void zygote_lost(void)
+{
+    LOGP("Zygote lost; falling back to fork\n");
+    close(zygote_fd);
+    zygote_fd = -1;
+}
+
+/**
+ * Launch args through the helper with the current session's directory, stdio
+ * and the shell's environment. Returns the child's pid, or -1 if the helper
+ * isn't running or couldn't launch it, in which case the caller should fork
+ * as usual. The child is ours to wait for.
+ */
+pid_t zygote_spawn(char **args)
+{
+    if (zygote_fd == -1) {
+        return -1;
+    }
+
+    struct zygote_request header = { 0 };
+    size_t len = sizeof(header);
+    for (char **arg = args; *arg != NULL; arg++, header.argc++) {
+        size_t arg_len = strlen(*arg) + 1;
+        if (len + arg_len > sizeof(request_buf)) {
+            return -1;
+        }
+        memcpy(request_buf + len, *arg, arg_len);
+        len += arg_len;
+    }
+    for (char **env = environ; *env != NULL; env++, header.envc++) {
+        size_t env_len = strlen(*env) + 1;
+        if (len + env_len > sizeof(request_buf)) {
+            return -1;
+        }
+        memcpy(request_buf + len, *env, env_len);
+        len += env_len;
+    }
+    memcpy(request_buf, &header, sizeof(header));
+
+    struct session *session = session_current();
+    int cwd_fd = session->cwd_fd;
+    if (cwd_fd == -1 && (cwd_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC)) == -1) {
+        return -1;
+    }
+    int fds[ZYGOTE_FDS] = {
+        cwd_fd,
+        session->stdin_fd != -1 ? session->stdin_fd : STDIN_FILENO,
+        session->output_fd != -1 ? session->output_fd : STDOUT_FILENO,
+        session->stderr_fd != -1 ? session->stderr_fd : STDERR_FILENO,
+    };
+
+    struct zygote_reply reply = { .pid = -1 };
+    ssize_t received = -1;
+    if (send_fds(zygote_fd, request_buf, len, fds, ZYGOTE_FDS) != -1) {
+        do {
+            received = recv(zygote_fd, &reply, sizeof(reply), 0);
+        } while (received == -1 && errno == EINTR);
+    }
+    if (cwd_fd != session->cwd_fd) {
+        close(cwd_fd);
+    }
+    if (received != sizeof(reply)) {
+        zygote_lost();
+        return -1;
+    }
+    if (reply.pid == -1) {
+        errno = reply.error;
+    }
+    return reply.pid;
+}
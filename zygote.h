@@ -0,0 +1,25 @@
+/**
+ * @file
+ *
+ * ZYGOTE
+ * A small helper process, forked before readline, history and the caches are
+ * set up, that launches commands on the shell's behalf. Forking the helper
+ * copies its small address space instead of the interactive shell's, so
+ * launch latency no longer grows with the shell. Children are cloned with
+ * CLONE_PARENT, which makes them children of the shell: waitpid, SIGCHLD and
+ * the job table work exactly as they do for fork().
+ *
+ * Set SWISH_SPAWN=fork to launch everything with plain fork() instead.
+ */
+
+#ifndef _ZYGOTE_H_
+#define _ZYGOTE_H_
+
+#include <sys/types.h>
+
+#define ZYGOTE_MAX_REQUEST (128 * 1024) //argv and environment sent per spawn
+
+void zygote_start(void);
+pid_t zygote_spawn(char **);
+
+#endif